@@ -2,9 +2,14 @@
 
 #include <limits>
 #include <algorithm>
+#include <cstring>
+#include <atomic>
+#include <vector>
 
 #include "KMathCore.h"
 #include "KRay.h"
+#include "KKernels.h"
+#include "KThreadPool.h"
 
 
 namespace kt{
@@ -28,6 +33,17 @@ struct BBox
     bool valid() const { return m_min.x < m_max.x && m_min.y < m_max.y && m_min.z < m_max.z; }
     bool empty() const { return !valid(); }
     
+    float surfaceArea() const
+    {
+        // Flat boxes still have area, but boxes with nothing in them don't
+        if (m_min.x > m_max.x || m_min.y > m_max.y || m_min.z > m_max.z)
+            return 0.0f;
+        Vector extents = m_max - m_min;
+        return 2.0f * (extents.x * extents.y + extents.y * extents.z + extents.z * extents.x);
+    }
+    
+    Point center() const { return (m_min + m_max) * 0.5f; }
+    
     bool intersects(const Ray& ray, float& inout_t0, float& inout_t1) const
     {
         // Ray-box intersection, recording the distances along the ray it enters/exits
@@ -113,34 +129,78 @@ const BVHNodeFlags kSplitY = 1;
 const BVHNodeFlags kSplitZ = 2;
 const BVHNodeFlags kSplitFlags = 0x3;
 const BVHNodeFlags kLeafNode = 0x4;
-// 29 bits left over for # of prims if we ever get around to that
+// The other 29 bits hold the # of prims in a leaf node
+const unsigned int kLeafPrimCountShift = 3;
+
+
+// How BVH splits get chosen.  SAH (the default) bins the primitives along each
+// axis and picks the split the surface-area heuristic thinks is cheapest to
+// trace; midpoint just cuts the longest axis in half, which builds a lot faster
+// but makes trees that are slower to trace.
+enum BVHBuildMethod
+{
+    kBVHBuildSAH = 0,
+    kBVHBuildMidpoint
+};
+
+// Name <-> method, for the command line and the render log
+inline bool parseBVHBuildMethod(const char* name, BVHBuildMethod& outMethod)
+{
+    if (std::strcmp(name, "sah") == 0)
+        outMethod = kBVHBuildSAH;
+    else if (std::strcmp(name, "midpoint") == 0)
+        outMethod = kBVHBuildMidpoint;
+    else
+        return false;
+    return true;
+}
+
+inline const char* bvhBuildMethodName(BVHBuildMethod method)
+{
+    return method == kBVHBuildMidpoint ? "midpoint" : "sah";
+}
+
+// Number of candidate split planes (+1) the SAH build tries along each axis
+const unsigned int kSAHBins = 32;
+// Most primitives the SAH build will put in one leaf
+const unsigned int kMaxLeafPrims = 8;
+// Cost of visiting a node (its share of a wide node's SIMD box test, the
+// traversal stack bookkeeping and the cache miss), relative to testing one
+// primitive
+const float kSAHTraversalCost = 1.0f;
+// When building with a thread pool, ranges of more than this many elements
+// get binned in chunks of this size in parallel, and get their subtrees built
+// as separate tasks.  Below it the overhead isn't worth it.
+const unsigned int kParallelBuildGrain = 8192;
 
 
 // BVH node: it has a bounding box around the contents of the node, flags that
-// indicate if it's a leaf node (has no child nodes, holds a primitive) or is an
-// interior node (has two child nodes, and has a splitting axis).  Note that the
-// children nodes will always be stored consecutively, so we only have to store
-// the index to the first child node.  Also note that leaf nodes will store the
-// primitive index, but don't need the child node index (and vice-versa), so we
-// stick them in a union because the node uses either the child index or the
-// primitive index, but not both at the same time (ever).
+// indicate if it's a leaf node (has no child nodes, holds a few primitives) or
+// is an interior node (has two child nodes, and has a splitting axis).  Note
+// that the children nodes will always be stored consecutively, so we only have
+// to store the index to the first child node.  Likewise a leaf's primitives
+// are stored consecutively in the BVH's primitive list, so a leaf stores where
+// they start in the list (and the count goes in the flags).  Leaf nodes don't
+// need the child node index (and vice-versa), so we stick them in a union
+// because the node uses either the child index or the primitive index, but not
+// both at the same time (ever).
 struct BVHNode
 {
     BBox m_bbox;
     union
     {
         unsigned int m_firstChild;
-        unsigned int m_prim;
+        unsigned int m_firstPrim;
     };
     BVHNodeFlags m_flags;
     
     BVHNode() { }
-    BVHNode(const BVHNode& n) : m_bbox(n.m_bbox), m_prim(n.m_prim), m_flags(n.m_flags) { }
+    BVHNode(const BVHNode& n) : m_bbox(n.m_bbox), m_firstPrim(n.m_firstPrim), m_flags(n.m_flags) { }
     
     BVHNode& operator =(const BVHNode& n)
     {
         m_bbox = n.m_bbox;
-        m_prim = n.m_prim;
+        m_firstPrim = n.m_firstPrim;
         m_flags = n.m_flags;
         return *this;
     }
@@ -155,10 +215,77 @@ struct BVHNode
     unsigned int leftChildIndex()  const { return m_firstChild; }
     unsigned int rightChildIndex() const { return m_firstChild + 1; }
     
-    unsigned int prim() const { return m_prim; }
+    // Leaf primitives are [firstPrim, firstPrim + numPrims) in the BVH's primitive list
+    unsigned int firstPrim() const { return m_firstPrim; }
+    unsigned int numPrims()  const { return m_flags >> kLeafPrimCountShift; }
+};
+
+
+// Wide BVH width: the binary tree gets collapsed so each node has up to this
+// many children, as many as the box test kernel (see KKernels.h) takes.  It
+// doesn't depend on the instruction set, so neither does the tree.
+const unsigned int kBVHWidth = kKernelWidth;
+
+// Wide BVH child references: interior children are wide node indices, leaves
+// have the top bit set, then (# of prims - 1) in the next 3 bits, then where
+// their prims start in the BVH's primitive list.
+const unsigned int kWideLeafFlag = 0x80000000u;
+const unsigned int kWideLeafCountShift = 28;
+const unsigned int kWideLeafCountMask = 0x7u;
+const unsigned int kWideLeafPrimMask = 0x0fffffffu;
+
+
+// Wide BVH node.  The children's bboxes are stored one component at a time
+// (all the min x's together, then all the min y's, and so on) so that a ray
+// can be tested against every one of them with a handful of SIMD ops.  The
+// children are packed into the first m_numChildren slots.
+struct WideBVHNode
+{
+    WideBoxes m_bounds;
+    unsigned int m_children[kBVHWidth];
+    unsigned int m_numChildren;
+    
+    void setChild(unsigned int slot, const BBox& bbox, unsigned int child)
+    {
+        m_bounds.m_minX[slot] = bbox.m_min.x;
+        m_bounds.m_minY[slot] = bbox.m_min.y;
+        m_bounds.m_minZ[slot] = bbox.m_min.z;
+        m_bounds.m_maxX[slot] = bbox.m_max.x;
+        m_bounds.m_maxY[slot] = bbox.m_max.y;
+        m_bounds.m_maxZ[slot] = bbox.m_max.z;
+        m_children[slot] = child;
+    }
+    
+    static bool leafChild(unsigned int child)          { return (child & kWideLeafFlag) != 0; }
+    static unsigned int leafFirstPrim(unsigned int child) { return child & kWideLeafPrimMask; }
+    static unsigned int leafNumPrims(unsigned int child)
+    {
+        return ((child >> kWideLeafCountShift) & kWideLeafCountMask) + 1;
+    }
+    static unsigned int makeLeafChild(unsigned int firstPrim, unsigned int numPrims)
+    {
+        return kWideLeafFlag | ((numPrims - 1) << kWideLeafCountShift) | firstPrim;
+    }
 };
 
 
+// A ray set up for the kernels, with its inverse direction for the box tests
+inline KernelRay kernelRay(const Ray& ray, const Vector& invDir)
+{
+    KernelRay kray;
+    kray.m_origin[0] = ray.m_origin.x;
+    kray.m_origin[1] = ray.m_origin.y;
+    kray.m_origin[2] = ray.m_origin.z;
+    kray.m_direction[0] = ray.m_direction.x;
+    kray.m_direction[1] = ray.m_direction.y;
+    kray.m_direction[2] = ray.m_direction.z;
+    kray.m_invDir[0] = invDir.x;
+    kray.m_invDir[1] = invDir.y;
+    kray.m_invDir[2] = invDir.z;
+    return kray;
+}
+
+
 /*
  * BVH (bounding volume hierarchy).  This is a binary tree data spatial data
  * structure used to find ray intersections much more quickly (algorithmically
@@ -167,39 +294,103 @@ struct BVHNode
  * to two child BVH nodes.  Each node has a bounding box, which *may* overlap
  * with its sibling node.
  * 
- * This particular BVH uses spatial splits, so the trees it generates are not
- * amazingly efficient, but they're way, WAY better than nothing.  A more
- * advanced implementation would use SAH (surface-area hueristic) to pick better
- * splitting axis locations.  Those trees generally take longer to build, but
- * the time to actually trace rays through them is faster.
+ * By default the splits are picked with a binned SAH (surface-area heuristic):
+ * the odds of a ray that hits a node also hitting a child are roughly the
+ * ratio of their surface areas, so we try a handful of candidate split planes
+ * along each axis and keep the one with the smallest expected cost.  The old
+ * spatial midpoint split is still available for when build time matters more
+ * than trace time; its trees are not amazingly efficient, but they're way,
+ * WAY better than nothing.
+ * 
+ * Leaves can hold several primitives.  The SAH build makes a leaf whenever
+ * testing everything in a node directly is cheaper than splitting it any
+ * further (up to kMaxLeafPrims primitives), which saves a lot of nodes and
+ * the box tests that go with them.  The midpoint build always splits down to
+ * one primitive per leaf.
+ * 
+ * The binary tree is only used while building.  It then gets collapsed into
+ * a wide tree (kBVHWidth children per node) for tracing, pulling each node's
+ * biggest grandchildren up until it's full; rays test all of a node's child
+ * boxes at once with the SIMD kernels (see KKernels.h) and visit the hit
+ * children nearest first.
+ * 
+ * Given a thread pool, the build is spread across it: element bboxes and the
+ * SAH bins of big nodes are done in parallel chunks, and big subtrees get
+ * built as tasks of their own.  The tree comes out the same either way.
  * 
  * The template param type for the BVH must have the following methods:
  *     unsigned int numElements() const;
  *     BBox elementBBox(unsigned int index) const;
  *     float elementArea(unsigned int index) const;
- *     bool intersect(Intersection& intersection, unsigned int elementIndex);
- *     bool doesIntersect(const Ray& ray, unsigned int elementIndex);
- * The first two methods are used during building, the second two during tracing.
+ *     bool intersectLeaf(const Ray& ray, Intersection& intersection,
+ *                        const unsigned int *prims,
+ *                        unsigned int firstSlot, unsigned int numPrims);
+ *     bool doesIntersectLeaf(const Ray& ray, const unsigned int *prims,
+ *                            unsigned int firstSlot, unsigned int numPrims);
+ * The first three methods are used during building, the last two during
+ * tracing.  elementBBox() may get called from several threads at once during
+ * the build.  The leaf methods get handed all of a leaf's element indices at
+ * once, along with where they start in primOrder(); objects that lay their
+ * own data out in that order after the build can test a whole leaf from one
+ * contiguous run of memory.  intersectLeaf() only has to record the hit
+ * itself (distance, shape, primitive, barycentrics); the surface attributes
+ * can wait until the BVH's caller knows which hit is the nearest.
  */
 template<typename T>
 class BVH
 {
 public:
-    BVH(T& object);
+    BVH(T& object, BVHBuildMethod method = kBVHBuildSAH);
     
     ~BVH();
     
+    // Pick how the next build() chooses its splits
+    void setBuildMethod(BVHBuildMethod method) { m_buildMethod = method; }
+    BVHBuildMethod buildMethod() const { return m_buildMethod; }
+    
+    // Pool the next build() may spread its work across (NULL builds on the
+    // calling thread alone)
+    void setThreadPool(ThreadPool *pPool) { m_pThreadPool = pPool; }
+    
     // Call this before tracing any rays through the BVH!
     bool build();
     
+    // True if the tree was built (or restored) with the current build method
+    bool upToDate() const { return m_built && m_builtMethod == m_buildMethod; }
+    
+    // Put back a tree saved from an earlier build() over the same elements,
+    // instead of building it again.  The tree is checked for indices that
+    // are out of range (or point back up the tree), and rejected if it has
+    // any; returns false then, leaving the BVH unbuilt.
+    bool restore(const WideBVHNode *nodes, size_t numNodes,
+                 const unsigned int *prims, size_t numPrims,
+                 BVHBuildMethod builtMethod);
+    
     // Trace rays, forwarding final ray intersection logic to the object
-    bool intersect(Intersection& intersection);
+    bool intersect(const Ray& ray, Intersection& intersection);
     bool doesIntersect(const Ray& ray);
     
+    // Element indices in the order the leaves reference them (valid after
+    // build(), one entry per element)
+    const unsigned int* primOrder() const { return m_prims; }
+    
+    // The wide nodes (valid after build(); empty if there are no elements)
+    const std::vector<WideBVHNode>& wideNodes() const { return m_wideNodes; }
+    
 private:
     T& m_object;
+    // Binary nodes (only around during the build)
     BVHNode *m_nodes;
     unsigned int m_numNodes;
+    // Wide nodes we trace through; the root is the first one
+    std::vector<WideBVHNode> m_wideNodes;
+    // Primitive indices for the object, grouped so each leaf's are together
+    unsigned int *m_prims;
+    BVHBuildMethod m_buildMethod;
+    // Whether there's a tree to trace, and how it was made
+    bool m_built;
+    BVHBuildMethod m_builtMethod;
+    ThreadPool *m_pThreadPool;
     
     // A couple of helper structs for building the BVH
     
@@ -230,16 +421,69 @@ private:
         }
     };
     
+    // Build state shared by every subtree (which may be building on
+    // different threads)
+    struct BuildState
+    {
+        BuildElement *m_elements;
+        std::atomic<unsigned int> m_numNodes;
+        std::atomic<bool> m_failed;
+        // Where big subtrees get built (NULL to build everything in place)
+        TaskGroup *m_pSubtrees;
+    };
+    
+    // Element counts and bboxes in each SAH bin along each axis
+    struct SAHBins
+    {
+        BBox m_bboxes[3][kSAHBins];
+        unsigned int m_counts[3][kSAHBins];
+        
+        SAHBins() { std::fill(&m_counts[0][0], &m_counts[0][0] + 3 * kSAHBins, 0u); }
+        
+        void merge(const SAHBins& bins)
+        {
+            for (unsigned int axis = 0; axis < 3; ++axis)
+            {
+                for (unsigned int bin = 0; bin < kSAHBins; ++bin)
+                {
+                    m_bboxes[axis][bin] = m_bboxes[axis][bin].combined(bins.m_bboxes[axis][bin]);
+                    m_counts[axis][bin] += bins.m_counts[axis][bin];
+                }
+            }
+        }
+    };
+    
     // At each step of the build, this is called recursively to fill out a BVH node
-    bool buildRange(BuildElement *permutedElements,
+    bool buildRange(BuildState& state,
                     unsigned int begin, unsigned int end,
                     unsigned int nodeIndex, const BBox& nodeBBox);
+    
+    void makeLeaf(unsigned int begin, unsigned int end,
+                  unsigned int nodeIndex, const BBox& nodeBBox);
+    
+    // Make a wide node out of a binary interior node (and recursively its
+    // descendants), returning the wide node's index
+    unsigned int collapse(unsigned int nodeIndex);
+    
+    // Split choosers: each one picks an axis, partitions the range so the
+    // elements on the left of the split come first, and returns where the
+    // right side starts (which may be begin or end if it couldn't split).
+    // The SAH one also reports what it expects tracing through the split to
+    // cost, relative to testing a single primitive.
+    unsigned int splitMidpoint(BuildElement *permutedElements,
+                               unsigned int begin, unsigned int end,
+                               const BBox& nodeBBox, BVHNodeFlags& outSplit);
+    unsigned int splitSAH(BuildElement *permutedElements,
+                          unsigned int begin, unsigned int end,
+                          const BBox& nodeBBox, BVHNodeFlags& outSplit,
+                          float& outCost);
 };
 
 
 template<typename T>
-BVH<T>::BVH(T& object)
-    : m_object(object), m_nodes(NULL), m_numNodes(0)
+BVH<T>::BVH(T& object, BVHBuildMethod method)
+    : m_object(object), m_nodes(NULL), m_numNodes(0), m_wideNodes(), m_prims(NULL), m_buildMethod(method),
+      m_built(false), m_builtMethod(method), m_pThreadPool(NULL)
 {
     
 }
@@ -248,6 +492,7 @@ template<typename T>
 BVH<T>::~BVH()
 {
     if (m_nodes != NULL) delete[] m_nodes;
+    if (m_prims != NULL) delete[] m_prims;
 }
 
 template<typename T>
@@ -255,45 +500,299 @@ bool BVH<T>::build()
 {
     // Prep for the build: get primitive bboxes, indices, and set up the actual
     // BVH node storage so we can start filling it out.
+    if (m_nodes != NULL)
+    {
+        delete[] m_nodes;
+        m_nodes = NULL;
+        m_numNodes = 0;
+    }
+    if (m_prims != NULL)
+    {
+        delete[] m_prims;
+        m_prims = NULL;
+    }
+    m_wideNodes.clear();
+    m_built = false;
     unsigned int numElems = m_object.numElements();
     if (numElems == 0)
+    {
+        m_built = true;
+        m_builtMethod = m_buildMethod;
         return true;
+    }
+    // Wide leaves only have room for this many bits of primitive index
+    if (numElems > kWideLeafPrimMask)
+        return false;
     
     BuildElement *elems = new BuildElement[numElems];
+    std::vector<BBox> chunkBBoxes((numElems + kParallelBuildGrain - 1) / kParallelBuildGrain);
+    parallelFor(m_pThreadPool, 0, numElems, kParallelBuildGrain,
+                [this, elems, &chunkBBoxes](size_t chunkBegin, size_t chunkEnd)
+    {
+        BBox chunkBBox;
+        for (size_t i = chunkBegin; i < chunkEnd; ++i)
+        {
+            elems[i].m_prim = (unsigned int) i;
+            elems[i].m_bbox = m_object.elementBBox((unsigned int) i);
+            chunkBBox = chunkBBox.combined(elems[i].m_bbox);
+        }
+        chunkBBoxes[chunkBegin / kParallelBuildGrain] = chunkBBox;
+    });
     BBox totalBBox;
-    for (unsigned int i = 0; i < numElems; ++i)
+    for (size_t i = 0; i < chunkBBoxes.size(); ++i)
     {
-        elems[i].m_prim = i;
-        elems[i].m_bbox = m_object.elementBBox(i);
-        totalBBox = totalBBox.combined(elems[i].m_bbox);
+        totalBBox = totalBBox.combined(chunkBBoxes[i]);
     }
-    // There can be exactly this many BVH nodes total.  It just works.
+    // With one primitive per leaf there would be exactly this many BVH nodes
+    // total, so that's as many as there can be.
     m_nodes = new BVHNode[numElems * 2 - 1];
-    // We start with one node already set aside (the root node)
-    m_numNodes = 1;
-    // Start building (with the root node)
-    bool built = buildRange(elems, 0, numElems, 0, totalBBox);
+    // Start building (with the root node, which we start with already set
+    // aside), and wait for any subtrees that went off to other threads
+    BuildState state;
+    state.m_elements = elems;
+    state.m_numNodes = 1;
+    state.m_failed = false;
+    TaskGroup subtrees(m_pThreadPool);
+    state.m_pSubtrees = m_pThreadPool != NULL ? &subtrees : NULL;
+    bool built = buildRange(state, 0, numElems, 0, totalBBox);
+    subtrees.wait();
+    built = built && !state.m_failed;
+    m_numNodes = state.m_numNodes;
+    // Leaves refer to runs of the permuted elements; keep just their indices
+    m_prims = new unsigned int[numElems];
+    for (unsigned int i = 0; i < numElems; ++i)
+    {
+        m_prims[i] = elems[i].m_prim;
+    }
+    // Collapse into the wide tree we actually trace through.  Each wide node
+    // soaks up at least one binary interior node, usually more.
+    m_wideNodes.reserve(m_numNodes / 2 + 1);
+    if (m_nodes[0].leafNode())
+    {
+        // Just the one leaf; give it a root to hang off of
+        WideBVHNode root;
+        root.m_numChildren = 1;
+        root.setChild(0, m_nodes[0].m_bbox,
+                      WideBVHNode::makeLeafChild(m_nodes[0].firstPrim(), m_nodes[0].numPrims()));
+        m_wideNodes.push_back(root);
+    }
+    else
+    {
+        collapse(0);
+    }
     // Clean up temp help for building and get outta here
+    delete[] m_nodes;
+    m_nodes = NULL;
+    m_numNodes = 0;
     delete[] elems;
+    m_built = built;
+    m_builtMethod = m_buildMethod;
     return built;
 }
 
 template<typename T>
-bool BVH<T>::buildRange(BuildElement *permutedElements,
+bool BVH<T>::restore(const WideBVHNode *nodes, size_t numNodes,
+                     const unsigned int *prims, size_t numPrims,
+                     BVHBuildMethod builtMethod)
+{
+    if (m_nodes != NULL)
+    {
+        delete[] m_nodes;
+        m_nodes = NULL;
+        m_numNodes = 0;
+    }
+    if (m_prims != NULL)
+    {
+        delete[] m_prims;
+        m_prims = NULL;
+    }
+    m_wideNodes.clear();
+    m_built = false;
+    
+    // Same elements, every one of them in exactly one leaf slot
+    unsigned int numElems = m_object.numElements();
+    if (numPrims != numElems || (numElems == 0) != (numNodes == 0))
+        return false;
+    for (size_t i = 0; i < numPrims; ++i)
+    {
+        if (prims[i] >= numElems)
+            return false;
+    }
+    // Children always come after their parent, so this also rules out loops
+    for (size_t n = 0; n < numNodes; ++n)
+    {
+        const WideBVHNode& node = nodes[n];
+        if (node.m_numChildren == 0 || node.m_numChildren > kBVHWidth)
+            return false;
+        for (unsigned int i = 0; i < node.m_numChildren; ++i)
+        {
+            unsigned int child = node.m_children[i];
+            if (WideBVHNode::leafChild(child))
+            {
+                if (WideBVHNode::leafFirstPrim(child) + WideBVHNode::leafNumPrims(child) > numPrims)
+                    return false;
+            }
+            else if (child <= n || child >= numNodes)
+            {
+                return false;
+            }
+        }
+    }
+    
+    m_wideNodes.assign(nodes, nodes + numNodes);
+    if (numPrims > 0)
+    {
+        m_prims = new unsigned int[numPrims];
+        std::copy(prims, prims + numPrims, m_prims);
+    }
+    m_built = true;
+    m_builtMethod = builtMethod;
+    return true;
+}
+
+template<typename T>
+unsigned int BVH<T>::collapse(unsigned int nodeIndex)
+{
+    // Start with the two children, and keep opening up the interior child
+    // with the biggest surface area (the one rays are most likely to hit)
+    // until there's no more room or only leaves are left
+    unsigned int children[kBVHWidth];
+    unsigned int numChildren = 2;
+    children[0] = m_nodes[nodeIndex].leftChildIndex();
+    children[1] = m_nodes[nodeIndex].rightChildIndex();
+    while (numChildren < kBVHWidth)
+    {
+        int biggest = -1;
+        float biggestArea = -1.0f;
+        for (unsigned int i = 0; i < numChildren; ++i)
+        {
+            const BVHNode& child = m_nodes[children[i]];
+            if (child.interiorNode() && child.m_bbox.surfaceArea() > biggestArea)
+            {
+                biggest = (int) i;
+                biggestArea = child.m_bbox.surfaceArea();
+            }
+        }
+        if (biggest < 0)
+            break;
+        const BVHNode& opened = m_nodes[children[biggest]];
+        children[biggest] = opened.leftChildIndex();
+        children[numChildren++] = opened.rightChildIndex();
+    }
+    
+    // Reserve our spot before the children take theirs, then fill it in once
+    // they know where they ended up
+    unsigned int wideIndex = (unsigned int) m_wideNodes.size();
+    m_wideNodes.push_back(WideBVHNode());
+    WideBVHNode wideNode;
+    wideNode.m_numChildren = numChildren;
+    for (unsigned int i = 0; i < kBVHWidth; ++i)
+    {
+        if (i >= numChildren)
+        {
+            wideNode.setChild(i, BBox(), 0);
+            continue;
+        }
+        const BVHNode& child = m_nodes[children[i]];
+        if (child.leafNode())
+            wideNode.setChild(i, child.m_bbox, WideBVHNode::makeLeafChild(child.firstPrim(), child.numPrims()));
+        else
+            wideNode.setChild(i, child.m_bbox, collapse(children[i]));
+    }
+    m_wideNodes[wideIndex] = wideNode;
+    return wideIndex;
+}
+
+template<typename T>
+bool BVH<T>::buildRange(BuildState& state,
                         unsigned int begin, unsigned int end,
                         unsigned int nodeIndex, const BBox& nodeBBox)
 {
+    BuildElement *permutedElements = state.m_elements;
+    
     // Is there only one primitive?  If so, make this a leaf node.
     if (end - begin <= 1)
     {
-        m_nodes[nodeIndex].m_flags = kLeafNode;
-        m_nodes[nodeIndex].m_bbox = nodeBBox;
-        m_nodes[nodeIndex].m_prim = permutedElements[begin].m_prim;
+        makeLeaf(begin, end, nodeIndex, nodeBBox);
         return true;
     }
     
+    BVHNodeFlags split;
+    unsigned int splitIndex;
+    if (m_buildMethod == kBVHBuildMidpoint)
+    {
+        splitIndex = splitMidpoint(permutedElements, begin, end, nodeBBox, split);
+    }
+    else
+    {
+        // Would it be cheaper to just test everything here than to split?
+        float splitCost;
+        splitIndex = splitSAH(permutedElements, begin, end, nodeBBox, split, splitCost);
+        if (end - begin <= kMaxLeafPrims && float(end - begin) <= splitCost)
+        {
+            makeLeaf(begin, end, nodeIndex, nodeBBox);
+            return true;
+        }
+    }
+    
     // Interior node...
     
+    m_nodes[nodeIndex].m_bbox = nodeBBox;
+    m_nodes[nodeIndex].m_flags = split;
+    
+    // Peel off half of the elements if one side of the partition was empty
+    // Note: doing this makes *crappy* BVH nodes at this part of the tree, but
+    // it keeps us from generating pathologically-stupid trees instead in some
+    // difficult cases.  Better to be merely crappy than pathologically stupid.
+    if (splitIndex <= begin || splitIndex >= end)
+    {
+        splitIndex = begin + (end - begin) / 2;
+        if (splitIndex < begin + 1)
+            splitIndex = begin + 1;
+        else if (splitIndex > end - 1)
+            splitIndex = end - 1;
+    }
+    
+    // Calculate bboxes for each new child we're about to create
+    BBox leftBBox, rightBBox;
+    for (unsigned int i = begin; i < splitIndex; ++i)
+    {
+        leftBBox = leftBBox.combined(permutedElements[i].m_bbox);
+    }
+    for (unsigned int i = splitIndex; i < end; ++i)
+    {
+        rightBBox = rightBBox.combined(permutedElements[i].m_bbox);
+    }
+    
+    // Create children nodes, recurse to keep building.  A big right subtree
+    // gets handed off to another thread while we carry on with the left one
+    // (they work on separate parts of the element list and node storage).
+    unsigned int firstChild = state.m_numNodes.fetch_add(2);
+    m_nodes[nodeIndex].m_firstChild = firstChild;
+    if (state.m_pSubtrees != NULL && end - splitIndex > kParallelBuildGrain)
+    {
+        BuildState *pState = &state;
+        state.m_pSubtrees->run([this, pState, splitIndex, end, firstChild, rightBBox]()
+        {
+            if (!buildRange(*pState, splitIndex, end, firstChild + 1, rightBBox))
+                pState->m_failed = true;
+        });
+    }
+    else if (!buildRange(state, splitIndex, end, firstChild + 1, rightBBox))
+    {
+        return false;
+    }
+    if (!buildRange(state, begin, splitIndex, firstChild, leftBBox))
+        return false;
+    
+    return true;
+}
+
+template<typename T>
+unsigned int BVH<T>::splitMidpoint(BuildElement *permutedElements,
+                                   unsigned int begin, unsigned int end,
+                                   const BBox& nodeBBox, BVHNodeFlags& outSplit)
+{
     // Pick split axis
     Vector extents = nodeBBox.m_max - nodeBBox.m_min;
     BVHNodeFlags split;
@@ -308,9 +807,9 @@ bool BVH<T>::buildRange(BuildElement *permutedElements,
         split = kSplitY;
     else
         split = kSplitZ;
+    outSplit = split;
     
-    // Pick split axis location (this is a vanilla spatial split, a SAH tree
-    // build would do something more sophisticated here).
+    // Pick split axis location (this is a vanilla spatial split)
     float splitAxis;
     if (split == kSplitX)
         splitAxis = (nodeBBox.m_max.x + nodeBBox.m_min.x) * 0.5f;
@@ -319,238 +818,315 @@ bool BVH<T>::buildRange(BuildElement *permutedElements,
     else
         splitAxis = (nodeBBox.m_max.z + nodeBBox.m_min.z) * 0.5f;
     
-    m_nodes[nodeIndex].m_bbox = nodeBBox;
-    m_nodes[nodeIndex].m_flags = split;
-    
     // Separate primitives such that those on the left of the split are in the
     // earlier part of the list (for the range we're dealing with) and those on
     // the right part of the split are later part of the list.
     BuildElementPredicate pred(splitAxis, split);
     BuildElement* partitionIter = std::partition(&permutedElements[begin], (&permutedElements[0]) + end, pred);
-    unsigned int splitIndex = (unsigned int)(partitionIter - (&permutedElements[0]));
+    return (unsigned int)(partitionIter - (&permutedElements[0]));
+}
+
+template<typename T>
+void BVH<T>::makeLeaf(unsigned int begin, unsigned int end,
+                      unsigned int nodeIndex, const BBox& nodeBBox)
+{
+    m_nodes[nodeIndex].m_flags = kLeafNode | ((end - begin) << kLeafPrimCountShift);
+    m_nodes[nodeIndex].m_bbox = nodeBBox;
+    m_nodes[nodeIndex].m_firstPrim = begin;
+}
+
+template<typename T>
+unsigned int BVH<T>::splitSAH(BuildElement *permutedElements,
+                              unsigned int begin, unsigned int end,
+                              const BBox& nodeBBox, BVHNodeFlags& outSplit,
+                              float& outCost)
+{
+    // Big ranges get binned in chunks spread across the pool; small ones
+    // just get done right here as a single chunk
+    ThreadPool *pPool = end - begin > kParallelBuildGrain ? m_pThreadPool : NULL;
+    size_t numChunks = (end - begin + kParallelBuildGrain - 1) / kParallelBuildGrain;
     
-    // Peel off half of the elements if one side of the partition was empty
-    // Note: doing this makes *crappy* BVH nodes at this part of the tree, but
-    // it keeps us from generating pathologically-stupid trees instead in some
-    // difficult cases.  Better to be merely crappy than pathologically stupid.
-    if (splitIndex <= begin || splitIndex >= end)
+    // Bin by bbox centers rather than the bboxes themselves, so every element
+    // lands in exactly one bin
+    std::vector<BBox> chunkCenterBBoxes(numChunks);
+    parallelFor(pPool, begin, end, kParallelBuildGrain,
+                [permutedElements, begin, &chunkCenterBBoxes](size_t chunkBegin, size_t chunkEnd)
     {
-        splitIndex = begin + (end - begin) / 2;
-        if (splitIndex < begin + 1)
-            splitIndex = begin + 1;
-        else if (splitIndex > end - 1)
-            splitIndex = end - 1;
+        BBox chunkCenterBBox;
+        for (size_t i = chunkBegin; i < chunkEnd; ++i)
+        {
+            chunkCenterBBox.expand(permutedElements[i].m_bbox.center());
+        }
+        chunkCenterBBoxes[(chunkBegin - begin) / kParallelBuildGrain] = chunkCenterBBox;
+    });
+    BBox centerBBox;
+    for (size_t i = 0; i < numChunks; ++i)
+    {
+        centerBBox = centerBBox.combined(chunkCenterBBoxes[i]);
+    }
+    Vector centerExtents = centerBBox.m_max - centerBBox.m_min;
+    float binScales[3];
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        binScales[axis] = centerExtents[axis] > 0.0f ? kSAHBins / centerExtents[axis] : 0.0f;
     }
     
-    // Calculate bboxes for each new child we're about to create
-    BBox leftBBox, rightBBox;
-    for (unsigned int i = begin; i < splitIndex; ++i)
+    // Drop every element into a bin along each axis
+    std::vector<SAHBins> chunkBins(numChunks);
+    parallelFor(pPool, begin, end, kParallelBuildGrain,
+                [permutedElements, begin, &centerBBox, &binScales, &chunkBins](size_t chunkBegin, size_t chunkEnd)
     {
-        leftBBox = leftBBox.combined(permutedElements[i].m_bbox);
+        SAHBins& bins = chunkBins[(chunkBegin - begin) / kParallelBuildGrain];
+        for (size_t i = chunkBegin; i < chunkEnd; ++i)
+        {
+            Point center = permutedElements[i].m_bbox.center();
+            for (unsigned int axis = 0; axis < 3; ++axis)
+            {
+                unsigned int bin = (unsigned int)((center[axis] - centerBBox.m_min[axis]) * binScales[axis]);
+                if (bin >= kSAHBins)
+                    bin = kSAHBins - 1;
+                bins.m_counts[axis][bin]++;
+                bins.m_bboxes[axis][bin] = bins.m_bboxes[axis][bin].combined(permutedElements[i].m_bbox);
+            }
+        }
+    });
+    for (size_t i = 1; i < numChunks; ++i)
+    {
+        chunkBins[0].merge(chunkBins[i]);
     }
-    for (unsigned int i = splitIndex; i < end; ++i)
+    const SAHBins& bins = chunkBins[0];
+    
+    // Try each axis, keeping the cheapest split.  The cost of a split is the
+    // number of elements on each side weighted by the side's surface area;
+    // the node's own area is the same for every candidate, so it drops out.
+    float bestCost = std::numeric_limits<float>::max();
+    unsigned int bestAxis = 0;
+    unsigned int bestBin = 0;
+    for (unsigned int axis = 0; axis < 3; ++axis)
     {
-        rightBBox = rightBBox.combined(permutedElements[i].m_bbox);
+        if (!(centerExtents[axis] > 0.0f))
+            continue;
+        const BBox *binBBoxes = bins.m_bboxes[axis];
+        const unsigned int *binCounts = bins.m_counts[axis];
+        
+        // Sweep from the right to get the area and count to the right of each
+        // plane, then from the left to score each plane
+        float rightAreas[kSAHBins];
+        unsigned int rightCounts[kSAHBins];
+        BBox rightBBox;
+        unsigned int rightCount = 0;
+        for (unsigned int bin = kSAHBins - 1; bin > 0; --bin)
+        {
+            rightBBox = rightBBox.combined(binBBoxes[bin]);
+            rightCount += binCounts[bin];
+            rightAreas[bin] = rightBBox.surfaceArea();
+            rightCounts[bin] = rightCount;
+        }
+        BBox leftBBox;
+        unsigned int leftCount = 0;
+        for (unsigned int bin = 1; bin < kSAHBins; ++bin)
+        {
+            leftBBox = leftBBox.combined(binBBoxes[bin - 1]);
+            leftCount += binCounts[bin - 1];
+            if (leftCount == 0 || rightCounts[bin] == 0)
+                continue;
+            float cost = leftCount * leftBBox.surfaceArea() + rightCounts[bin] * rightAreas[bin];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = bin;
+            }
+        }
     }
     
-    // Create children nodes, recurse to keep building
-    m_nodes[nodeIndex].m_firstChild = m_numNodes;
-    m_numNodes += 2;
-    if (!buildRange(permutedElements, begin, splitIndex, m_nodes[nodeIndex].m_firstChild, leftBBox))
-        return false;
-    if (!buildRange(permutedElements, splitIndex, end, m_nodes[nodeIndex].m_firstChild + 1, rightBBox))
-        return false;
+    if (bestBin == 0)
+    {
+        outCost = std::numeric_limits<float>::max();
+        // Every element has the same center (or no plane separated anything),
+        // so there's nothing for SAH to go on; fall back to a midpoint split,
+        // and the caller cuts the range in half if that doesn't work either.
+        return splitMidpoint(permutedElements, begin, end, nodeBBox, outSplit);
+    }
     
-    return true;
+    // Turn the area-weighted counts into an expected cost: a ray that hits
+    // this node hits each child with a probability of the area ratio
+    float nodeArea = nodeBBox.surfaceArea();
+    outCost = nodeArea > 0.0f ? kSAHTraversalCost + bestCost / nodeArea
+                              : std::numeric_limits<float>::max();
+    
+    // Elements in bins past the chosen plane go on the left (first) side,
+    // same as the midpoint split, since traversal relies on the left child
+    // being the one further along the split axis
+    outSplit = (BVHNodeFlags) bestAxis;
+    float axisMin = centerBBox.m_min[bestAxis];
+    float binScale = binScales[bestAxis];
+    unsigned int splitIndex = begin;
+    for (unsigned int i = begin; i < end; ++i)
+    {
+        unsigned int bin = (unsigned int)((permutedElements[i].m_bbox.center()[bestAxis] - axisMin) * binScale);
+        if (bin >= kSAHBins)
+            bin = kSAHBins - 1;
+        if (bin >= bestBin)
+        {
+            std::swap(permutedElements[i], permutedElements[splitIndex]);
+            splitIndex++;
+        }
+    }
+    return splitIndex;
 }
 
 // Arbitrary limit on tree depth; there can be 2^32 nodes, or 2^31 prims implying
-// a max depth of 32, but the trees are not perfectly balanced, so we add some
-// slack that hopefully will suffice.
-const unsigned int kMaxTraversalSteps = 50;
+// a max depth of 32, but the trees are not perfectly balanced (SAH trees in
+// particular happily go lopsided around dense detail), so we add some slack
+// that hopefully will suffice.
+const unsigned int kMaxTraversalDepth = 64;
+// Each wide node visited can leave all but one of its children waiting
+const unsigned int kMaxTraversalSteps = kMaxTraversalDepth * (kBVHWidth - 1) + 1;
 
-// Temporary data used during traversal to remember a node we need to potentially
-// still visit and examine for intersection.
+// Temporary data used during traversal to remember a child we need to
+// potentially still visit and examine for intersection, and the distance
+// along the ray where we enter it.
 struct TraversalStep
 {
-    unsigned int m_nodeIndex;
-    float m_t0, m_t1;
+    unsigned int m_child;
+    float m_t0;
 };
 
 template<typename T>
 bool BVH<T>::doesIntersect(const Ray& ray)
 {
+    if (m_wideNodes.empty())
+        return false;
+    
     // Ray-bbox intersection uses the inverse direction (for performance reasons)
     Vector invDir(1.0f / ray.m_direction);
+    KernelRay kray = kernelRay(ray, invDir);
+    const Kernels& k = kernels();
     
-    // In order to find which child is "closer" along the ray we have to know
-    // which direction the ray is going relative to each BVH node's spliting axis
-    bool dirSigns[3] =
-    {
-        invDir.x < 0.0f,
-        invDir.y < 0.0f,
-        invDir.z < 0.0f
-    };
-    
-    // Maintain a list of nodes we need to examine, and the enter/exit distances
-    // along the ray they live in.
+    // Maintain a list of children we need to examine.  Since we only care if
+    // *something* intersected at all, we don't bother sorting them.
     TraversalStep steps[kMaxTraversalSteps];
-    // Start with the root node (if we have one)
-    unsigned int numSteps = (m_nodes != NULL && m_numNodes > 0) ? 1 : 0;
-    steps[0].m_nodeIndex = 0;
-    steps[0].m_t0 = kRayTMin;
-    steps[0].m_t1 = ray.m_tMax;
-
-    // Process pending nodes until we run out
-    while (numSteps > 0 && numSteps <= kMaxTraversalSteps)
+    unsigned int numSteps = 0;
+    unsigned int nodeIndex = 0;
+    float tNear[kBVHWidth];
+    for (;;)
     {
-        unsigned int step = numSteps - 1;
-        const BVHNode& node = m_nodes[steps[step].m_nodeIndex];
-        
-        // Test prim if this is a prim node
-        if (node.leafNode())
+        // Test every child of the node at once, and queue up the ones we hit
+        const WideBVHNode& node = m_wideNodes[nodeIndex];
+        unsigned int hitMask = k.intersectBoxes(node.m_bounds, node.m_numChildren,
+                                                  kray, kRayTMin, ray.m_tMax, tNear);
+        for (unsigned int i = 0; hitMask != 0; ++i, hitMask >>= 1)
         {
-            if (m_object.doesIntersect(ray, node.m_prim))
+            if ((hitMask & 1) != 0 && numSteps < kMaxTraversalSteps)
             {
-                return true;
+                steps[numSteps].m_child = node.m_children[i];
+                steps[numSteps].m_t0 = tNear[i];
+                numSteps++;
             }
-            // Done with this prim node
-            numSteps--;
-            continue;
-        }
-        
-        // Test ray against node bbox, adjusting ranges back if possible based
-        // on previous near intersections
-        float t0 = steps[step].m_t0;
-        float t1 = steps[step].m_t1;
-        if (!node.m_bbox.intersects(ray.m_origin, invDir, t0, t1))
-        {
-            // Ray misses the bbox, skip the node
-            numSteps--;
-            continue;
         }
         
-        // Find which child node is closest
-        // NOTE: it's not unreasonable to skip this check and just pick
-        // an order, since we only care if *something* intersected at all, but
-        // we leave the ordering in the hopes that closer objects will be more
-        // frequently hit along the ray.
-        unsigned int closestNode, furthestNode;
-        if (dirSigns[node.split()] == false)
-        {
-            furthestNode = node.leftChildIndex();
-            closestNode = node.rightChildIndex();
-        }
-        else
+        // Work through queued children until we find another node to open up
+        bool foundNode = false;
+        while (numSteps > 0 && !foundNode)
         {
-            closestNode = node.leftChildIndex();
-            furthestNode = node.rightChildIndex();
+            unsigned int child = steps[--numSteps].m_child;
+            if (!WideBVHNode::leafChild(child))
+            {
+                nodeIndex = child;
+                foundNode = true;
+                continue;
+            }
+            // Test prims in this leaf
+            unsigned int firstPrim = WideBVHNode::leafFirstPrim(child);
+            if (m_object.doesIntersectLeaf(ray, m_prims + firstPrim, firstPrim,
+                                           WideBVHNode::leafNumPrims(child)))
+            {
+                return true;
+            }
         }
-        
-        // Replace current step with furthest child
-        steps[step].m_nodeIndex = furthestNode;
-        steps[step].m_t0 = t0;
-        steps[step].m_t1 = t1;
-        // Push closest child as the next step to evaluate
-        numSteps++;
-        step++;
-        steps[step].m_nodeIndex = closestNode;
-        steps[step].m_t0 = t0;
-        steps[step].m_t1 = t1;
-    }
-    return false;
+        if (!foundNode)
+            return false;
+    }
 }
 
 template<typename T>
-bool BVH<T>::intersect(Intersection& intersection)
+bool BVH<T>::intersect(const Ray& ray, Intersection& intersection)
 {
-    // Ray-bbox intersection uses the inverse direction (for performance reasons)
-    Vector invDir(1.0f / intersection.m_ray.m_direction);
+    if (m_wideNodes.empty())
+        return false;
     
-    // In order to find which child is "closer" along the ray we have to know
-    // which direction the ray is going relative to each BVH node's spliting axis
-    bool dirSigns[3] =
-    {
-        invDir.x < 0.0f,
-        invDir.y < 0.0f,
-        invDir.z < 0.0f
-    };
+    // Ray-bbox intersection uses the inverse direction (for performance reasons)
+    Vector invDir(1.0f / ray.m_direction);
+    KernelRay kray = kernelRay(ray, invDir);
+    const Kernels& k = kernels();
     
-    // Maintain a list of nodes we need to examine, and the enter/exit distances
-    // along the ray they live in.  We use the enter/exit information as we go
-    // to find out if a node to be examined goes out of range, since a nearer
-    // intersection may have already been found.  It allows us to skip nodes
-    // quickly as they get out of range.
+    // Maintain a list of children we need to examine, and the distance along
+    // the ray we enter them.  We use that as we go to find out if a child to
+    // be examined goes out of range, since a nearer intersection may have
+    // already been found.  It allows us to skip children quickly as they get
+    // out of range.
     TraversalStep steps[kMaxTraversalSteps];
-    // Start with the root node (if we have one)
-    unsigned int numSteps = (m_nodes != NULL && m_numNodes > 0) ? 1 : 0;
-    steps[0].m_nodeIndex = 0;
-    steps[0].m_t0 = kRayTMin;
-    steps[0].m_t1 = intersection.m_t;
-
-    // Process pending nodes until we run out
+    unsigned int numSteps = 0;
+    unsigned int nodeIndex = 0;
+    float tNear[kBVHWidth];
     bool intersected = false;
-    while (numSteps > 0 && numSteps <= kMaxTraversalSteps)
+    for (;;)
     {
-        unsigned int step = numSteps - 1;
-        const BVHNode& node = m_nodes[steps[step].m_nodeIndex];
+        // Test every child of the node at once (only out to the nearest hit
+        // so far)
+        const WideBVHNode& node = m_wideNodes[nodeIndex];
+        unsigned int hitMask = k.intersectBoxes(node.m_bounds, node.m_numChildren,
+                                                  kray, kRayTMin, intersection.m_t, tNear);
         
-        // Test prim if this is a prim node
-        if (node.leafNode())
+        // Queue up the children we hit, furthest first, so the nearest one is
+        // next to come off the list (that way we find near intersections
+        // early, and can skip more of what's behind them)
+        unsigned int firstNewStep = numSteps;
+        for (unsigned int i = 0; hitMask != 0; ++i, hitMask >>= 1)
         {
-            if (m_object.intersect(intersection, node.m_prim))
+            if ((hitMask & 1) == 0 || numSteps >= kMaxTraversalSteps)
+                continue;
+            // Insertion sort by decreasing entry distance (there's only a
+            // handful of them)
+            unsigned int step = numSteps++;
+            while (step > firstNewStep && steps[step - 1].m_t0 < tNear[i])
             {
-                intersected = true;
+                steps[step] = steps[step - 1];
+                step--;
             }
-            // Done with this prim node
-            numSteps--;
-            continue;
+            steps[step].m_child = node.m_children[i];
+            steps[step].m_t0 = tNear[i];
         }
         
-        // Test ray against node bbox, adjusting ranges back if possible based
-        // on previous near intersections
-        float t0 = steps[step].m_t0;
-        float t1 = steps[step].m_t1;
-        if (t0 >= intersection.m_t)
+        // Work through queued children until we find another node to open up
+        bool foundNode = false;
+        while (numSteps > 0 && !foundNode)
         {
-            // Previous near intersection was closer than this entire node, skip it
-            numSteps--;
-            continue;
-        }
-        if (t1 > intersection.m_t)
-            t1 = intersection.m_t;
-        if (!node.m_bbox.intersects(intersection.m_ray.m_origin, invDir, t0, t1))
-        {
-            // Ray misses the bbox, skip the node
-            numSteps--;
-            continue;
-        }
-        
-        // Find which child node is closest
-        unsigned int closestNode, furthestNode;
-        if (dirSigns[node.split()] == false)
-        {
-            furthestNode = node.leftChildIndex();
-            closestNode = node.rightChildIndex();
-        }
-        else
-        {
-            closestNode = node.leftChildIndex();
-            furthestNode = node.rightChildIndex();
+            const TraversalStep& step = steps[--numSteps];
+            if (step.m_t0 >= intersection.m_t)
+            {
+                // Previous near intersection was closer than this entire child, skip it
+                continue;
+            }
+            unsigned int child = step.m_child;
+            if (!WideBVHNode::leafChild(child))
+            {
+                nodeIndex = child;
+                foundNode = true;
+                continue;
+            }
+            // Test prims in this leaf
+            unsigned int firstPrim = WideBVHNode::leafFirstPrim(child);
+            if (m_object.intersectLeaf(ray, intersection, m_prims + firstPrim, firstPrim,
+                                       WideBVHNode::leafNumPrims(child)))
+            {
+                intersected = true;
+            }
         }
-        
-        // Replace current step with furthest child
-        steps[step].m_nodeIndex = furthestNode;
-        steps[step].m_t0 = t0;
-        steps[step].m_t1 = t1;
-        // Push closest child as the next step to evaluate
-        numSteps++;
-        step++;
-        steps[step].m_nodeIndex = closestNode;
-        steps[step].m_t0 = t0;
-        steps[step].m_t1 = t1;
-    }
-    return intersected;
+        if (!foundNode)
+            return intersected;
+    }
 }
 
 
@@ -0,0 +1,200 @@
+
+#include <cstring>
+#include <algorithm>
+
+#include "KBucket.h"
+
+
+namespace kt{
+
+bool parseBucketOrder(const char* name, BucketOrder& outOrder)
+{
+    if (std::strcmp(name, "scanline") == 0)
+        outOrder = kBucketScanline;
+    else if (std::strcmp(name, "spiral") == 0)
+        outOrder = kBucketSpiral;
+    else if (std::strcmp(name, "hilbert") == 0)
+        outOrder = kBucketHilbert;
+    else
+        return false;
+    return true;
+}
+
+const char* bucketOrderName(BucketOrder order)
+{
+    switch (order)
+    {
+    case kBucketSpiral:  return "spiral";
+    case kBucketHilbert: return "hilbert";
+    default:             return "scanline";
+    }
+}
+
+// Map a distance along a Hilbert curve filling an n x n grid (n a power of
+// two) to the grid cell at that distance.
+static void hilbertToGrid(size_t n, size_t d, size_t& outX, size_t& outY)
+{
+    size_t x = 0, y = 0;
+    for (size_t s = 1; s < n; s *= 2)
+    {
+        size_t rx = 1 & (d / 2);
+        size_t ry = 1 & (d ^ rx);
+        // Rotate/flip the quadrant so the sub-curves join up end to end
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+        x += s * rx;
+        y += s * ry;
+        d /= 4;
+    }
+    outX = x;
+    outY = y;
+}
+
+void makeBuckets(size_t width,
+                 size_t height,
+                 size_t bucketSize,
+                 BucketOrder order,
+                 std::vector<Bucket>& outBuckets)
+{
+    outBuckets.clear();
+    if (width == 0 || height == 0)
+        return;
+    if (bucketSize == 0)
+        bucketSize = 1;
+
+    // Number of buckets across and down (rounding up to cover the edges)
+    size_t xBuckets = (width + bucketSize - 1) / bucketSize;
+    size_t yBuckets = (height + bucketSize - 1) / bucketSize;
+    outBuckets.reserve(xBuckets * yBuckets);
+
+    // Build the list of bucket grid cells in the requested order
+    std::vector<size_t> cells;
+    cells.reserve(xBuckets * yBuckets);
+    if (order == kBucketSpiral)
+    {
+        // Walk outward from the center bucket: right 1, down 1, left 2, up 2,
+        // right 3, ... keeping the cells that land inside the grid.
+        const long dx[4] = { 1, 0, -1, 0 };
+        const long dy[4] = { 0, 1, 0, -1 };
+        long x = long(xBuckets - 1) / 2;
+        long y = long(yBuckets - 1) / 2;
+        size_t leg = 1;
+        size_t dir = 0;
+        cells.push_back(y * xBuckets + x);
+        while (cells.size() < xBuckets * yBuckets)
+        {
+            for (int repeat = 0; repeat < 2; ++repeat)
+            {
+                for (size_t i = 0; i < leg; ++i)
+                {
+                    x += dx[dir];
+                    y += dy[dir];
+                    if (x >= 0 && y >= 0 && x < long(xBuckets) && y < long(yBuckets))
+                        cells.push_back(y * xBuckets + x);
+                }
+                dir = (dir + 1) % 4;
+            }
+            leg++;
+        }
+    }
+    else if (order == kBucketHilbert)
+    {
+        // Run a Hilbert curve over the smallest power-of-two square that
+        // covers the grid, skipping the cells that fall outside of it.
+        size_t n = 1;
+        while (n < xBuckets || n < yBuckets)
+            n *= 2;
+        for (size_t d = 0; d < n * n; ++d)
+        {
+            size_t x, y;
+            hilbertToGrid(n, d, x, y);
+            if (x < xBuckets && y < yBuckets)
+                cells.push_back(y * xBuckets + x);
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < xBuckets * yBuckets; ++i)
+            cells.push_back(i);
+    }
+
+    // Turn grid cells into pixel ranges (making sure the edge buckets don't
+    // go off the end of the image)
+    for (size_t i = 0; i < cells.size(); ++i)
+    {
+        size_t xc = cells[i] % xBuckets;
+        size_t yc = cells[i] / xBuckets;
+        outBuckets.push_back(Bucket(xc * bucketSize,
+                                    std::min((xc + 1) * bucketSize, width),
+                                    yc * bucketSize,
+                                    std::min((yc + 1) * bucketSize, height)));
+    }
+}
+
+
+BucketScheduler::BucketScheduler(const std::vector<Bucket>& buckets, size_t numWorkers)
+    : m_queues()
+{
+    if (numWorkers == 0)
+        numWorkers = 1;
+    m_queues.reserve(numWorkers);
+    for (size_t i = 0; i < numWorkers; ++i)
+    {
+        m_queues.push_back(new WorkerQueue);
+    }
+    // Deal the buckets out like cards so every worker starts near the
+    // beginning of the order
+    for (size_t i = 0; i < buckets.size(); ++i)
+    {
+        m_queues[i % numWorkers]->m_buckets.push_back(buckets[i]);
+    }
+}
+
+BucketScheduler::~BucketScheduler()
+{
+    for (size_t i = 0; i < m_queues.size(); ++i)
+    {
+        delete m_queues[i];
+    }
+}
+
+bool BucketScheduler::next(size_t workerIndex, Bucket& outBucket)
+{
+    size_t numQueues = m_queues.size();
+    workerIndex %= numQueues;
+
+    // Our own queue first, oldest bucket first
+    {
+        WorkerQueue& queue = *m_queues[workerIndex];
+        std::unique_lock<std::mutex> lock(queue.m_mutex);
+        if (!queue.m_buckets.empty())
+        {
+            outBucket = queue.m_buckets.front();
+            queue.m_buckets.pop_front();
+            return true;
+        }
+    }
+
+    // Nothing left for us; steal from the far end of the other queues
+    for (size_t i = 1; i < numQueues; ++i)
+    {
+        WorkerQueue& victim = *m_queues[(workerIndex + i) % numQueues];
+        std::unique_lock<std::mutex> lock(victim.m_mutex);
+        if (!victim.m_buckets.empty())
+        {
+            outBucket = victim.m_buckets.back();
+            victim.m_buckets.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace kt
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <mutex>
+
+
+namespace kt{
+
+//
+// Buckets (small rectangular pieces of the image that get rendered as a unit)
+//
+struct Bucket
+{
+    // Pixel range covered by the bucket, [start, end) in each dimension
+    size_t m_xstart, m_xend, m_ystart, m_yend;
+
+    Bucket() : m_xstart(0), m_xend(0), m_ystart(0), m_yend(0) { }
+    Bucket(size_t xstart, size_t xend, size_t ystart, size_t yend)
+        : m_xstart(xstart), m_xend(xend), m_ystart(ystart), m_yend(yend) { }
+};
+
+
+// Order buckets are handed out in.  Scanline goes row by row from the top,
+// spiral starts in the middle of the frame (where the subject usually is) and
+// works outward, and Hilbert follows a space-filling curve so consecutive
+// buckets stay close together on screen and in the caches.
+enum BucketOrder
+{
+    kBucketScanline = 0,
+    kBucketSpiral,
+    kBucketHilbert
+};
+
+// Name <-> order, for the command line and the render log
+bool parseBucketOrder(const char* name, BucketOrder& outOrder);
+const char* bucketOrderName(BucketOrder order);
+
+// Chop a width x height image into bucketSize x bucketSize buckets (the ones
+// on the right and bottom edges may be smaller), listed in the given order
+void makeBuckets(size_t width,
+                 size_t height,
+                 size_t bucketSize,
+                 BucketOrder order,
+                 std::vector<Bucket>& outBuckets);
+
+
+//
+// Work-stealing bucket scheduler
+//
+// Each worker gets its own queue of buckets, dealt out round-robin so that
+// the frame as a whole still fills in roughly in bucket order.  A worker
+// takes buckets from the front of its own queue, and once that runs dry it
+// steals from the back of somebody else's.  That way no core sits idle while
+// there's still work left anywhere in the frame, no matter how unevenly the
+// expensive parts of the scene are spread across the image.
+class BucketScheduler
+{
+public:
+    BucketScheduler(const std::vector<Bucket>& buckets, size_t numWorkers);
+
+    ~BucketScheduler();
+
+    size_t numWorkers() const { return m_queues.size(); }
+
+    // Fetch the next bucket for a worker; returns false once every bucket in
+    // the frame has been handed out.
+    bool next(size_t workerIndex, Bucket& outBucket);
+
+private:
+    struct WorkerQueue
+    {
+        std::mutex m_mutex;
+        std::deque<Bucket> m_buckets;
+    };
+
+    std::vector<WorkerQueue*> m_queues;
+
+    // Not copyable
+    BucketScheduler(const BucketScheduler&);
+    BucketScheduler& operator =(const BucketScheduler&);
+};
+
+} // namespace kt
@@ -62,13 +62,31 @@ protected:
 //
 // Image (collection of colored pixels with a width x height)
 //
+// Besides the displayable pixels, the image keeps a running sum of all the
+// radiance samples taken in each pixel along with how many there were, so a
+// render can keep adding samples (pass after pass) and resolve the current
+// estimate whenever it likes.  It also sums the squared sample luminance,
+// which gives a variance estimate for adaptive sampling, and can flag pixels
+// as converged so renders skip them.
 class Image
 {
 public:
-    Image(size_t width, size_t height)
-        : m_width(width), m_height(height), m_pixels(new Color[width * height]) { }
+    Image(size_t width, size_t height): 
+        m_width(width), m_height(height),
+        m_pixels(new Color[width * height]),
+        m_sampleSums(new Color[width * height]),
+        m_sampleCounts(new unsigned int[width * height]()),
+        m_lumSquareSums(new float[width * height]()),
+        m_converged(new bool[width * height]()) { }
     
-    virtual ~Image() { delete[] m_pixels; }
+    virtual ~Image()
+    {
+        delete[] m_pixels;
+        delete[] m_sampleSums;
+        delete[] m_sampleCounts;
+        delete[] m_lumSquareSums;
+        delete[] m_converged;
+    }
     
     size_t width()  const { return m_width; }
     size_t height() const { return m_height; }
@@ -78,9 +96,64 @@ public:
         return m_pixels[y * m_width + x];
     }
     
+    // Accumulate a batch of samples (their summed radiance, and the sum of
+    // each sample's luminance squared) into a pixel
+    void addSamples(size_t x, size_t y,
+                    const Color& sampleSum,
+                    float lumSquareSum,
+                    unsigned int numSamples)
+    {
+        m_sampleSums[y * m_width + x] += sampleSum;
+        m_lumSquareSums[y * m_width + x] += lumSquareSum;
+        m_sampleCounts[y * m_width + x] += numSamples;
+    }
+    
+    unsigned int sampleCount(size_t x, size_t y) const
+    {
+        return m_sampleCounts[y * m_width + x];
+    }
+    
+    // Current estimate for the pixel: the mean of all samples taken so far
+    Color estimate(size_t x, size_t y) const
+    {
+        unsigned int count = m_sampleCounts[y * m_width + x];
+        return count > 0 ? m_sampleSums[y * m_width + x] / float(count) : Color();
+    }
+    
+    // Sample variance of the luminance of the pixel's samples
+    float variance(size_t x, size_t y) const
+    {
+        unsigned int count = m_sampleCounts[y * m_width + x];
+        if (count < 2)
+            return 0.0f;
+        float mean = m_sampleSums[y * m_width + x].luminance() / count;
+        float meanSquare = m_lumSquareSums[y * m_width + x] / count;
+        // Round-off can push this a hair below zero for very flat pixels
+        return std::max(0.0f, (meanSquare - mean * mean) * count / (count - 1));
+    }
+    
+    bool converged(size_t x, size_t y) const { return m_converged[y * m_width + x]; }
+    void setConverged(size_t x, size_t y, bool converged) { m_converged[y * m_width + x] = converged; }
+    
+    // Copy the current estimate of every pixel into the displayable pixels
+    void resolve()
+    {
+        for (size_t y = 0; y < m_height; ++y)
+        {
+            for (size_t x = 0; x < m_width; ++x)
+            {
+                m_pixels[y * m_width + x] = estimate(x, y);
+            }
+        }
+    }
+    
 protected:
     size_t m_width, m_height;
     Color *m_pixels;
+    Color *m_sampleSums;
+    unsigned int *m_sampleCounts;
+    float *m_lumSquareSums;
+    bool *m_converged;
 };
 
 } // namespace kt
\ No newline at end of file
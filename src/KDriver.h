@@ -4,6 +4,9 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <vector>
+
+#include "KKernels.h"
 
 namespace kt{
 
@@ -26,19 +29,14 @@ void ppm_driver(Image *image, const char *outfile)
     std::ofstream fileStream(outfile, std::ios::out | std::ios::binary);
     fileStream << headerStream.str();
 
-    // for each row...
-    for (size_t y = 0; y < kHeight; ++y)
+    // The whole image goes out in one write, quantized by the kernels (see
+    // KKernels.h)
+    std::vector<unsigned char> rgb(kWidth * kHeight * 3);
+    if (!rgb.empty())
     {
-        // for each pixel across the row...
-        for (size_t x = 0; x < kWidth; ++x)
-        {
-            unsigned char r, g, b;
-            Color pixelColor = image->pixel(x,y);
-            r = static_cast<unsigned char>(pixelColor.r * 255.0f);
-            g = static_cast<unsigned char>(pixelColor.g * 255.0f);
-            b = static_cast<unsigned char>(pixelColor.b * 255.0f);
-            fileStream << r << g << b;
-        }
+        kernels().quantizePixels(&image->pixel(0, 0).r, sizeof(Color) / sizeof(float),
+                                 kWidth * kHeight, &rgb[0]);
+        fileStream.write(reinterpret_cast<const char*>(&rgb[0]), rgb.size());
     }
 
     fileStream.flush();
@@ -0,0 +1,1029 @@
+
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <iostream>
+
+#include "KGeoReader.h"
+#include "KMappedFile.h"
+#include "KMeshCache.h"
+
+
+namespace kt{
+
+//
+// Tokenizing helpers.  These all work on a [p, end) range of the mapped file,
+// moving p past whatever they consume.
+//
+
+static inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static inline bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static inline void skipSpaces(const char*& p, const char *end)
+{
+    while (p < end && isSpace(*p))
+        ++p;
+}
+
+static inline const char* findLineEnd(const char *p, const char *end)
+{
+    const char *newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    return newline != NULL ? newline : end;
+}
+
+// Parse a (possibly signed) integer; returns false if there isn't one
+static inline bool parseInt(const char*& p, const char *end, int& outValue)
+{
+    const char *q = p;
+    bool negative = false;
+    if (q < end && (*q == '-' || *q == '+'))
+    {
+        negative = *q == '-';
+        ++q;
+    }
+    if (q >= end || !isDigit(*q))
+        return false;
+    long long value = 0;
+    while (q < end && isDigit(*q))
+    {
+        if (value < 0x7fffffffLL)
+            value = value * 10 + (*q - '0');
+        ++q;
+    }
+    if (value > 0x7fffffffLL)
+        value = 0x7fffffffLL;
+    outValue = int(negative ? -value : value);
+    p = q;
+    return true;
+}
+
+// Exact powers of ten (every one of them fits in a double's mantissa)
+static const double kPowersOfTen[] =
+{
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Parse a float; returns false if there isn't one.  The common case (up to
+// 15 or so significant digits and a modest exponent) is done here: the digits
+// and the power of ten are both exact in a double, so one multiply or divide
+// gives the correctly rounded result.  Anything fancier (long mantissas, huge
+// exponents) goes through strtof().  Like reading floats from a stream, there
+// is no inf or nan.
+static inline bool parseFloat(const char*& p, const char *end, float& outValue)
+{
+    const char *start = p;
+    const char *q = p;
+    bool negative = false;
+    if (q < end && (*q == '-' || *q == '+'))
+    {
+        negative = *q == '-';
+        ++q;
+    }
+    uint64_t mantissa = 0;
+    int numDigits = 0;
+    int exponent = 0;
+    bool anyDigits = false;
+    bool exact = true;
+    while (q < end && isDigit(*q))
+    {
+        if (numDigits < 18)
+        {
+            mantissa = mantissa * 10 + (*q - '0');
+            if (mantissa != 0)
+                numDigits++;
+        }
+        else
+        {
+            exponent++;
+            exact = exact && *q == '0';
+        }
+        anyDigits = true;
+        ++q;
+    }
+    if (q < end && *q == '.')
+    {
+        ++q;
+        while (q < end && isDigit(*q))
+        {
+            if (numDigits < 18)
+            {
+                mantissa = mantissa * 10 + (*q - '0');
+                if (mantissa != 0)
+                    numDigits++;
+                exponent--;
+            }
+            else
+            {
+                exact = exact && *q == '0';
+            }
+            anyDigits = true;
+            ++q;
+        }
+    }
+    if (anyDigits && q < end && (*q == 'e' || *q == 'E'))
+    {
+        // Only counts as an exponent if there are digits after it
+        const char *e = q + 1;
+        int expValue = 0;
+        if (parseInt(e, end, expValue))
+        {
+            exponent += expValue;
+            q = e;
+        }
+    }
+
+    if (anyDigits && exact && mantissa <= (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22)
+    {
+        double value = double(mantissa);
+        value = exponent < 0 ? value / kPowersOfTen[-exponent] : value * kPowersOfTen[exponent];
+        outValue = float(negative ? -value : value);
+        p = q;
+        return true;
+    }
+
+    if (!anyDigits)
+        return false;
+    
+    // Slow path; strtof() wants a null-terminated string, so copy the token
+    const char *tokenEnd = start;
+    while (tokenEnd < end && !isSpace(*tokenEnd) && *tokenEnd != '\n' && *tokenEnd != '#')
+        ++tokenEnd;
+    char buffer[128];
+    size_t length = std::min(size_t(tokenEnd - start), sizeof(buffer) - 1);
+    std::memcpy(buffer, start, length);
+    buffer[length] = '\0';
+    char *parsedEnd = NULL;
+    float value = std::strtof(buffer, &parsedEnd);
+    if (parsedEnd == buffer)
+        return false;
+    outValue = value;
+    p = start + (parsedEnd - buffer);
+    return true;
+}
+
+// Does the line (after leading spaces) start with this command, followed by
+// a space or the end of the line?
+static inline bool isCommand(const char *p, const char *lineEnd, const char *command, size_t length)
+{
+    if (size_t(lineEnd - p) < length || std::memcmp(p, command, length) != 0)
+        return false;
+    return p + length == lineEnd || isSpace(p[length]);
+}
+
+
+// Files get cut into pieces of about this many bytes (ending on line breaks),
+// which are parsed separately and then stitched together
+const size_t kOBJChunkSize = 4 << 20;
+
+// One piece of the file and everything parsed out of it.  Positive indices
+// in the face corners are already final; negative (relative) ones can only be
+// resolved within the chunk, so they're kept relative to the chunk's first
+// vertex/normal, and their corners listed so they can be fixed up once we
+// know how many vertices/normals came before the chunk.
+struct OBJChunk
+{
+    const char *m_begin, *m_end;
+    std::vector<Point> m_verts;
+    std::vector<Vector> m_normals;
+    std::vector<unsigned int> m_faceStarts;
+    std::vector<unsigned int> m_vertexIndices;
+    std::vector<unsigned int> m_normalIndices;
+    std::vector<unsigned int> m_relativeVertexCorners;
+    std::vector<unsigned int> m_relativeNormalCorners;
+    bool m_anyFaceNormals;
+    
+    OBJChunk() : m_begin(NULL), m_end(NULL), m_anyFaceNormals(false) { }
+};
+
+// Parse one chunk's lines into the chunk
+static void parseOBJChunk(OBJChunk& chunk)
+{
+    const char *begin = chunk.m_begin;
+    const char *end = chunk.m_end;
+    
+    // First pass: count everything up so we can allocate it all at once
+    size_t numVerts = 0, numNormals = 0, numFaces = 0, numCorners = 0;
+    for (const char *line = begin; line < end; )
+    {
+        const char *lineEnd = findLineEnd(line, end);
+        const char *p = line;
+        skipSpaces(p, lineEnd);
+        if (isCommand(p, lineEnd, "v", 1))
+        {
+            numVerts++;
+        }
+        else if (isCommand(p, lineEnd, "vn", 2))
+        {
+            numNormals++;
+        }
+        else if (isCommand(p, lineEnd, "f", 1))
+        {
+            numFaces++;
+            // Each run of non-space characters is a corner
+            for (p += 1; p < lineEnd; )
+            {
+                skipSpaces(p, lineEnd);
+                if (p < lineEnd)
+                    numCorners++;
+                while (p < lineEnd && !isSpace(*p))
+                    ++p;
+            }
+        }
+        line = lineEnd < end ? lineEnd + 1 : end;
+    }
+    
+    std::vector<Point>& verts = chunk.m_verts;
+    std::vector<Vector>& normals = chunk.m_normals;
+    verts.reserve(numVerts);
+    normals.reserve(numNormals);
+    chunk.m_faceStarts.reserve(numFaces);
+    chunk.m_vertexIndices.reserve(numCorners);
+    chunk.m_normalIndices.reserve(numCorners);
+    
+    // Second pass: the real thing
+    for (const char *line = begin; line < end; )
+    {
+        const char *lineEnd = findLineEnd(line, end);
+        const char *p = line;
+        line = lineEnd < end ? lineEnd + 1 : end;
+        skipSpaces(p, lineEnd);
+        if (p == lineEnd || *p == '#')
+        {
+            // Blank line, or a comment; eat it
+            continue;
+        }
+        
+        if (isCommand(p, lineEnd, "v", 1))
+        {
+            // NOTE: there is an optional w coordinate that we're ignoring here
+            Point v;
+            p += 1;
+            skipSpaces(p, lineEnd);
+            if (parseFloat(p, lineEnd, v.x))
+            {
+                skipSpaces(p, lineEnd);
+                if (parseFloat(p, lineEnd, v.y))
+                {
+                    skipSpaces(p, lineEnd);
+                    parseFloat(p, lineEnd, v.z);
+                }
+            }
+            verts.push_back(v);
+        }
+        else if (isCommand(p, lineEnd, "vn", 2))
+        {
+            Vector v;
+            p += 2;
+            skipSpaces(p, lineEnd);
+            if (parseFloat(p, lineEnd, v.x))
+            {
+                skipSpaces(p, lineEnd);
+                if (parseFloat(p, lineEnd, v.y))
+                {
+                    skipSpaces(p, lineEnd);
+                    parseFloat(p, lineEnd, v.z);
+                }
+            }
+            normals.push_back(v);
+        }
+        else if (isCommand(p, lineEnd, "f", 1))
+        {
+            chunk.m_faceStarts.push_back((unsigned int) chunk.m_vertexIndices.size());
+            p += 1;
+            for (;;)
+            {
+                skipSpaces(p, lineEnd);
+                int vi;
+                if (!parseInt(p, lineEnd, vi))
+                    break;
+                int uvi = 0, ni = 0;
+                bool gotUV = false;
+                bool gotN = false;
+                if (p < lineEnd && *p == '/')
+                {
+                    ++p;
+                    if (p < lineEnd && *p == '/')
+                    {
+                        ++p;
+                        gotN = parseInt(p, lineEnd, ni);
+                    }
+                    else
+                    {
+                        gotUV = parseInt(p, lineEnd, uvi);
+                        if (p < lineEnd && *p == '/')
+                        {
+                            ++p;
+                            gotN = parseInt(p, lineEnd, ni);
+                        }
+                    }
+                }
+                unsigned int corner = (unsigned int) chunk.m_vertexIndices.size();
+                if (vi <= 0)
+                    chunk.m_relativeVertexCorners.push_back(corner);
+                chunk.m_vertexIndices.push_back(vi > 0 ? vi - 1 : (int)verts.size() + vi);
+                if (gotUV)
+                {
+                    // UVs aren't supported yet
+                }
+                if (gotN)
+                {
+                    if (ni <= 0)
+                        chunk.m_relativeNormalCorners.push_back(corner);
+                    chunk.m_normalIndices.push_back(ni > 0 ? ni - 1 : (int)normals.size() + ni);
+                    chunk.m_anyFaceNormals = true;
+                }
+                else
+                {
+                    chunk.m_normalIndices.push_back(kNoNormal);
+                }
+            }
+        }
+        else
+        {
+            // vt, usemtl, mtllib, s, o, g, ... are all ignored for now
+        }
+    }
+}
+
+
+//
+// Mesh cache helpers, shared by the readers
+//
+
+// A cache made from this very file saves us the parse and the BVH build.
+// Returns the cached mesh if there's an up to date one; either way, stamps
+// the file so a new cache can be written for it later (outStamped is false
+// if the file couldn't be read to stamp it).
+static Polymesh* readCachedMesh(const char *filename, MeshSourceStamp& outStamp, bool& outStamped)
+{
+    outStamped = getMeshSourceStamp(filename, outStamp);
+    if (!outStamped)
+        return NULL;
+    return readMeshCache(meshCacheFilename(filename).c_str(), outStamp);
+}
+
+// Have a freshly read mesh save itself to the cache once its BVH is built
+static Polymesh* cacheMesh(Polymesh *pMesh, const char *filename,
+                           const MeshSourceStamp& stamp, bool stamped)
+{
+    if (pMesh != NULL && stamped)
+        pMesh->setCacheFile(meshCacheFilename(filename), stamp);
+    return pMesh;
+}
+
+
+Polymesh* readFromOBJFile(const char* filename, ThreadPool *pPool)
+{
+    MeshSourceStamp sourceStamp;
+    bool stamped = false;
+    Polymesh *pCached = readCachedMesh(filename, sourceStamp, stamped);
+    if (pCached != NULL)
+        return pCached;
+    
+    MappedFile file;
+    if (!file.open(filename) || file.size() == 0)
+        return NULL;
+    const char *begin = file.data();
+    const char *end = begin + file.size();
+    
+    // Cut the file into chunks, each ending just after a line break
+    std::vector<OBJChunk> chunks;
+    chunks.reserve(file.size() / kOBJChunkSize + 1);
+    for (const char *chunkBegin = begin; chunkBegin < end; )
+    {
+        const char *chunkEnd = end;
+        if (size_t(end - chunkBegin) > kOBJChunkSize)
+        {
+            chunkEnd = findLineEnd(chunkBegin + kOBJChunkSize, end);
+            chunkEnd = chunkEnd < end ? chunkEnd + 1 : end;
+        }
+        chunks.push_back(OBJChunk());
+        chunks.back().m_begin = chunkBegin;
+        chunks.back().m_end = chunkEnd;
+        chunkBegin = chunkEnd;
+    }
+    
+    // Parse them all at once
+    parallelFor(pPool, 0, chunks.size(), 1, [&chunks](size_t chunkBegin, size_t chunkEnd)
+    {
+        for (size_t i = chunkBegin; i < chunkEnd; ++i)
+            parseOBJChunk(chunks[i]);
+    });
+    
+    // Where each chunk's results go in the whole mesh (a running total of the
+    // counts from the chunks before it)
+    size_t numChunks = chunks.size();
+    std::vector<size_t> vertBases(numChunks + 1, 0), normalBases(numChunks + 1, 0);
+    std::vector<size_t> faceBases(numChunks + 1, 0), cornerBases(numChunks + 1, 0);
+    bool anyFaceNormals = false;
+    for (size_t i = 0; i < numChunks; ++i)
+    {
+        vertBases[i + 1] = vertBases[i] + chunks[i].m_verts.size();
+        normalBases[i + 1] = normalBases[i] + chunks[i].m_normals.size();
+        faceBases[i + 1] = faceBases[i] + chunks[i].m_faceStarts.size();
+        cornerBases[i + 1] = cornerBases[i] + chunks[i].m_vertexIndices.size();
+        anyFaceNormals = anyFaceNormals || chunks[i].m_anyFaceNormals;
+    }
+    if (vertBases[numChunks] == 0 || faceBases[numChunks] == 0)
+        return NULL;
+    if (cornerBases[numChunks] > 0xffffffffu)
+    {
+        std::cerr << "Too many face corners in " << filename << std::endl;
+        return NULL;
+    }
+    
+    // Stitch the chunks together, resolving the relative indices now that we
+    // know how many vertices/normals come before each chunk
+    std::vector<Point> verts(vertBases[numChunks]);
+    std::vector<Vector> normals(normalBases[numChunks]);
+    FaceList faces;
+    faces.m_faceStarts.resize(faceBases[numChunks] + 1);
+    faces.m_vertexIndices.resize(cornerBases[numChunks]);
+    if (anyFaceNormals)
+        faces.m_normalIndices.resize(cornerBases[numChunks]);
+    faces.m_faceStarts[faceBases[numChunks]] = (unsigned int) cornerBases[numChunks];
+    parallelFor(pPool, 0, numChunks, 1, [&](size_t chunkBegin, size_t chunkEnd)
+    {
+        for (size_t i = chunkBegin; i < chunkEnd; ++i)
+        {
+            OBJChunk& chunk = chunks[i];
+            unsigned int vertBase = (unsigned int) vertBases[i];
+            unsigned int normalBase = (unsigned int) normalBases[i];
+            unsigned int cornerBase = (unsigned int) cornerBases[i];
+            std::copy(chunk.m_verts.begin(), chunk.m_verts.end(), verts.begin() + vertBases[i]);
+            std::copy(chunk.m_normals.begin(), chunk.m_normals.end(), normals.begin() + normalBases[i]);
+            for (size_t f = 0; f < chunk.m_faceStarts.size(); ++f)
+            {
+                faces.m_faceStarts[faceBases[i] + f] = cornerBase + chunk.m_faceStarts[f];
+            }
+            unsigned int *vertexIndices = faces.m_vertexIndices.empty() ? NULL : &faces.m_vertexIndices[cornerBase];
+            std::copy(chunk.m_vertexIndices.begin(), chunk.m_vertexIndices.end(), vertexIndices);
+            for (size_t c = 0; c < chunk.m_relativeVertexCorners.size(); ++c)
+            {
+                vertexIndices[chunk.m_relativeVertexCorners[c]] += vertBase;
+            }
+            if (anyFaceNormals && !chunk.m_normalIndices.empty())
+            {
+                unsigned int *normalIndices = &faces.m_normalIndices[cornerBase];
+                std::copy(chunk.m_normalIndices.begin(), chunk.m_normalIndices.end(), normalIndices);
+                for (size_t c = 0; c < chunk.m_relativeNormalCorners.size(); ++c)
+                {
+                    normalIndices[chunk.m_relativeNormalCorners[c]] += normalBase;
+                }
+            }
+            // Done with this chunk
+            chunk = OBJChunk();
+        }
+    });
+    file.close();
+    
+    // Let the user know if the file points at vertices/normals it doesn't have
+    size_t numBadVerts = 0, numBadNormals = 0;
+    for (size_t c = 0; c < faces.m_vertexIndices.size(); ++c)
+    {
+        if (faces.m_vertexIndices[c] >= verts.size())
+            numBadVerts++;
+        if (anyFaceNormals && faces.m_normalIndices[c] != kNoNormal && faces.m_normalIndices[c] >= normals.size())
+            numBadNormals++;
+    }
+    if (numBadVerts > 0)
+        std::cerr << "Found " << numBadVerts << " out-of-range vertex indices in " << filename << std::endl;
+    if (numBadNormals > 0)
+        std::cerr << "Found " << numBadNormals << " out-of-range N indices in " << filename << std::endl;
+    
+    return cacheMesh(new Polymesh(verts, normals, faces, NULL), filename, sourceStamp, stamped);
+}
+
+//
+// PLY
+//
+
+enum PLYType
+{
+    kPLYNone,
+    kPLYInt8, kPLYUInt8,
+    kPLYInt16, kPLYUInt16,
+    kPLYInt32, kPLYUInt32,
+    kPLYFloat32, kPLYFloat64
+};
+
+static PLYType plyTypeFromName(const char *name, const char *nameEnd)
+{
+    // Both the original names and the sized ones newer exporters write
+    static const struct { const char *m_name; PLYType m_type; } kTypeNames[] =
+    {
+        { "char",  kPLYInt8 },    { "int8",    kPLYInt8 },
+        { "uchar", kPLYUInt8 },   { "uint8",   kPLYUInt8 },
+        { "short", kPLYInt16 },   { "int16",   kPLYInt16 },
+        { "ushort", kPLYUInt16 }, { "uint16",  kPLYUInt16 },
+        { "int",   kPLYInt32 },   { "int32",   kPLYInt32 },
+        { "uint",  kPLYUInt32 },  { "uint32",  kPLYUInt32 },
+        { "float", kPLYFloat32 }, { "float32", kPLYFloat32 },
+        { "double", kPLYFloat64 }, { "float64", kPLYFloat64 }
+    };
+    size_t length = nameEnd - name;
+    for (size_t i = 0; i < sizeof(kTypeNames) / sizeof(kTypeNames[0]); ++i)
+    {
+        if (std::strlen(kTypeNames[i].m_name) == length && std::memcmp(kTypeNames[i].m_name, name, length) == 0)
+            return kTypeNames[i].m_type;
+    }
+    return kPLYNone;
+}
+
+static size_t plyTypeSize(PLYType type)
+{
+    switch (type)
+    {
+    case kPLYInt8:    case kPLYUInt8:   return 1;
+    case kPLYInt16:   case kPLYUInt16:  return 2;
+    case kPLYInt32:   case kPLYUInt32:  return 4;
+    case kPLYFloat32:                   return 4;
+    case kPLYFloat64:                   return 8;
+    default:                            return 0;
+    }
+}
+
+struct PLYProperty
+{
+    std::string m_name;
+    PLYType m_type;
+    // For list properties, the type of the item count (kPLYNone otherwise);
+    // m_type is then the type of the items
+    PLYType m_countType;
+};
+
+struct PLYElement
+{
+    std::string m_name;
+    size_t m_count;
+    std::vector<PLYProperty> m_properties;
+    
+    int findProperty(const char *name) const
+    {
+        for (size_t i = 0; i < m_properties.size(); ++i)
+        {
+            if (m_properties[i].m_name == name)
+                return (int) i;
+        }
+        return -1;
+    }
+    
+    // Bytes per row in a binary file, or 0 if there are lists (so rows vary)
+    size_t binaryRowSize() const
+    {
+        size_t size = 0;
+        for (size_t i = 0; i < m_properties.size(); ++i)
+        {
+            if (m_properties[i].m_countType != kPLYNone)
+                return 0;
+            size += plyTypeSize(m_properties[i].m_type);
+        }
+        return size;
+    }
+    
+    // Where a property starts in a binary row (for rows without lists)
+    size_t binaryOffset(int property) const
+    {
+        size_t offset = 0;
+        for (int i = 0; i < property; ++i)
+        {
+            offset += plyTypeSize(m_properties[i].m_type);
+        }
+        return offset;
+    }
+    
+    // Are these three properties floats, one right after the other, so they
+    // can be copied straight into a Point or Vector?
+    bool packedFloats(int a, int b, int c) const
+    {
+        return m_properties[a].m_type == kPLYFloat32 &&
+               m_properties[b].m_type == kPLYFloat32 &&
+               m_properties[c].m_type == kPLYFloat32 &&
+               b == a + 1 && c == b + 1;
+    }
+};
+
+static bool hostIsBigEndian()
+{
+    const uint16_t one = 1;
+    return *reinterpret_cast<const unsigned char*>(&one) == 0;
+}
+
+// Read one binary value, swapping its bytes if the file's byte order isn't ours
+static double readPLYBinaryValue(const char *p, PLYType type, bool swap)
+{
+    unsigned char bytes[8];
+    size_t size = plyTypeSize(type);
+    std::memcpy(bytes, p, size);
+    if (swap)
+        std::reverse(bytes, bytes + size);
+    switch (type)
+    {
+    case kPLYInt8:    { int8_t v;   std::memcpy(&v, bytes, size); return v; }
+    case kPLYUInt8:   { uint8_t v;  std::memcpy(&v, bytes, size); return v; }
+    case kPLYInt16:   { int16_t v;  std::memcpy(&v, bytes, size); return v; }
+    case kPLYUInt16:  { uint16_t v; std::memcpy(&v, bytes, size); return v; }
+    case kPLYInt32:   { int32_t v;  std::memcpy(&v, bytes, size); return v; }
+    case kPLYUInt32:  { uint32_t v; std::memcpy(&v, bytes, size); return v; }
+    case kPLYFloat32: { float v;    std::memcpy(&v, bytes, size); return v; }
+    case kPLYFloat64: { double v;   std::memcpy(&v, bytes, size); return v; }
+    default:          return 0.0;
+    }
+}
+
+// Where we are in the body of a PLY file, and how to read values from it
+struct PLYCursor
+{
+    const char *m_p, *m_end;
+    bool m_binary;
+    bool m_swap;
+    
+    // Read one value; returns false if the file ran out (or, in an ASCII
+    // file, there's no number where there should be)
+    bool read(PLYType type, double& outValue)
+    {
+        if (m_binary)
+        {
+            size_t size = plyTypeSize(type);
+            if (size_t(m_end - m_p) < size)
+                return false;
+            outValue = readPLYBinaryValue(m_p, type, m_swap);
+            m_p += size;
+            return true;
+        }
+        // ASCII values are just whitespace separated; rows are usually one
+        // to a line, but nothing depends on it
+        while (m_p < m_end && (isSpace(*m_p) || *m_p == '\n'))
+            ++m_p;
+        if (type == kPLYFloat32 || type == kPLYFloat64)
+        {
+            float value;
+            if (!parseFloat(m_p, m_end, value))
+                return false;
+            outValue = value;
+        }
+        else
+        {
+            int value;
+            if (!parseInt(m_p, m_end, value))
+                return false;
+            outValue = value;
+        }
+        return true;
+    }
+};
+
+// Read one row of an element property by property, handing each value (each
+// item, for lists) to handle(propertyIndex, value)
+template<typename Handler>
+static bool readPLYRow(PLYCursor& cursor, const PLYElement& element, Handler& handle)
+{
+    for (size_t i = 0; i < element.m_properties.size(); ++i)
+    {
+        const PLYProperty& property = element.m_properties[i];
+        double value;
+        if (property.m_countType == kPLYNone)
+        {
+            if (!cursor.read(property.m_type, value))
+                return false;
+            handle(i, value);
+            continue;
+        }
+        double count;
+        if (!cursor.read(property.m_countType, count) || count < 0.0)
+            return false;
+        for (size_t item = 0; item < size_t(count); ++item)
+        {
+            if (!cursor.read(property.m_type, value))
+                return false;
+            handle(i, value);
+        }
+    }
+    return true;
+}
+
+static bool readPLYVertices(PLYCursor& cursor, const PLYElement& element,
+                            std::vector<Point>& verts, std::vector<Vector>& normals)
+{
+    int x = element.findProperty("x"), y = element.findProperty("y"), z = element.findProperty("z");
+    int nx = element.findProperty("nx"), ny = element.findProperty("ny"), nz = element.findProperty("nz");
+    if (x < 0 || y < 0 || z < 0)
+        return false;
+    bool hasNormals = nx >= 0 && ny >= 0 && nz >= 0;
+    size_t count = element.m_count;
+    verts.resize(count);
+    if (hasNormals)
+        normals.resize(count);
+    
+    size_t rowSize = element.binaryRowSize();
+    if (cursor.m_binary && rowSize != 0)
+    {
+        // Fixed size rows: pick the values out of each row directly, copying
+        // them as they are when they're floats in our byte order and in the
+        // same order as our points and vectors (which they usually are)
+        if (size_t(cursor.m_end - cursor.m_p) / rowSize < count)
+            return false;
+        const char *rows = cursor.m_p;
+        cursor.m_p += count * rowSize;
+        if (!cursor.m_swap && element.packedFloats(x, y, z) && x == 0 &&
+            rowSize == 3 * sizeof(float) && sizeof(Point) == rowSize && count > 0)
+        {
+            // Nothing but positions, laid out just like ours (not the case
+            // when our points are padded for SIMD); one copy does it
+            std::memcpy(static_cast<void*>(&verts[0]), rows, count * sizeof(Point));
+            return true;
+        }
+        int props[6] = { x, y, z, nx, ny, nz };
+        size_t offsets[6];
+        for (int i = 0; i < (hasNormals ? 6 : 3); ++i)
+        {
+            offsets[i] = element.binaryOffset(props[i]);
+        }
+        bool copyPositions = !cursor.m_swap && element.packedFloats(x, y, z);
+        bool copyNormals = hasNormals && !cursor.m_swap && element.packedFloats(nx, ny, nz);
+        for (size_t v = 0; v < count; ++v)
+        {
+            const char *row = rows + v * rowSize;
+            if (copyPositions)
+            {
+                std::memcpy(static_cast<void*>(&verts[v].x), row + offsets[0], 3 * sizeof(float));
+            }
+            else
+            {
+                verts[v] = Point(float(readPLYBinaryValue(row + offsets[0], element.m_properties[x].m_type, cursor.m_swap)),
+                                 float(readPLYBinaryValue(row + offsets[1], element.m_properties[y].m_type, cursor.m_swap)),
+                                 float(readPLYBinaryValue(row + offsets[2], element.m_properties[z].m_type, cursor.m_swap)));
+            }
+            if (copyNormals)
+            {
+                std::memcpy(static_cast<void*>(&normals[v].x), row + offsets[3], 3 * sizeof(float));
+            }
+            else if (hasNormals)
+            {
+                normals[v] = Vector(float(readPLYBinaryValue(row + offsets[3], element.m_properties[nx].m_type, cursor.m_swap)),
+                                    float(readPLYBinaryValue(row + offsets[4], element.m_properties[ny].m_type, cursor.m_swap)),
+                                    float(readPLYBinaryValue(row + offsets[5], element.m_properties[nz].m_type, cursor.m_swap)));
+            }
+        }
+        return true;
+    }
+    
+    // ASCII (or rows with lists in them): one value at a time
+    float components[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+    auto handle = [&](size_t property, double value)
+    {
+        int p = (int) property;
+        int component = p == x ? 0 : p == y ? 1 : p == z ? 2 : p == nx ? 3 : p == ny ? 4 : p == nz ? 5 : -1;
+        if (component >= 0)
+            components[component] = float(value);
+    };
+    for (size_t v = 0; v < count; ++v)
+    {
+        if (!readPLYRow(cursor, element, handle))
+            return false;
+        verts[v] = Point(components[0], components[1], components[2]);
+        if (hasNormals)
+            normals[v] = Vector(components[3], components[4], components[5]);
+    }
+    return true;
+}
+
+static bool readPLYFaces(PLYCursor& cursor, const PLYElement& element, FaceList& faces)
+{
+    int indices = element.findProperty("vertex_indices");
+    if (indices < 0)
+        indices = element.findProperty("vertex_index");
+    if (indices < 0 || element.m_properties[indices].m_countType == kPLYNone)
+        return false;
+    size_t count = element.m_count;
+    faces.m_faceStarts.reserve(count + 1);
+    faces.m_vertexIndices.reserve(count * 3);
+    
+    const PLYProperty& property = element.m_properties[indices];
+    if (cursor.m_binary && !cursor.m_swap && element.m_properties.size() == 1 &&
+        plyTypeSize(property.m_countType) == 1 && plyTypeSize(property.m_type) == 4 &&
+        property.m_type != kPLYFloat32)
+    {
+        // Faces that are nothing but a byte count and 32 bit indices (what
+        // nearly every exporter writes); copy each face's indices as they are
+        for (size_t f = 0; f < count; ++f)
+        {
+            if (cursor.m_p >= cursor.m_end)
+                return false;
+            size_t numCorners = (unsigned char) *cursor.m_p++;
+            if (size_t(cursor.m_end - cursor.m_p) / 4 < numCorners)
+                return false;
+            size_t base = faces.m_vertexIndices.size();
+            faces.m_vertexIndices.resize(base + numCorners);
+            if (numCorners > 0)
+                std::memcpy(&faces.m_vertexIndices[base], cursor.m_p, numCorners * 4);
+            cursor.m_p += numCorners * 4;
+            faces.m_faceStarts.push_back((unsigned int) faces.m_vertexIndices.size());
+        }
+        return true;
+    }
+    
+    auto handle = [&](size_t property, double value)
+    {
+        if ((int) property == indices)
+            faces.m_vertexIndices.push_back(value >= 0.0 ? (unsigned int) value : 0xffffffffu);
+    };
+    for (size_t f = 0; f < count; ++f)
+    {
+        if (!readPLYRow(cursor, element, handle))
+            return false;
+        faces.m_faceStarts.push_back((unsigned int) faces.m_vertexIndices.size());
+    }
+    return true;
+}
+
+static bool skipPLYElement(PLYCursor& cursor, const PLYElement& element)
+{
+    size_t rowSize = element.binaryRowSize();
+    if (cursor.m_binary && rowSize != 0)
+    {
+        if (size_t(cursor.m_end - cursor.m_p) / rowSize < element.m_count)
+            return false;
+        cursor.m_p += element.m_count * rowSize;
+        return true;
+    }
+    auto ignore = [](size_t, double) { };
+    for (size_t i = 0; i < element.m_count; ++i)
+    {
+        if (!readPLYRow(cursor, element, ignore))
+            return false;
+    }
+    return true;
+}
+
+// Next space-separated word on the line; returns false if there are no more
+static bool nextWord(const char*& p, const char *lineEnd, const char*& outWord, const char*& outWordEnd)
+{
+    skipSpaces(p, lineEnd);
+    outWord = p;
+    while (p < lineEnd && !isSpace(*p))
+        ++p;
+    outWordEnd = p;
+    return outWord < outWordEnd;
+}
+
+static bool wordIs(const char *word, const char *wordEnd, const char *text)
+{
+    return size_t(wordEnd - word) == std::strlen(text) && std::memcmp(word, text, wordEnd - word) == 0;
+}
+
+
+Polymesh* readFromPLYFile(const char* filename)
+{
+    MeshSourceStamp sourceStamp;
+    bool stamped = false;
+    Polymesh *pCached = readCachedMesh(filename, sourceStamp, stamped);
+    if (pCached != NULL)
+        return pCached;
+    
+    MappedFile file;
+    if (!file.open(filename) || file.size() == 0)
+        return NULL;
+    const char *p = file.data();
+    const char *end = p + file.size();
+    
+    // Header: what elements there are, in the order they come in the body,
+    // and what's in each of their rows
+    std::vector<PLYElement> elements;
+    bool binary = false, bigEndian = false;
+    bool headerOK = false;
+    for (bool firstLine = true; p < end; firstLine = false)
+    {
+        const char *lineEnd = findLineEnd(p, end);
+        const char *line = p;
+        p = lineEnd < end ? lineEnd + 1 : end;
+        const char *word, *wordEnd;
+        if (!nextWord(line, lineEnd, word, wordEnd))
+            continue;
+        if (firstLine)
+        {
+            if (!wordIs(word, wordEnd, "ply"))
+                break;
+        }
+        else if (wordIs(word, wordEnd, "format"))
+        {
+            if (!nextWord(line, lineEnd, word, wordEnd))
+                break;
+            binary = !wordIs(word, wordEnd, "ascii");
+            bigEndian = wordIs(word, wordEnd, "binary_big_endian");
+            if (binary && !bigEndian && !wordIs(word, wordEnd, "binary_little_endian"))
+                break;
+        }
+        else if (wordIs(word, wordEnd, "element"))
+        {
+            PLYElement element;
+            int count = 0;
+            if (!nextWord(line, lineEnd, word, wordEnd))
+                break;
+            element.m_name.assign(word, wordEnd);
+            skipSpaces(line, lineEnd);
+            if (!parseInt(line, lineEnd, count) || count < 0)
+                break;
+            element.m_count = (size_t) count;
+            elements.push_back(element);
+        }
+        else if (wordIs(word, wordEnd, "property"))
+        {
+            PLYProperty property;
+            property.m_countType = kPLYNone;
+            if (elements.empty() || !nextWord(line, lineEnd, word, wordEnd))
+                break;
+            if (wordIs(word, wordEnd, "list"))
+            {
+                if (!nextWord(line, lineEnd, word, wordEnd))
+                    break;
+                property.m_countType = plyTypeFromName(word, wordEnd);
+                if (property.m_countType == kPLYNone || !nextWord(line, lineEnd, word, wordEnd))
+                    break;
+            }
+            property.m_type = plyTypeFromName(word, wordEnd);
+            if (property.m_type == kPLYNone || !nextWord(line, lineEnd, word, wordEnd))
+                break;
+            property.m_name.assign(word, wordEnd);
+            elements.back().m_properties.push_back(property);
+        }
+        else if (wordIs(word, wordEnd, "end_header"))
+        {
+            headerOK = true;
+            break;
+        }
+        // Anything else (comment, obj_info) we don't need
+    }
+    if (!headerOK)
+    {
+        std::cerr << "Bad PLY header in " << filename << std::endl;
+        return NULL;
+    }
+    
+    // Body: pull out the vertices and faces, skipping anything else
+    std::vector<Point> verts;
+    std::vector<Vector> normals;
+    FaceList faces;
+    PLYCursor cursor;
+    cursor.m_p = p;
+    cursor.m_end = end;
+    cursor.m_binary = binary;
+    cursor.m_swap = binary && bigEndian != hostIsBigEndian();
+    for (size_t e = 0; e < elements.size(); ++e)
+    {
+        bool ok;
+        if (elements[e].m_name == "vertex")
+            ok = readPLYVertices(cursor, elements[e], verts, normals);
+        else if (elements[e].m_name == "face")
+            ok = readPLYFaces(cursor, elements[e], faces);
+        else
+            ok = skipPLYElement(cursor, elements[e]);
+        if (!ok)
+        {
+            std::cerr << "Bad or missing PLY " << elements[e].m_name << " data in " << filename << std::endl;
+            return NULL;
+        }
+    }
+    file.close();
+    if (verts.empty() || faces.numFaces() == 0)
+        return NULL;
+    
+    // Normals are per vertex, so each corner's normal has its vertex's index
+    if (!normals.empty())
+        faces.m_normalIndices = faces.m_vertexIndices;
+    
+    size_t numBadVerts = 0;
+    for (size_t c = 0; c < faces.m_vertexIndices.size(); ++c)
+    {
+        if (faces.m_vertexIndices[c] >= verts.size())
+            numBadVerts++;
+    }
+    if (numBadVerts > 0)
+        std::cerr << "Found " << numBadVerts << " out-of-range vertex indices in " << filename << std::endl;
+    
+    return cacheMesh(new Polymesh(verts, normals, faces, NULL), filename, sourceStamp, stamped);
+}
+
+
+Polymesh* readFromFile(const char* filename, ThreadPool *pPool)
+{
+    size_t length = std::strlen(filename);
+    if (length >= 4 && filename[length - 4] == '.' &&
+        (filename[length - 3] | 0x20) == 'p' && (filename[length - 2] | 0x20) == 'l' &&
+        (filename[length - 1] | 0x20) == 'y')
+    {
+        return readFromPLYFile(filename);
+    }
+    return readFromOBJFile(filename, pPool);
+}
+
+}// end namespace kt
@@ -39,142 +39,62 @@ namespace kt{
  * to the reader.
  * 
  * Also note that for this stage, we do not support texture mapping, so the vt
- * directive is also effectively ignored.  But the code is in there, so it
- * should be easy to enable it in the future.
+ * directive is also effectively ignored.
+ * 
+ * Scanned assets can run to gigabytes of OBJ, so the reader maps the file
+ * into memory and parses it in place with a small hand-written tokenizer (no
+ * strings, streams or allocations per line).  A quick first pass counts the
+ * vertices, normals and face corners so the arrays get allocated just once.
+ * 
+ * Given a thread pool, the file is cut into line-aligned chunks that get
+ * parsed in parallel, then stitched back together in order using a running
+ * total of each chunk's counts (that's also when relative indices in one
+ * chunk get pointed at vertices from earlier chunks).
+ * 
+ * The mesh gets saved to a cache next to the file (foo.obj.ktmesh, see
+ * KMeshCache.h) once its BVH is built, and later reads of an unchanged file
+ * load that instead of parsing anything.
+ * 
+ * Returns NULL if the file can't be read or has no vertices or faces.
  */
 
-Polymesh* readFromOBJFile(const char* filename)
-{
-    std::ifstream input(filename);
-    
-    std::vector<Face> faces;
-    std::vector<Point> verts;
-    std::vector<Vector> normals;
-    
-    std::string lineStr;
-    std::string command;
-    while (input.good())
-    {
-        lineStr.clear();
-        std::getline(input, lineStr);
+Polymesh* readFromOBJFile(const char* filename, ThreadPool *pPool = NULL);
 
-        std::istringstream lineInput(lineStr);
-        if (lineInput.eof())
-        {
-            continue;
-        }
+/*
+ * PLY files start with an ASCII header describing the "elements" that follow
+ * and the properties of each, then the elements' rows, in ASCII or in binary
+ * (little or big endian):
+ * 
+ *     ply
+ *     format binary_little_endian 1.0
+ *     element vertex 8
+ *     property float x
+ *     property float y
+ *     property float z
+ *     element face 6
+ *     property list uchar int vertex_indices
+ *     end_header
+ * 
+ * We read x/y/z (and nx/ny/nz, if they're all there) from the vertex element
+ * and the index list (vertex_indices or vertex_index) from the face element;
+ * other properties and elements are skipped.  Indices are 0-based, and
+ * normals are per vertex.
+ * 
+ * Binary rows are read in place.  Vertices whose positions/normals are three
+ * floats in our byte order get copied straight into the mesh's arrays (the
+ * whole element in one go if that's all there is), and faces that are just a
+ * byte count plus 32 bit indices get each face's indices copied at once.
+ * Anything else goes value by value, converting as needed.
+ * 
+ * Meshes read from PLY files get cached the same way as OBJ ones.  Returns
+ * NULL if the file can't be read, isn't a PLY file we understand, or has no
+ * vertices or faces.
+ */
 
-        command.clear();
-        lineInput >> command;
-        if (lineInput.fail())
-        {
-            continue;
-        }
+Polymesh* readFromPLYFile(const char* filename);
 
-        if (command[0] == '#')
-        {
-            // Found a comment; eat it
-        }
-        else if (command == "v")
-        {
-            // NOTE: there is an optional w coordinate that we're ignoring here
-            Point v;
-            lineInput >> v.x;
-            lineInput >> v.y;
-            lineInput >> v.z;
-            verts.push_back(v);
-        }
-        else if (command == "vn")
-        {
-            Vector v;
-            lineInput >> v.x;
-            lineInput >> v.y;
-            lineInput >> v.z;
-            normals.push_back(v);
-        }
-        else if (command == "vt")
-        {
-            // Note: there's an optional w coordinate that we're ignoring here
-            // Vec2 uv;
-            // lineInput >> uv.m_u;
-            // lineInput >> uv.m_v;
-            // uvs.push_back(uv);
-        }
-        else if (command == "f")
-        {
-            faces.push_back(Face());
-            Face& face = faces.back();
-            while (lineInput.good())
-            {
-                int vi;
-                lineInput >> vi;
-                if (lineInput.fail())
-                    break;
-                int uvi, ni;
-                bool gotUV = false;
-                bool gotN = false;
-                if (lineInput.peek() == '/')
-                {
-                    char slash;
-                    lineInput >> slash;
-                    if (lineInput.peek() == '/')
-                    {
-                        lineInput >> slash;
-                        lineInput >> ni;
-                        gotN = true;
-                    }
-                    else
-                    {
-                        lineInput >> uvi;
-                        gotUV = true;
-                        if (lineInput.peek() == '/')
-                        {
-                            lineInput >> slash;
-                            lineInput >> ni;
-                            gotN = true;
-                        }
-                    }
-                }
-                vi = vi > 0 ? vi - 1 : (int)verts.size() + vi;
-                face.m_vertexIndices.push_back(vi);
-                if (vi >= (int)verts.size())
-                    std::cerr << "Found out-of-range vertex index: " << vi << std::endl;
-                if (gotUV)
-                {
-                    // uvi = uvi > 0 ? uvi - 1 : (int)uvs.size() + uvi;
-                    // face.m_uvIndices.push_back(uvi);
-                    // if (uvi >= uvs.size())
-                    //     std::cerr << "Found out-of-range UV index: " << uvi << std::endl;
-                }
-                if (gotN)
-                {
-                    ni = ni > 0 ? ni - 1 : (int)normals.size() + ni;
-                    face.m_normalIndices.push_back(ni);
-                    if (ni >= (int)normals.size())
-                        std::cerr << "Found out-of-range N index: " << ni << std::endl;
-                }
-            }
-        }
-        else if (command == "usemtl")
-        {
-            
-        }
-        else if (command == "mtllib")
-        {
-            
-        }
-        else if (command == "s")
-        {
-            
-        }
-        else
-        {
-            
-        }
-    }
-    if (verts.empty() || faces.empty())
-        return NULL;
-    return new Polymesh(verts, normals, faces, NULL);
-}
+// Read a mesh file of either kind, going by its extension (.ply is PLY,
+// anything else is taken to be OBJ)
+Polymesh* readFromFile(const char* filename, ThreadPool *pPool = NULL);
 
-}// end namespace kt
\ No newline at end of file
+}// end namespace kt
@@ -0,0 +1,195 @@
+#pragma once
+
+//
+// The bodies of the kernels in KKernels.h.  Each KKernels*.cpp includes this
+// to build them for its own instruction set (KSIMD.h gives them SIMD lanes as
+// wide as that set has), and names the table of them with KT_KERNEL_TABLE.
+// Nothing else should include it.
+//
+
+#include "KKernels.h"
+#include "KSIMD.h"
+
+
+namespace kt{
+
+namespace {
+
+#if defined(__AVX2__)
+const char *kKernelName = "avx2";
+#elif defined(__AVX__)
+const char *kKernelName = "avx";
+#elif defined(__SSE2__)
+const char *kKernelName = "sse2";
+#else
+const char *kKernelName = "generic";
+#endif
+
+// Lanes of a packet starting at the given triangle that hold one of the
+// first `end` triangles
+inline unsigned int packetLanes(unsigned int first, unsigned int end)
+{
+    return end - first >= kSIMDWidth ? (1u << kSIMDWidth) - 1u : (1u << (end - first)) - 1u;
+}
+
+unsigned int intersectBoxes(const WideBoxes& boxes, unsigned int numBoxes,
+                            const KernelRay& ray, float tMin, float tMax,
+                            float outTNear[kKernelWidth])
+{
+    SIMDFloat ox(ray.m_origin[0]), oy(ray.m_origin[1]), oz(ray.m_origin[2]);
+    SIMDFloat ix(ray.m_invDir[0]), iy(ray.m_invDir[1]), iz(ray.m_invDir[2]);
+    // (With narrow lanes, boxes past the packed ones don't need testing)
+    unsigned int hitMask = 0;
+    for (unsigned int first = 0; first < numBoxes; first += kSIMDWidth)
+    {
+        SIMDFloat tx0 = (SIMDFloat::load(boxes.m_minX + first) - ox) * ix;
+        SIMDFloat tx1 = (SIMDFloat::load(boxes.m_maxX + first) - ox) * ix;
+        SIMDFloat ty0 = (SIMDFloat::load(boxes.m_minY + first) - oy) * iy;
+        SIMDFloat ty1 = (SIMDFloat::load(boxes.m_maxY + first) - oy) * iy;
+        SIMDFloat tz0 = (SIMDFloat::load(boxes.m_minZ + first) - oz) * iz;
+        SIMDFloat tz1 = (SIMDFloat::load(boxes.m_maxZ + first) - oz) * iz;
+        // min() and max() return their second operand on NaN
+        SIMDFloat tNear = max(min(tx0, tx1),
+                          max(min(ty0, ty1),
+                          max(min(tz0, tz1), SIMDFloat(tMin))));
+        SIMDFloat tFar = min(max(tx0, tx1),
+                         min(max(ty0, ty1),
+                         min(max(tz0, tz1), SIMDFloat(tMax))));
+        tNear.store(outTNear + first);
+        hitMask |= (tNear <= tFar).bits() << first;
+    }
+    return hitMask & ((1u << numBoxes) - 1u);
+}
+
+// Test kSIMDWidth triangles starting at the given one against the ray,
+// returning a bit mask of those hit in [tMin, tMax), and the distance and
+// barycentric coords of each hit
+unsigned int intersectTrianglePacket(const LeafTriangles& triangles, unsigned int first,
+                                     const KernelRay& ray, float tMin, float tMax,
+                                     float outT[kSIMDWidth],
+                                     float outBeta[kSIMDWidth],
+                                     float outGamma[kSIMDWidth])
+{
+    // Moller-Trumbore ray-triangle intersection test, for a whole packet of
+    // triangles at once.  The point here is to find the barycentric
+    // coordinates of the triangle where the ray hits the plane the triangle
+    // lives in.  If the barycentric coordinates alpha, beta, gamma all add up
+    // to 1 (and each is in the 0.0 to 1.0 range) then we have a valid
+    // intersection in the triangle.  Then, each of alpha, beta, gamma are the
+    // amounts of influence each vertex has on the values at the intersection.
+    // So if we store things at the vertices (like normals, UVs, colors, etc)
+    // we can just weight them with the barycentric coordinates to get the
+    // interpolated result.
+    //
+    // Each lane works through the exact same operations the one-at-a-time
+    // version would, so the results don't depend on the SIMD width.
+    const float *const *c = triangles.m_components;
+    SIMDFloat v0x = SIMDFloat::load(c[kLeafTriV0X] + first);
+    SIMDFloat v0y = SIMDFloat::load(c[kLeafTriV0Y] + first);
+    SIMDFloat v0z = SIMDFloat::load(c[kLeafTriV0Z] + first);
+    SIMDFloat nx = SIMDFloat::load(c[kLeafTriNX] + first);
+    SIMDFloat ny = SIMDFloat::load(c[kLeafTriNY] + first);
+    SIMDFloat nz = SIMDFloat::load(c[kLeafTriNZ] + first);
+    SIMDFloat dx(ray.m_direction[0]), dy(ray.m_direction[1]), dz(ray.m_direction[2]);
+    SIMDFloat ox(ray.m_origin[0]), oy(ray.m_origin[1]), oz(ray.m_origin[2]);
+
+    // A zero determinant means the ray runs parallel to the triangle
+    SIMDFloat det = -(dx * nx + dy * ny + dz * nz);
+    SIMDMask valid = det != SIMDFloat(0.0f);
+
+    SIMDFloat toV0x = v0x - ox, toV0y = v0y - oy, toV0z = v0z - oz;
+    SIMDFloat crossX = dy * toV0z - dz * toV0y;
+    SIMDFloat crossY = dz * toV0x - dx * toV0z;
+    SIMDFloat crossZ = dx * toV0y - dy * toV0x;
+    SIMDFloat invDet = SIMDFloat(1.0f) / det;
+
+    // Calculate barycentric gamma coord
+    SIMDFloat toV1x = SIMDFloat::load(c[kLeafTriV1X] + first) - ox;
+    SIMDFloat toV1y = SIMDFloat::load(c[kLeafTriV1Y] + first) - oy;
+    SIMDFloat toV1z = SIMDFloat::load(c[kLeafTriV1Z] + first) - oz;
+    SIMDFloat gamma = -(toV1x * crossX + toV1y * crossY + toV1z * crossZ) * invDet;
+    valid = valid & (gamma >= SIMDFloat(0.0f)) & (gamma <= SIMDFloat(1.0f));
+
+    // Calculate barycentric beta coord
+    SIMDFloat toV2x = SIMDFloat::load(c[kLeafTriV2X] + first) - ox;
+    SIMDFloat toV2y = SIMDFloat::load(c[kLeafTriV2Y] + first) - oy;
+    SIMDFloat toV2z = SIMDFloat::load(c[kLeafTriV2Z] + first) - oz;
+    SIMDFloat beta = (toV2x * crossX + toV2y * crossY + toV2z * crossZ) * invDet;
+    valid = valid & (beta >= SIMDFloat(0.0f)) & (beta + gamma <= SIMDFloat(1.0f));
+
+    SIMDFloat t = -(toV0x * nx + toV0y * ny + toV0z * nz) * invDet;
+    valid = valid & (t >= SIMDFloat(tMin)) & (t < SIMDFloat(tMax));
+
+    t.store(outT);
+    beta.store(outBeta);
+    gamma.store(outGamma);
+    return valid.bits();
+}
+
+bool nearestTriangle(const LeafTriangles& triangles, unsigned int begin, unsigned int end,
+                     const KernelRay& ray, float tMin, float& ioT,
+                     unsigned int& outTriangle, float& outBeta, float& outGamma)
+{
+    bool intersectAny = false;
+    float t[kSIMDWidth], beta[kSIMDWidth], gamma[kSIMDWidth];
+    for (unsigned int first = begin; first < end; first += kSIMDWidth)
+    {
+        unsigned int hitMask = intersectTrianglePacket(triangles, first, ray, tMin, ioT, t, beta, gamma);
+        hitMask &= packetLanes(first, end);
+        for (unsigned int i = 0; hitMask != 0; ++i, hitMask >>= 1)
+        {
+            if ((hitMask & 1) != 0 && t[i] < ioT)
+            {
+                ioT = t[i];
+                outTriangle = first + i;
+                outBeta = beta[i];
+                outGamma = gamma[i];
+                intersectAny = true;
+            }
+        }
+    }
+    return intersectAny;
+}
+
+bool anyTriangle(const LeafTriangles& triangles, unsigned int begin, unsigned int end,
+                 const KernelRay& ray, float tMin, float tMax)
+{
+    float t[kSIMDWidth], beta[kSIMDWidth], gamma[kSIMDWidth];
+    for (unsigned int first = begin; first < end; first += kSIMDWidth)
+    {
+        if ((intersectTrianglePacket(triangles, first, ray, tMin, tMax, t, beta, gamma) &
+             packetLanes(first, end)) != 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void quantizePixels(const float *pixels, size_t stride, size_t count, unsigned char *outRGB)
+{
+    // Plain loops, for the compiler to vectorize for the instruction set
+    // (NaNs come out black)
+    for (size_t i = 0; i < count; ++i)
+    {
+        for (size_t c = 0; c < 3; ++c)
+        {
+            float v = pixels[i * stride + c];
+            v = v > 0.0f ? (v < 1.0f ? v : 1.0f) : 0.0f;
+            outRGB[i * 3 + c] = (unsigned char) (v * 255.0f);
+        }
+    }
+}
+
+} // anonymous namespace
+
+extern const Kernels KT_KERNEL_TABLE =
+{
+    kKernelName,
+    intersectBoxes,
+    nearestTriangle,
+    anyTriangle,
+    quantizePixels
+};
+
+} // namespace kt
@@ -0,0 +1,103 @@
+#include <string.h>
+#include <string>
+#include <vector>
+
+// The kernels built for the baseline instruction set
+#define KT_KERNEL_TABLE kBaselineKernelTable
+#include "KKernelCode.h"
+
+
+namespace kt{
+
+// See KKernelsAVX2.cpp
+extern const Kernels* const kAVX2Kernels;
+
+// CPU feature checks (the compiler's built-ins ask CPUID, and make sure the
+// OS saves the wider registers too)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KT_CPU_FEATURES
+#endif
+
+static bool cpuHasAVX2()
+{
+#if defined(KT_CPU_FEATURES)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+// Kernels the CPU can run, best last
+static std::vector<const Kernels*> usableKernels()
+{
+    std::vector<const Kernels*> usable(1, &kBaselineKernelTable);
+    if (kAVX2Kernels != NULL && cpuHasAVX2())
+        usable.push_back(kAVX2Kernels);
+    return usable;
+}
+
+static const Kernels*& selectedKernels()
+{
+    static const Kernels *s_pKernels = usableKernels().back();
+    return s_pKernels;
+}
+
+const Kernels& kernels()
+{
+    return *selectedKernels();
+}
+
+bool selectKernels(const char *name)
+{
+    std::vector<const Kernels*> usable = usableKernels();
+    for (size_t i = 0; i < usable.size(); ++i)
+    {
+        if (strcmp(usable[i]->m_name, name) == 0)
+        {
+            selectedKernels() = usable[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* kernelNames()
+{
+    static const std::string s_names = std::string(kBaselineKernelTable.m_name) +
+                                       (kAVX2Kernels != NULL ? " avx2" : "");
+    return s_names.c_str();
+}
+
+static std::string detectCPUFeatures()
+{
+    std::string found;
+#if defined(KT_CPU_FEATURES)
+    __builtin_cpu_init();
+    // (The built-in only takes literal names)
+    const char *names[] = { "sse2", "sse4.2", "avx", "avx2", "fma", "avx512f" };
+    bool has[] = { __builtin_cpu_supports("sse2") != 0,
+                   __builtin_cpu_supports("sse4.2") != 0,
+                   __builtin_cpu_supports("avx") != 0,
+                   __builtin_cpu_supports("avx2") != 0,
+                   __builtin_cpu_supports("fma") != 0,
+                   __builtin_cpu_supports("avx512f") != 0 };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+    {
+        if (!has[i])
+            continue;
+        if (!found.empty())
+            found += " ";
+        found += names[i];
+    }
+#endif
+    return found.empty() ? "none known" : found;
+}
+
+const char* cpuFeatures()
+{
+    static const std::string s_features = detectCPUFeatures();
+    return s_features.c_str();
+}
+
+} // namespace kt
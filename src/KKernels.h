@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stddef.h>
+
+
+namespace kt{
+
+//
+// Hot kernels, built for several instruction sets
+//
+// The innermost loops of ray tracing (testing a ray against a wide BVH node's
+// boxes and against a leaf's triangles) and of writing images out get built
+// once for the baseline instruction set of the build and again for AVX2 (see
+// the Makefile), and the best set this CPU can run is picked the first time
+// they're needed.  So one binary runs on older machines and still makes use
+// of the wider SIMD units of newer ones.
+//
+// Every set works through the exact same operations in each lane, so they
+// all give the same results, down to the bit.
+//
+// The kernels only see plain arrays of floats: the code built for AVX2 must
+// not share any inline functions (which the linker is free to pick any one
+// copy of) with the rest of the renderer.
+//
+
+// Wide BVH nodes have up to this many children; it's the same for every
+// instruction set, so the same BVHs (and mesh caches) work with all of them
+const unsigned int kKernelWidth = 8;
+
+// The children's bboxes of a wide BVH node, one component at a time (all the
+// min x's together, then all the min y's, and so on)
+struct WideBoxes
+{
+    float m_minX[kKernelWidth], m_minY[kKernelWidth], m_minZ[kKernelWidth];
+    float m_maxX[kKernelWidth], m_maxY[kKernelWidth], m_maxZ[kKernelWidth];
+};
+
+// A ray as the kernels take it (only the box test needs the inverse
+// direction)
+struct KernelRay
+{
+    float m_origin[3];
+    float m_direction[3];
+    float m_invDir[3];
+};
+
+// Components of triangles copied out for the intersection kernels; each
+// component of all of the triangles is in its own array, padded with
+// kKernelWidth more so a packet can always be loaded in one go
+enum LeafTriComponent
+{
+    kLeafTriV0X, kLeafTriV0Y, kLeafTriV0Z,
+    kLeafTriV1X, kLeafTriV1Y, kLeafTriV1Z,
+    kLeafTriV2X, kLeafTriV2Y, kLeafTriV2Z,
+    kLeafTriNX,  kLeafTriNY,  kLeafTriNZ,
+    kNumLeafTriComponents
+};
+
+struct LeafTriangles
+{
+    const float *m_components[kNumLeafTriComponents];
+};
+
+struct Kernels
+{
+    // Instruction set they were built for
+    const char *m_name;
+
+    // Slab test the ray against the first numBoxes boxes over [tMin, tMax].
+    // Returns a bit mask of the boxes hit, and fills in the distance each is
+    // entered at.  A NaN from a slab (ray origin exactly on a flat box's
+    // plane) doesn't narrow the range.
+    unsigned int (*intersectBoxes)(const WideBoxes& boxes, unsigned int numBoxes,
+                                   const KernelRay& ray, float tMin, float tMax,
+                                   float outTNear[kKernelWidth]);
+
+    // Nearest hit in [tMin, ioT) among triangles [begin, end), if any;
+    // updates ioT and gives the triangle and the barycentric coords of the
+    // hit.  Ties go to the earlier triangle.
+    bool (*nearestTriangle)(const LeafTriangles& triangles, unsigned int begin, unsigned int end,
+                            const KernelRay& ray, float tMin, float& ioT,
+                            unsigned int& outTriangle, float& outBeta, float& outGamma);
+
+    // Whether any of triangles [begin, end) is hit in [tMin, tMax)
+    bool (*anyTriangle)(const LeafTriangles& triangles, unsigned int begin, unsigned int end,
+                        const KernelRay& ray, float tMin, float tMax);
+
+    // 8 bit RGB for count pixels, whose r, g and b are the first three of
+    // every stride floats, clamped to [0, 1]
+    void (*quantizePixels)(const float *pixels, size_t stride, size_t count,
+                           unsigned char *outRGB);
+};
+
+// The kernels in use.  The first call picks the best ones the CPU can run.
+const Kernels& kernels();
+
+// Use the kernels built for the named instruction set instead (see
+// kernelNames()); returns false, and changes nothing, if there are none by
+// that name that the CPU can run
+bool selectKernels(const char *name);
+
+// Names of the instruction sets there are kernels for, best last
+// ("sse2 avx2", say)
+const char* kernelNames();
+
+// Names of the instruction set extensions the CPU has that matter to us
+// ("sse2 avx avx2", say)
+const char* cpuFeatures();
+
+} // namespace kt
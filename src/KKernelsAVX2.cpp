@@ -0,0 +1,24 @@
+//
+// The kernels built for AVX2.  The Makefile builds this file with -mavx2;
+// without it there are none.  Nothing here may run until KKernels.cpp has
+// checked the CPU has AVX2, so this only defines data.
+//
+
+#include "KKernels.h"
+
+#if defined(__AVX2__)
+
+#define KT_KERNEL_TABLE kAVX2KernelTable
+#include "KKernelCode.h"
+
+namespace kt{
+extern const Kernels* const kAVX2Kernels = &kAVX2KernelTable;
+}
+
+#else
+
+namespace kt{
+extern const Kernels* const kAVX2Kernels = NULL;
+}
+
+#endif
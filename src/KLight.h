@@ -8,6 +8,141 @@
 
 namespace kt{
 
+//
+// Light bounds
+//
+// A conservative outline of where some light comes from, which way it goes
+// and how much of it there is, good for guessing how much of it reaches a
+// given point.  The light BVH keeps one for each of its nodes.  The normals
+// of the emitting surfaces all lie within acos(m_cosNormals) of m_axis, and
+// light leaves each surface at up to acos(m_cosEmission) from its normal
+// (0, that is 90 degrees, for area lights).  See "Importance Sampling of
+// Many Lights with Adaptive Tree Splitting", Conty Estevez and Kulla, HPG
+// 2018, and its use in pbrt-v4.
+//
+struct LightBounds
+{
+    BBox m_bbox;
+    // Luminance of all the light given off
+    float m_power;
+    Vector m_axis;
+    float m_cosNormals, m_cosEmission;
+    // Emits from the back of the surfaces too
+    bool m_twoSided;
+    
+    LightBounds()
+        : m_bbox(), m_power(0.0f), m_axis(0.0f, 0.0f, 1.0f),
+          m_cosNormals(1.0f), m_cosEmission(0.0f), m_twoSided(false) { }
+    
+    LightBounds(const BBox& bbox, float power, const Vector& axis,
+                float cosNormals, float cosEmission, bool twoSided)
+        : m_bbox(bbox), m_power(power), m_axis(axis),
+          m_cosNormals(cosNormals), m_cosEmission(cosEmission), m_twoSided(twoSided) { }
+    
+    // Bounds of both
+    LightBounds combined(const LightBounds& b) const
+    {
+        LightBounds result(m_bbox.combined(b.m_bbox), m_power + b.m_power, m_axis,
+                           m_cosNormals, std::min(m_cosEmission, b.m_cosEmission),
+                           m_twoSided || b.m_twoSided);
+        combineCones(m_axis, m_cosNormals, b.m_axis, b.m_cosNormals,
+                     result.m_axis, result.m_cosNormals);
+        return result;
+    }
+    
+    // Estimate of how much of the light reaches a point with the given
+    // surface normal.  It's only zero if none of it can.
+    float importance(const Point& p, const Vector& n) const
+    {
+        // The light's direction as seen from the point, and the cone of
+        // directions the box fills from there
+        Point center = m_bbox.center();
+        Vector toPoint = p - center;
+        float dist2 = toPoint.length2();
+        float radius2 = (m_bbox.m_max - m_bbox.m_min).length2() * 0.25f;
+        float cosBox = -1.0f;
+        if (dist2 > radius2)
+            cosBox = std::sqrt(std::max(0.0f, 1.0f - radius2 / dist2));
+        float sinBox = std::sqrt(std::max(0.0f, 1.0f - cosBox * cosBox));
+        toPoint = dist2 > 0.0f ? toPoint / std::sqrt(dist2) : Vector(0.0f, 0.0f, 1.0f);
+        
+        // Smallest angle between a light normal and a direction towards
+        // the point; not being behind an area light only takes that angle
+        // to be under 90 degrees
+        float cosToPoint = dot(m_axis, toPoint);
+        if (m_twoSided)
+            cosToPoint = std::fabs(cosToPoint);
+        float sinToPoint = std::sqrt(std::max(0.0f, 1.0f - cosToPoint * cosToPoint));
+        float sinNormals = std::sqrt(std::max(0.0f, 1.0f - m_cosNormals * m_cosNormals));
+        float cosOutside = cosSubtract(sinToPoint, cosToPoint, sinNormals, m_cosNormals);
+        float sinOutside = sinSubtract(sinToPoint, cosToPoint, sinNormals, m_cosNormals);
+        float cosEmitted = cosSubtract(sinOutside, cosOutside, sinBox, cosBox);
+        if (cosEmitted <= m_cosEmission)
+            return 0.0f;
+        
+        // Same for the point's own normal (either side; it might be
+        // lighting the back of something that lets light through)
+        float cosIncident = std::fabs(dot(toPoint, n));
+        float sinIncident = std::sqrt(std::max(0.0f, 1.0f - cosIncident * cosIncident));
+        float cosReceived = cosSubtract(sinIncident, cosIncident, sinBox, cosBox);
+        
+        // Don't let the distance get any less than the light's size, or
+        // everything close to a big light looks like it's right up against it
+        return std::max(0.0f, m_power * cosEmitted * cosReceived / std::max(dist2, radius2));
+    }
+    
+    // cos(max(a - b, 0)) and sin(max(a - b, 0)), from the sines and cosines
+    static float cosSubtract(float sinA, float cosA, float sinB, float cosB)
+    {
+        return cosA > cosB ? 1.0f : cosA * cosB + sinA * sinB;
+    }
+    
+    static float sinSubtract(float sinA, float cosA, float sinB, float cosB)
+    {
+        return cosA > cosB ? 0.0f : sinA * cosB - cosA * sinB;
+    }
+    
+    // Smallest cone holding two cones of directions
+    static void combineCones(const Vector& axisA, float cosA, const Vector& axisB, float cosB,
+                             Vector& outAxis, float& outCos)
+    {
+        float angleA = std::acos(std::min(std::max(cosA, -1.0f), 1.0f));
+        float angleB = std::acos(std::min(std::max(cosB, -1.0f), 1.0f));
+        float angleBetween = std::acos(std::min(std::max(dot(axisA, axisB), -1.0f), 1.0f));
+        // One inside the other?
+        if (std::min(angleBetween + angleB, float(M_PI)) <= angleA)
+        {
+            outAxis = axisA;
+            outCos = cosA;
+            return;
+        }
+        if (std::min(angleBetween + angleA, float(M_PI)) <= angleB)
+        {
+            outAxis = axisB;
+            outCos = cosB;
+            return;
+        }
+        // Otherwise the new cone spans from the far side of one to the far
+        // side of the other, so turn A's axis towards B's to its middle
+        float angle = (angleA + angleBetween + angleB) * 0.5f;
+        Vector turnAxis = cross(axisA, axisB);
+        if (angle >= float(M_PI) || turnAxis.length2() == 0.0f)
+        {
+            outAxis = axisA;
+            outCos = -1.0f;
+            return;
+        }
+        turnAxis.normalize();
+        float turn = angle - angleA;
+        float cosTurn = std::cos(turn), sinTurn = std::sin(turn);
+        outAxis = axisA * cosTurn + cross(turnAxis, axisA) * sinTurn +
+                  turnAxis * (dot(turnAxis, axisA) * (1.0f - cosTurn));
+        outAxis.normalize();
+        outCos = std::cos(angle);
+    }
+};
+
+
 // Light base class, making it easy to find all the lights in the scene.
 class Light : public Shape
 {
@@ -22,7 +157,44 @@ public:
     
     virtual Color emitted() const { return m_color * m_power; }
     
-    virtual float intersectPDF(const Intersection& intersection) = 0;
+    // PDF (with respect to solid angle) of the ray having hit the light where
+    // it did, if the intersection is on this light
+    virtual float intersectPDF(const Ray& ray, const Intersection& intersection) = 0;
+    
+    // A light can be made of many pieces ("emitters") that lighting chooses
+    // between one at a time, like the triangles of a mesh light.  Most lights
+    // are a single emitter, which is the whole light.
+    virtual unsigned int numEmitters() const { return 1; }
+    
+    // Where an emitter is, which way it faces and how much light it gives
+    // off, for choosing between them (see the LightSampler)
+    virtual LightBounds emitterBounds(unsigned int emitter) = 0;
+    
+    // Like sampleSurface(), but only on the given emitter
+    virtual bool sampleEmitter(unsigned int emitter,
+                               const Point& surfPosition,
+                               const Vector& surfNormal,
+                               float refTime,
+                               float u1, float u2, float u3,
+                               Point& outPosition,
+                               Vector& outNormal,
+                               float& outPDF)
+    {
+        return sampleSurface(surfPosition, surfNormal, refTime, u1, u2, u3,
+                             outPosition, outNormal, outPDF);
+    }
+    
+    // Which emitter an intersection on this light is on, and the PDF (with
+    // respect to solid angle) of sampleEmitter() having picked it
+    virtual unsigned int emitterHit(const Intersection& intersection) const { return 0; }
+    
+    virtual float emitterPDF(unsigned int emitter, const Ray& ray, const Intersection& intersection)
+    {
+        return intersectPDF(ray, intersection);
+    }
+    
+    // Lights off at infinity have nowhere to be in the light BVH
+    virtual bool isDistant() const { return false; }
 
 protected:
     Color m_color;
@@ -32,6 +204,11 @@ protected:
 };
 
 
+// Below this solid angle (in steradians), a spherical rectangle's angles can't
+// be worked out precisely enough in floats, but the light is also small enough
+// to be sampled just as well by area
+const float kMinSphericalRectangleSolidAngle = 1.0e-3f;
+
 // Area light with a corner and two sides to define a rectangular/parallelipiped shape
 class RectangleLight : public Light
 {
@@ -48,9 +225,9 @@ public:
     
     virtual ~RectangleLight() { }
     
-    virtual bool intersect(Intersection& intersection)
+    virtual bool intersect(const Ray& ray, Intersection& intersection)
     {
-        Ray localRay = intersection.m_ray.transformToLocal(m_transform);
+        Ray localRay = ray.transformToLocal(m_transform);
         
         // This is much like a plane intersection, except we also range check it
         // to make sure it's within the rectangle.  Please see the plane shape
@@ -95,12 +272,13 @@ public:
         // This intersection is the closest so far, so record it.
         intersection.m_t = t;
         intersection.m_pShape = this;
+        intersection.m_primID = kNoPrimitive;
         intersection.m_pMaterial = &m_material;
         intersection.m_colorModifier = Color(1.0f, 1.0f, 1.0f);
         intersection.m_normal = m_transform.fromLocalNormal(localRay.m_time, normal);
         // Hit the back side of the light?  We'll count it, so flip the normal
         // to effectively make a double-sided light.
-        if (dot(intersection.m_normal, intersection.m_ray.m_direction) > 0.0f)
+        if (dot(intersection.m_normal, ray.m_direction) > 0.0f)
         {
             intersection.m_normal *= -1.0f;
         }
@@ -175,7 +353,10 @@ public:
     }
     
     // Given two random numbers between 0.0 and 1.0, find a location + surface
-    // normal on the surface of the *light*.
+    // normal on the surface of the *light*.  Points get spread evenly over
+    // the solid angle the light covers, as seen from the surface; if that's
+    // too small to work out precisely (or the light isn't a rectangle) they
+    // get spread evenly over its area instead.
     virtual bool sampleSurface(const Point& surfPosition,
                                const Vector& surfNormal,
                                float refTime,
@@ -186,14 +367,30 @@ public:
     {
         // Take care which calculations must be done in local space, 
         // and which should be non-local
-        outPosition = m_position + m_side1 * u1 + m_side2 * u2;
-        outPosition = m_transform.fromLocalPoint(refTime, outPosition);
+        Point corner = m_transform.fromLocalPoint(refTime, m_position);
+        Vector side1 = m_transform.fromLocalVector(refTime, m_side1);
+        Vector side2 = m_transform.fromLocalVector(refTime, m_side2);
+        outNormal = cross(side1, side2);
+        float area = outNormal.normalize();
+        if (sphericalSampling(side1, side2))
+        {
+            SphericalRectangle rect(corner, side1, side2, surfPosition);
+            if (rect.solidAngle() >= kMinSphericalRectangleSolidAngle)
+            {
+                outPosition = rect.sample(u1, u2);
+                // Double-sided, so face the surface
+                if (dot(outNormal, surfPosition - outPosition) < 0.0f)
+                {
+                    outNormal *= -1.0f;
+                }
+                outPDF = 1.0f / rect.solidAngle();
+                return true;
+            }
+        }
+        
+        outPosition = corner + side1 * u1 + side2 * u2;
         Vector outgoing = surfPosition - outPosition;
         float dist = outgoing.normalize();
-        outNormal = cross(m_side1, m_side2);
-        // Transform out as a vector to preserve scale (we need it for the area calculation)
-        outNormal = m_transform.fromLocalVector(refTime, outNormal);
-        float area = outNormal.normalize();
         // Reference point out in back of the light?  That's okay, we'll flip
         // the normal to have a double-sided light.
         if (dot(outNormal, outgoing) < 0.0f)
@@ -211,16 +408,24 @@ public:
         return true;
     }
     
-    virtual float intersectPDF(const Intersection& intersection)
+    virtual float intersectPDF(const Ray& ray, const Intersection& intersection)
     {
         if (intersection.m_pShape == this)
         {
             // Take care which calculations must be done in local space,
             // and which should be non-local
-            Vector side1 = m_transform.fromLocalVector(intersection.m_ray.m_time, m_side1);
-            Vector side2 = m_transform.fromLocalVector(intersection.m_ray.m_time, m_side2);
+            Vector side1 = m_transform.fromLocalVector(ray.m_time, m_side1);
+            Vector side2 = m_transform.fromLocalVector(ray.m_time, m_side2);
+            // This has to make the same choice sampleSurface() would have
+            if (sphericalSampling(side1, side2))
+            {
+                SphericalRectangle rect(m_transform.fromLocalPoint(ray.m_time, m_position),
+                                        side1, side2, ray.m_origin);
+                if (rect.solidAngle() >= kMinSphericalRectangleSolidAngle)
+                    return 1.0f / rect.solidAngle();
+            }
             float pdf = intersection.m_t * intersection.m_t /
-                        (std::fabs(dot(intersection.m_normal, -intersection.m_ray.m_direction)) *
+                        (std::fabs(dot(intersection.m_normal, -ray.m_direction)) *
                          cross(side1, side2).length());
             // Really big PDFs blow up power-heuristic MIS; detect it and don't
             // sample in that case
@@ -233,17 +438,57 @@ public:
         return 0.0f;
     }
     
+    virtual LightBounds emitterBounds(unsigned int emitter)
+    {
+        // Lights both ways, from an area that might change as it moves
+        Vector axis;
+        float cosNormals = 1.0f, area = 0.0f;
+        for (size_t ti = 0; ti < m_transform.numKeys(); ++ti)
+        {
+            float time = m_transform.keyTime(ti);
+            Vector normal = cross(m_transform.fromLocalVector(time, m_side1),
+                                  m_transform.fromLocalVector(time, m_side2));
+            if (ti == 0)
+            {
+                area = normal.normalize();
+                axis = normal;
+            }
+            else
+            {
+                LightBounds::combineCones(axis, cosNormals, normal.normalized(), 1.0f, axis, cosNormals);
+            }
+        }
+        return LightBounds(bbox(), emitted().luminance() * area * 2.0f,
+                           axis, cosNormals, 0.0f, true);
+    }
+    
 protected:
     Point m_position;
     Vector m_side1, m_side2;
+    
+    // Spherical rectangle sampling only works on rectangles, and the sides
+    // could get sheared by the transform even if they start out square
+    static bool sphericalSampling(const Vector& side1, const Vector& side2)
+    {
+        return std::fabs(dot(side1, side2)) <= 1.0e-4f * side1.length() * side2.length();
+    }
 };
 
 
+// Spherical triangles are sampled between these solid angles (in steradians).
+// Below it the angles can't be worked out precisely enough in floats, but the
+// triangle is small enough to be sampled just as well by area; above it the
+// viewer is nearly on the triangle, where the angles go wrong again.
+const float kMinSphericalTriangleSolidAngle = 3.0e-4f;
+const float kMaxSphericalTriangleSolidAngle = 6.22f;
+
 // Mesh light based on an arbitrary shape from the scene.  Note that transforming
 // this actual light will have no effect; you should transform the shape that it
 // is attached to.
 //
-// The MeshLight is not stable right now, we need to improve light sample algorithm.
+// Lighting takes its samples a triangle at a time (see numEmitters()), with
+// points spread evenly over the solid angle of the triangle, so big triangles
+// close to the surface being lit are no noisier than small distant ones.
 class MeshLight : public Light
 {
 public:
@@ -257,10 +502,10 @@ public:
     
     virtual ~MeshLight() { }
     
-    virtual bool intersect(Intersection& intersection)
+    virtual bool intersect(const Ray& ray, Intersection& intersection)
     {
         // Forward intersection test on to the shape, but patch in the light material
-        if (m_pShape->intersect(intersection))
+        if (m_pShape->intersect(ray, intersection))
         {
             intersection.m_pMaterial = &m_material;
             intersection.m_pShape = this;
@@ -311,21 +556,140 @@ public:
         return true;
     }
     
-    virtual float intersectPDF(const Intersection& intersection)
+    virtual float intersectPDF(const Ray& ray, const Intersection& intersection)
     {
         if (intersection.m_pShape == this)
         {
-            return m_pShape->pdfSA(intersection.m_ray.m_origin,
-                                   intersection.m_ray.m_direction, // TODO: this isn't quite correct, but it's unused ATM
-                                   intersection.m_ray.m_time,
-                                   intersection.position(),
+            return m_pShape->pdfSA(ray.m_origin,
+                                   ray.m_direction, // TODO: this isn't quite correct, but it's unused ATM
+                                   ray.m_time,
+                                   intersection.position(ray),
                                    intersection.m_normal);
         }
         return 0.0f;
     }
     
+    // Each triangle of the mesh is an emitter of its own, so lighting can
+    // favour the ones that face the point being lit and are close to it
+    virtual unsigned int numEmitters() const { return m_pShape->numTriangles(); }
+    
+    virtual LightBounds emitterBounds(unsigned int emitter)
+    {
+        const Transform& transform = m_pShape->transform();
+        BBox bbox;
+        Vector axis;
+        float cosNormals = 1.0f, area = 0.0f;
+        for (size_t ti = 0; ti < transform.numKeys(); ++ti)
+        {
+            Point p0, p1, p2;
+            triangleCorners(emitter, transform.keyTime(ti), p0, p1, p2);
+            bbox.expand(p0);
+            bbox.expand(p1);
+            bbox.expand(p2);
+            Vector normal = cross(p1 - p0, p2 - p0);
+            if (ti == 0)
+            {
+                area = normal.normalize() * 0.5f;
+                axis = normal;
+            }
+            else
+            {
+                LightBounds::combineCones(axis, cosNormals, normal.normalized(), 1.0f, axis, cosNormals);
+            }
+        }
+        return LightBounds(bbox, emitted().luminance() * area, axis, cosNormals, 0.0f, false);
+    }
+    
+    virtual bool sampleEmitter(unsigned int emitter,
+                               const Point& surfPosition,
+                               const Vector& surfNormal,
+                               float refTime,
+                               float u1, float u2, float u3,
+                               Point& outPosition,
+                               Vector& outNormal,
+                               float& outPDF)
+    {
+        Point p0, p1, p2;
+        triangleCorners(emitter, refTime, p0, p1, p2);
+        outNormal = cross(p1 - p0, p2 - p0);
+        float area = outNormal.normalize() * 0.5f;
+        // The light is one-sided, so there's nothing to sample from behind
+        if (dot(outNormal, surfPosition - p0) <= 0.0f)
+        {
+            outPDF = 0.0f;
+            return false;
+        }
+        SphericalTriangle triangle(p0, p1, p2, surfPosition);
+        if (sphericalSampling(triangle))
+        {
+            outPosition = triangle.sample(u1, u2);
+            outPDF = 1.0f / triangle.solidAngle();
+            return true;
+        }
+        float alpha = 0.0f, beta = 0.0f;
+        uniformToBarycentricTriangle(u1, u2, alpha, beta);
+        outPosition = p0 * alpha + p1 * beta + p2 * (1.0f - alpha - beta);
+        outPDF = trianglePDF(surfPosition, outPosition, outNormal, area);
+        return outPDF > 0.0f;
+    }
+    
+    virtual unsigned int emitterHit(const Intersection& intersection) const
+    {
+        return intersection.m_primID;
+    }
+    
+    virtual float emitterPDF(unsigned int emitter, const Ray& ray, const Intersection& intersection)
+    {
+        if (intersection.m_pShape != this || emitter >= numEmitters())
+            return 0.0f;
+        Point p0, p1, p2;
+        triangleCorners(emitter, ray.m_time, p0, p1, p2);
+        Vector normal = cross(p1 - p0, p2 - p0);
+        float area = normal.normalize() * 0.5f;
+        // This has to make the same choice sampleEmitter() would have
+        if (dot(normal, ray.m_origin - p0) <= 0.0f)
+            return 0.0f;
+        SphericalTriangle triangle(p0, p1, p2, ray.m_origin);
+        if (sphericalSampling(triangle))
+            return 1.0f / triangle.solidAngle();
+        return trianglePDF(ray.m_origin, intersection.position(ray), normal, area);
+    }
+    
 protected:
-    Shape *m_pShape;
+    Polymesh *m_pShape;
+    
+    // A triangle of the mesh, in world space at the given time
+    void triangleCorners(unsigned int tri, float time, Point& outP0, Point& outP1, Point& outP2) const
+    {
+        const Transform& transform = m_pShape->transform();
+        outP0 = transform.fromLocalPoint(time, m_pShape->triangleVertex(tri, 0));
+        outP1 = transform.fromLocalPoint(time, m_pShape->triangleVertex(tri, 1));
+        outP2 = transform.fromLocalPoint(time, m_pShape->triangleVertex(tri, 2));
+    }
+    
+    // Whether a triangle's solid angle is in the range it can be sampled by
+    static bool sphericalSampling(const SphericalTriangle& triangle)
+    {
+        return triangle.solidAngle() >= kMinSphericalTriangleSolidAngle &&
+               triangle.solidAngle() <= kMaxSphericalTriangleSolidAngle;
+    }
+    
+    // PDF (with respect to solid angle at the reference point) of a uniform
+    // sample on a triangle landing where it did; the light is one-sided, so
+    // there's no chance of landing on its back
+    static float trianglePDF(const Point& refPosition, const Point& lightPosition,
+                             const Vector& lightNormal, float area)
+    {
+        Vector toRef = refPosition - lightPosition;
+        float dist2 = toRef.length2();
+        float cosLight = dot(lightNormal, toRef);
+        if (cosLight <= 0.0f || area <= 0.0f)
+            return 0.0f;
+        float pdf = dist2 * std::sqrt(dist2) / (area * cosLight);
+        // Really big PDFs blow up power-heuristic MIS; detect it and don't
+        // sample in that case
+        return pdf > 1.0e10f ? 0.0f : pdf;
+    }
 };
 
 // Directional light, distant light like sun light , is this physical?
@@ -345,7 +709,7 @@ public:
     
     virtual ~DistantLight() { }
     
-    virtual bool intersect(Intersection& intersection)
+    virtual bool intersect(const Ray& ray, Intersection& intersection)
     {   
         return false;
     }
@@ -355,6 +719,14 @@ public:
         return false;
     }
     
+    virtual void prepare()
+    {
+        // Park the light far away; this is done here rather than while
+        // sampling since lights get sampled from many threads at once.
+        m_transform.setTranslation(0.0f, Vector(1000.0f, 1000.0f, 1000.0f));
+        Light::prepare();
+    }
+    
     virtual BBox bbox()
     {
         // Calculate bbox in non-local space
@@ -378,7 +750,6 @@ public:
         // outPosition = outPosition.normalized();
         outPosition = m_direction + surfPosition;
         outPosition = outPosition*(u1+u2)*u3;
-        m_transform.setTranslation(0.0f, Vector(1000.0f, 1000.0f, 1000.0f));
         outPosition = m_transform.fromLocalPoint(refTime, outPosition);
         Vector outgoing = m_direction;
         float dist = outgoing.normalize();
@@ -420,15 +791,23 @@ public:
         // return true;
     }
     
-    virtual float intersectPDF(const Intersection& intersection)
+    // Distant lights have no size, so their "power" is just how bright they are
+    virtual LightBounds emitterBounds(unsigned int emitter)
+    {
+        return LightBounds(BBox(), emitted().luminance(), m_direction.normalized(), -1.0f, -1.0f, true);
+    }
+    
+    virtual bool isDistant() const { return true; }
+    
+    virtual float intersectPDF(const Ray& ray, const Intersection& intersection)
     {
         if (intersection.m_pShape == this)
         {
             // Take care which calculations must be done in local space,
             // and which should be non-local
-            Vector direction_local = m_transform.fromLocalVector(intersection.m_ray.m_time, m_direction);
+            Vector direction_local = m_transform.fromLocalVector(ray.m_time, m_direction);
             float pdf = intersection.m_t * intersection.m_t /
-                        (std::fabs(dot(intersection.m_normal, -intersection.m_ray.m_direction)) *
+                        (std::fabs(dot(intersection.m_normal, -ray.m_direction)) *
                          direction_local.length());
             // Really big PDFs blow up power-heuristic MIS; detect it and don't
             // sample in that case
@@ -0,0 +1,379 @@
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "KLightSampler.h"
+
+
+namespace kt{
+
+// Candidate split planes (+1) tried along each axis when building the BVH
+const unsigned int kLightBVHBins = 12;
+
+// Past this depth the BVH splits at the median, which keeps the way down to
+// any leaf within the 64 bits of a Path
+const unsigned int kLightBVHMaxBinnedDepth = 32;
+
+// Paths of emitters that never get picked, and of distant lights
+const unsigned int kNoLightNode = 0xffffffffu;
+const unsigned int kDistantLightNode = 0xfffffffeu;
+
+// Largest float under 1
+const float kOneMinusEpsilon = 0.99999994f;
+
+struct LightSampler::BuildItem
+{
+    unsigned int m_emitter;
+    LightBounds m_bounds;
+    Point m_centroid;
+};
+
+
+bool parseLightSelection(const char* name, LightSelection& outSelection)
+{
+    if (std::strcmp(name, "power") == 0)
+        outSelection = kLightSelectPower;
+    else if (std::strcmp(name, "bvh") == 0)
+        outSelection = kLightSelectBVH;
+    else
+        return false;
+    return true;
+}
+
+const char* lightSelectionName(LightSelection selection)
+{
+    switch (selection)
+    {
+    case kLightSelectPower: return "power";
+    default:                return "bvh";
+    }
+}
+
+
+// Cost of a BVH node with the given bounds: its power, times the solid angle
+// its light might go out in, times its surface area (pbrt-v4's take on the
+// surface area heuristic for lights)
+static float boundsCost(const LightBounds& bounds)
+{
+    float cosNormals = std::min(std::max(bounds.m_cosNormals, -1.0f), 1.0f);
+    float angleNormals = std::acos(cosNormals);
+    float angleEmission = std::acos(std::min(std::max(bounds.m_cosEmission, -1.0f), 1.0f));
+    float angleAll = std::min(angleNormals + angleEmission, float(M_PI));
+    float sinNormals = std::sqrt(std::max(0.0f, 1.0f - cosNormals * cosNormals));
+    float solidAngle = 2.0f * M_PI * (1.0f - cosNormals) +
+                       M_PI * 0.5f * (2.0f * angleAll * sinNormals -
+                                      std::cos(angleNormals - 2.0f * angleAll) -
+                                      2.0f * angleNormals * sinNormals + cosNormals);
+    return bounds.m_power * solidAngle * bounds.m_bbox.surfaceArea();
+}
+
+
+void LightSampler::build(const std::vector<Shape*>& lights, LightSelection selection)
+{
+    m_emitters.clear();
+    m_firstEmitter.clear();
+    m_distantEmitters.clear();
+    m_nodes.clear();
+    m_paths.clear();
+
+    for (size_t i = 0; i < lights.size(); ++i)
+    {
+        Light *pLight = (Light*) lights[i];
+        m_firstEmitter[pLight] = (unsigned int) m_emitters.size();
+        for (unsigned int e = 0; e < pLight->numEmitters(); ++e)
+        {
+            Emitter emitter = { pLight, e };
+            m_emitters.push_back(emitter);
+        }
+    }
+    m_selection = selection;
+
+    if (m_selection == kLightSelectPower)
+    {
+        std::vector<float> powers(m_emitters.size());
+        for (size_t i = 0; i < m_emitters.size(); ++i)
+        {
+            powers[i] = m_emitters[i].m_pLight->emitterBounds(m_emitters[i].m_emitter).m_power;
+        }
+        m_powerTable.build(powers);
+        return;
+    }
+
+    // Emitters that give off nothing never get picked
+    Path noPath = { kNoLightNode, 0 };
+    m_paths.assign(m_emitters.size(), noPath);
+    std::vector<BuildItem> items;
+    for (size_t i = 0; i < m_emitters.size(); ++i)
+    {
+        const Emitter& emitter = m_emitters[i];
+        LightBounds bounds = emitter.m_pLight->emitterBounds(emitter.m_emitter);
+        if (!(bounds.m_power > 0.0f))
+            continue;
+        if (emitter.m_pLight->isDistant())
+        {
+            m_distantEmitters.push_back((unsigned int) i);
+            m_paths[i].m_leaf = kDistantLightNode;
+            continue;
+        }
+        BuildItem item = { (unsigned int) i, bounds, bounds.m_bbox.center() };
+        items.push_back(item);
+    }
+    if (!items.empty())
+    {
+        m_nodes.reserve(items.size() * 2 - 1);
+        buildNode(items, 0, items.size(), 0, 0);
+    }
+}
+
+
+unsigned int LightSampler::buildNode(std::vector<BuildItem>& items, size_t begin, size_t end,
+                                     uint64_t bits, unsigned int depth)
+{
+    unsigned int nodeIndex = (unsigned int) m_nodes.size();
+    m_nodes.push_back(Node());
+    if (end - begin == 1)
+    {
+        m_nodes[nodeIndex].m_bounds = items[begin].m_bounds;
+        m_nodes[nodeIndex].m_index = items[begin].m_emitter;
+        m_nodes[nodeIndex].m_leaf = true;
+        m_paths[items[begin].m_emitter].m_leaf = nodeIndex;
+        m_paths[items[begin].m_emitter].m_bits = bits;
+        return nodeIndex;
+    }
+
+    LightBounds bounds = items[begin].m_bounds;
+    BBox centroids;
+    for (size_t i = begin; i < end; ++i)
+    {
+        if (i > begin)
+            bounds = bounds.combined(items[i].m_bounds);
+        centroids.expand(items[i].m_centroid);
+    }
+
+    // Bin the emitters along each axis and find the cheapest split between
+    // bins; stretched boxes get a penalty for splitting along their short
+    // sides, since the cost doesn't look at which way they're stretched
+    Vector extents = bounds.m_bbox.m_max - bounds.m_bbox.m_min;
+    float bestCost = std::numeric_limits<float>::max();
+    unsigned int bestAxis = 0, bestBin = 0;
+    bool binned = false;
+    for (unsigned int axis = 0; axis < 3 && depth < kLightBVHMaxBinnedDepth; ++axis)
+    {
+        float lo = centroids.m_min[axis], hi = centroids.m_max[axis];
+        if (!(hi > lo))
+            continue;
+        LightBounds binBounds[kLightBVHBins];
+        size_t binCounts[kLightBVHBins] = { 0 };
+        for (size_t i = begin; i < end; ++i)
+        {
+            unsigned int bin = std::min((unsigned int)((items[i].m_centroid[axis] - lo) / (hi - lo) * kLightBVHBins),
+                                        kLightBVHBins - 1);
+            binBounds[bin] = binCounts[bin] == 0 ? items[i].m_bounds : binBounds[bin].combined(items[i].m_bounds);
+            binCounts[bin]++;
+        }
+        // Bounds of everything in bins [split, kLightBVHBins), swept in from
+        // the top, so each split only has to add a bin to what's below it
+        float stretch = extents.maxComponent() / extents[axis];
+        LightBounds aboveBounds[kLightBVHBins];
+        size_t aboveCounts[kLightBVHBins + 1] = { 0 };
+        for (unsigned int bin = kLightBVHBins; bin-- > 0; )
+        {
+            aboveCounts[bin] = aboveCounts[bin + 1] + binCounts[bin];
+            if (binCounts[bin] == 0)
+                aboveBounds[bin] = bin + 1 < kLightBVHBins ? aboveBounds[bin + 1] : LightBounds();
+            else
+                aboveBounds[bin] = aboveCounts[bin + 1] == 0 ? binBounds[bin] : binBounds[bin].combined(aboveBounds[bin + 1]);
+        }
+        LightBounds below;
+        size_t numBelow = 0;
+        for (unsigned int split = 1; split < kLightBVHBins; ++split)
+        {
+            if (binCounts[split - 1] > 0)
+            {
+                below = numBelow == 0 ? binBounds[split - 1] : below.combined(binBounds[split - 1]);
+                numBelow += binCounts[split - 1];
+            }
+            if (numBelow == 0 || aboveCounts[split] == 0)
+                continue;
+            float cost = stretch * (boundsCost(below) + boundsCost(aboveBounds[split]));
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = split;
+                binned = true;
+            }
+        }
+    }
+
+    size_t mid = begin;
+    if (binned)
+    {
+        float lo = centroids.m_min[bestAxis], hi = centroids.m_max[bestAxis];
+        BuildItem *pMid = std::partition(&items[begin], &items[0] + end,
+            [=](const BuildItem& item)
+            {
+                unsigned int bin = std::min((unsigned int)((item.m_centroid[bestAxis] - lo) / (hi - lo) * kLightBVHBins),
+                                            kLightBVHBins - 1);
+                return bin < bestBin;
+            });
+        mid = pMid - &items[0];
+    }
+    if (mid == begin || mid == end)
+    {
+        // Nothing to bin (all the emitters are in the same place) or too deep
+        // already; just split them in half along the longest axis
+        Vector centroidExtents = centroids.m_max - centroids.m_min;
+        unsigned int axis = centroidExtents.x >= centroidExtents.y ?
+                            (centroidExtents.x >= centroidExtents.z ? 0 : 2) :
+                            (centroidExtents.y >= centroidExtents.z ? 1 : 2);
+        mid = (begin + end) / 2;
+        std::nth_element(&items[begin], &items[mid], &items[0] + end,
+            [=](const BuildItem& a, const BuildItem& b)
+            {
+                return a.m_centroid[axis] < b.m_centroid[axis];
+            });
+    }
+
+    buildNode(items, begin, mid, bits, depth + 1);
+    unsigned int secondChild = buildNode(items, mid, end, bits | (uint64_t(1) << depth), depth + 1);
+    m_nodes[nodeIndex].m_bounds = bounds;
+    m_nodes[nodeIndex].m_index = secondChild;
+    m_nodes[nodeIndex].m_leaf = false;
+    return nodeIndex;
+}
+
+
+bool LightSampler::empty() const
+{
+    if (m_selection == kLightSelectPower)
+        return m_powerTable.empty();
+    return m_nodes.empty() && m_distantEmitters.empty();
+}
+
+
+float LightSampler::bvhProbability() const
+{
+    return m_nodes.empty() ? 0.0f : 1.0f / (1.0f + m_distantEmitters.size());
+}
+
+
+int LightSampler::emitterIndex(const Light* pLight, unsigned int emitter) const
+{
+    std::unordered_map<const Light*, unsigned int>::const_iterator iter = m_firstEmitter.find(pLight);
+    if (iter == m_firstEmitter.end() || emitter >= pLight->numEmitters())
+        return -1;
+    return (int)(iter->second + emitter);
+}
+
+
+bool LightSampler::sample(const Point& position, const Vector& normal, float u,
+                          Light*& outLight, unsigned int& outEmitter, float& outPmf) const
+{
+    outPmf = 0.0f;
+    if (empty())
+        return false;
+
+    unsigned int index = 0;
+    if (m_selection == kLightSelectPower)
+    {
+        index = (unsigned int) m_powerTable.sample(u, outPmf);
+    }
+    else
+    {
+        float bvhChance = bvhProbability();
+        if (u >= bvhChance)
+        {
+            // A distant light
+            u = (u - bvhChance) / (1.0f - bvhChance);
+            size_t distant = std::min((size_t)(u * m_distantEmitters.size()), m_distantEmitters.size() - 1);
+            index = m_distantEmitters[distant];
+            outPmf = (1.0f - bvhChance) / m_distantEmitters.size();
+        }
+        else
+        {
+            // Walk down the BVH, reusing what's left of u after each choice
+            u = std::min(u / bvhChance, kOneMinusEpsilon);
+            float pmf = bvhChance;
+            unsigned int nodeIndex = 0;
+            while (!m_nodes[nodeIndex].m_leaf)
+            {
+                const Node& node = m_nodes[nodeIndex];
+                float importance0 = m_nodes[nodeIndex + 1].m_bounds.importance(position, normal);
+                float importance1 = m_nodes[node.m_index].m_bounds.importance(position, normal);
+                if (importance0 <= 0.0f && importance1 <= 0.0f)
+                    return false;
+                float p0 = importance0 / (importance0 + importance1);
+                if (u < p0)
+                {
+                    nodeIndex = nodeIndex + 1;
+                    u = std::min(u / p0, kOneMinusEpsilon);
+                    pmf *= p0;
+                }
+                else
+                {
+                    nodeIndex = node.m_index;
+                    u = std::min((u - p0) / (1.0f - p0), kOneMinusEpsilon);
+                    pmf *= 1.0f - p0;
+                }
+            }
+            // A lone emitter at the root hasn't been looked at yet
+            if (nodeIndex == 0 && m_nodes[0].m_bounds.importance(position, normal) <= 0.0f)
+                return false;
+            index = m_nodes[nodeIndex].m_index;
+            outPmf = pmf;
+        }
+    }
+    outLight = m_emitters[index].m_pLight;
+    outEmitter = m_emitters[index].m_emitter;
+    return outPmf > 0.0f;
+}
+
+
+float LightSampler::pmf(const Point& position, const Vector& normal,
+                        const Light* pLight, unsigned int emitter) const
+{
+    int index = emitterIndex(pLight, emitter);
+    if (index < 0 || empty())
+        return 0.0f;
+    if (m_selection == kLightSelectPower)
+        return m_powerTable.pmf(index);
+
+    const Path& path = m_paths[index];
+    float bvhChance = bvhProbability();
+    if (path.m_leaf == kNoLightNode)
+        return 0.0f;
+    if (path.m_leaf == kDistantLightNode)
+        return (1.0f - bvhChance) / m_distantEmitters.size();
+
+    // Follow the emitter's path down, with the same odds sample() had
+    float pmf = bvhChance;
+    uint64_t bits = path.m_bits;
+    unsigned int nodeIndex = 0;
+    while (!m_nodes[nodeIndex].m_leaf)
+    {
+        const Node& node = m_nodes[nodeIndex];
+        float importance0 = m_nodes[nodeIndex + 1].m_bounds.importance(position, normal);
+        float importance1 = m_nodes[node.m_index].m_bounds.importance(position, normal);
+        if (importance0 <= 0.0f && importance1 <= 0.0f)
+            return 0.0f;
+        float p0 = importance0 / (importance0 + importance1);
+        if (bits & 1)
+        {
+            nodeIndex = node.m_index;
+            pmf *= 1.0f - p0;
+        }
+        else
+        {
+            nodeIndex = nodeIndex + 1;
+            pmf *= p0;
+        }
+        bits >>= 1;
+    }
+    if (nodeIndex == 0 && m_nodes[0].m_bounds.importance(position, normal) <= 0.0f)
+        return 0.0f;
+    return pmf;
+}
+
+} // namespace kt
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#include "KMathCore.h"
+#include "KSampler.h"
+#include "KLight.h"
+
+
+namespace kt{
+
+//
+// Light selection
+//
+// How direct lighting chooses which emitter (a light, or a piece of one like
+// a mesh light's triangle) to take each light sample from.
+//
+// kLightSelectPower picks emitters in proportion to the light they give off,
+// so a dim fill light gets fewer samples than the key light.  It ignores
+// where the lighting is being done, though, so with many lights spread over a
+// scene most samples go to lights that are far away or facing elsewhere.
+//
+// kLightSelectBVH puts the emitters in a bounding volume hierarchy of their
+// bounds, power and orientation (see LightBounds), and walks down it from the
+// point being lit, at each node picking a child in proportion to how much of
+// its light might reach the point.  See "Importance Sampling of Many Lights
+// with Adaptive Tree Splitting", Conty Estevez and Kulla, HPG 2018.
+//
+enum LightSelection
+{
+    kLightSelectPower,
+    kLightSelectBVH
+};
+
+// Name <-> selection, for the command line and the render log
+bool parseLightSelection(const char* name, LightSelection& outSelection);
+const char* lightSelectionName(LightSelection selection);
+
+
+class LightSampler
+{
+public:
+    LightSampler() : m_selection(kLightSelectBVH) { }
+
+    // Gather the emitters of the lights; the lights have to be prepared
+    void build(const std::vector<Shape*>& lights, LightSelection selection);
+
+    LightSelection selection() const { return m_selection; }
+
+    size_t numEmitters() const { return m_emitters.size(); }
+
+    // True if there's nothing giving off any light
+    bool empty() const;
+
+    // Choose an emitter to light a point with the given normal from, with u
+    // in [0, 1).  Returns false if no emitter can light it.
+    bool sample(const Point& position, const Vector& normal, float u,
+                Light*& outLight, unsigned int& outEmitter, float& outPmf) const;
+
+    // Probability of sample() choosing the given emitter of a light
+    float pmf(const Point& position, const Vector& normal,
+              const Light* pLight, unsigned int emitter) const;
+
+private:
+    struct Emitter
+    {
+        Light *m_pLight;
+        unsigned int m_emitter;
+    };
+
+    // Light BVH node; the first child directly follows its parent, and the
+    // second is at m_index.  Leaves hold one emitter, at m_index.
+    struct Node
+    {
+        LightBounds m_bounds;
+        unsigned int m_index;
+        bool m_leaf;
+    };
+
+    // Leaf of each emitter and the way down to it (bit n set when the
+    // second child is taken at depth n)
+    struct Path
+    {
+        unsigned int m_leaf;
+        uint64_t m_bits;
+    };
+
+    // An emitter waiting to go in the BVH
+    struct BuildItem;
+
+    // Build the node for items [begin, end) and everything under it,
+    // returning its index
+    unsigned int buildNode(std::vector<BuildItem>& items, size_t begin, size_t end,
+                           uint64_t bits, unsigned int depth);
+
+    // Which emitter in m_emitters a light's emitter is (or -1)
+    int emitterIndex(const Light* pLight, unsigned int emitter) const;
+
+    // Chance of taking the BVH rather than a distant light
+    float bvhProbability() const;
+
+    LightSelection m_selection;
+    std::vector<Emitter> m_emitters;
+    std::unordered_map<const Light*, unsigned int> m_firstEmitter;
+
+    // Power selection: a table over all of the emitters
+    AliasTable m_powerTable;
+
+    // BVH selection: distant lights can't go in the BVH, so they are picked
+    // between uniformly, as often as the whole BVH is
+    std::vector<unsigned int> m_distantEmitters;
+    std::vector<Node> m_nodes;
+    std::vector<Path> m_paths;
+};
+
+} // namespace kt
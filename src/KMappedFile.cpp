@@ -0,0 +1,90 @@
+
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "KMappedFile.h"
+
+
+namespace kt{
+
+bool MappedFile::open(const char *filename)
+{
+    close();
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+    
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode))
+    {
+        m_size = (size_t) info.st_size;
+        if (m_size == 0)
+        {
+            // Nothing to map, but it's still a perfectly good (empty) file
+            ::close(fd);
+            m_mapped = false;
+            return true;
+        }
+        void *pMap = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (pMap != MAP_FAILED)
+        {
+            // We read front to back, so let the OS read ahead aggressively
+            madvise(pMap, m_size, MADV_SEQUENTIAL);
+            ::close(fd);
+            m_pData = static_cast<const char*>(pMap);
+            m_mapped = true;
+            return true;
+        }
+    }
+    
+    // Can't map it; read the whole thing in instead
+    size_t capacity = 1 << 20;
+    char *pBuffer = new char[capacity];
+    size_t size = 0;
+    for (;;)
+    {
+        if (size == capacity)
+        {
+            char *pBigger = new char[capacity * 2];
+            std::copy(pBuffer, pBuffer + size, pBigger);
+            delete[] pBuffer;
+            pBuffer = pBigger;
+            capacity *= 2;
+        }
+        ssize_t got = ::read(fd, pBuffer + size, capacity - size);
+        if (got < 0)
+        {
+            delete[] pBuffer;
+            ::close(fd);
+            m_size = 0;
+            return false;
+        }
+        if (got == 0)
+            break;
+        size += (size_t) got;
+    }
+    ::close(fd);
+    m_pData = pBuffer;
+    m_size = size;
+    m_mapped = false;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (m_pData != NULL)
+    {
+        if (m_mapped)
+            munmap(const_cast<char*>(m_pData), m_size);
+        else
+            delete[] m_pData;
+    }
+    m_pData = NULL;
+    m_size = 0;
+    m_mapped = false;
+}
+
+} // namespace kt
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+
+
+namespace kt{
+
+//
+// Memory-mapped file
+//
+// Read-only view of a whole file.  The OS pages the file in as we touch it,
+// so big files get read straight out of the page cache instead of being
+// copied through stream buffers a line at a time.  (If the file can't be
+// mapped, say it's a pipe, the whole thing gets read into memory instead.)
+//
+class MappedFile
+{
+public:
+    MappedFile() : m_pData(NULL), m_size(0), m_mapped(false) { }
+    
+    ~MappedFile() { close(); }
+    
+    // Returns false if the file couldn't be opened/read
+    bool open(const char *filename);
+    
+    void close();
+    
+    // The file contents (NOT null-terminated; NULL if the file is empty)
+    const char* data() const { return m_pData; }
+    size_t size() const { return m_size; }
+    
+private:
+    const char *m_pData;
+    size_t m_size;
+    bool m_mapped;
+    
+    // Not copyable
+    MappedFile(const MappedFile&);
+    MappedFile& operator =(const MappedFile&);
+};
+
+} // namespace kt
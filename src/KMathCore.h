@@ -4,6 +4,8 @@
 #include <algorithm>
 #include <vector>
 
+#include "KSIMD.h"
+
 
 #ifndef M_PI
     #define M_PI 3.14159265358979
@@ -14,6 +16,32 @@ namespace kt
 {
 
 
+//
+// Math backend
+//
+// Built with KT_SIMD_MATH (see KSIMD.h), Color and Vector are four floats
+// wide and 16 byte aligned, the last float being padding that nothing reads,
+// so each fits in an SSE register and their arithmetic does all three
+// components with one instruction.  Otherwise they are three plain floats.
+// Either way they give the same results, down to the bit: every component is
+// worked out with the same operations in the same order.
+//
+// The plain floats are the default.  The renderer's math is mostly a few
+// operations at a time on values that come and go as scalars, so the SIMD
+// versions don't buy any speed overall, while making every point and vector
+// in a mesh a third bigger.  (The wide work, like testing a ray against many
+// boxes or triangles at once, is done on SIMDFloat lanes instead.)
+//
+
+#if defined(KT_SIMD_MATH)
+// Whether the first three lanes are all equal
+inline bool equalXYZ(__m128 v1, __m128 v2)
+{
+    return (_mm_movemask_ps(_mm_cmpeq_ps(v1, v2)) & 7) == 7;
+}
+#endif
+
+
 //
 // RGB color class
 //
@@ -27,75 +55,112 @@ namespace kt
 
 struct Color
 {
+#if defined(KT_SIMD_MATH)
+    union
+    {
+        struct { float r, g, b, m_pad; };
+        __m128 m_simd;
+    };
+    
+    Color()                          : m_simd(_mm_setzero_ps())           { }
+    Color(float r, float g, float b) : m_simd(_mm_setr_ps(r, g, b, 0.0f)) { }
+    explicit Color(float f)          : m_simd(_mm_setr_ps(f, f, f, 0.0f)) { }
+    explicit Color(__m128 v)         : m_simd(v)                          { }
+#else
     float r, g, b;
     
     Color()                          : r(0.0f), g(0.0f), b(0.0f)    { }
-    Color(const Color& c)            : r(c.r) , g(c.g) , b(c.b)     { }
     Color(float r, float g, float b) : r(r), g(g), b(b)             { }
     explicit Color(float f)          : r(f), g(f), b(f)             { }
+#endif
     
     
     void clamp(float min = 0.0f, float max = 1.0f)
     {
+#if defined(KT_SIMD_MATH)
+        m_simd = _mm_max_ps(_mm_min_ps(m_simd, _mm_set1_ps(max)), _mm_set1_ps(min));
+#else
         r = std::max(min, std::min(max, r));
         g = std::max(min, std::min(max, g));
         b = std::max(min, std::min(max, b));
+#endif
     }
     
+    // Perceived brightness (Rec. 709 weights)
+    float luminance() const { return 0.2126f * r + 0.7152f * g + 0.0722f * b; }
+    
+    float maxComponent() const { return std::max(std::max(r, g), b); }
     
-    Color& operator =(const Color& c)
-    {
-        r = c.r;
-        g = c.g;
-        b = c.b;
-        return *this;
-    }
     
     Color& operator +=(const Color& c)
     {
+#if defined(KT_SIMD_MATH)
+        m_simd = _mm_add_ps(m_simd, c.m_simd);
+#else
         r += c.r;
         g += c.g;
         b += c.b;
+#endif
         return *this;
     }
     
     Color& operator -=(const Color& c)
     {
+#if defined(KT_SIMD_MATH)
+        m_simd = _mm_sub_ps(m_simd, c.m_simd);
+#else
         r -= c.r;
         g -= c.g;
         b -= c.b;
+#endif
         return *this;
     }
     
     Color& operator *=(const Color& c)
     {
+#if defined(KT_SIMD_MATH)
+        m_simd = _mm_mul_ps(m_simd, c.m_simd);
+#else
         r *= c.r;
         g *= c.g;
         b *= c.b;
+#endif
         return *this;
     }
     
     Color& operator /=(const Color& c)
     {
+#if defined(KT_SIMD_MATH)
+        m_simd = _mm_div_ps(m_simd, c.m_simd);
+#else
         r /= c.r;
         g /= c.g;
         b /= c.b;
+#endif
         return *this;
     }
     
     Color& operator *=(float f)
     {
+#if defined(KT_SIMD_MATH)
+        m_simd = _mm_mul_ps(m_simd, _mm_set1_ps(f));
+#else
         r *= f;
         g *= f;
         b *= f;
+#endif
         return *this;
     }
     
     Color& operator /=(float f)
     {
+#if defined(KT_SIMD_MATH)
+        m_simd = _mm_div_ps(m_simd, _mm_set1_ps(f));
+#else
         r /= f;
         g /= f;
         b /= f;
+#endif
         return *this;
     }
 };
@@ -103,57 +168,85 @@ struct Color
 
 inline Color operator +(const Color& c1, const Color& c2)
 {
+#if defined(KT_SIMD_MATH)
+    return Color(_mm_add_ps(c1.m_simd, c2.m_simd));
+#else
     return Color(c1.r + c2.r,
                  c1.g + c2.g,
                  c1.b + c2.b);
+#endif
 }
 
 
 inline Color operator -(const Color& c1, const Color& c2)
 {
+#if defined(KT_SIMD_MATH)
+    return Color(_mm_sub_ps(c1.m_simd, c2.m_simd));
+#else
     return Color(c1.r - c2.r,
                  c1.g - c2.g,
                  c1.b - c2.b);
+#endif
 }
 
 
 inline Color operator *(const Color& c1, const Color& c2)
 {
+#if defined(KT_SIMD_MATH)
+    return Color(_mm_mul_ps(c1.m_simd, c2.m_simd));
+#else
     return Color(c1.r * c2.r,
                  c1.g * c2.g,
                  c1.b * c2.b);
+#endif
 }
 
 
 inline Color operator /(const Color& c1, const Color& c2)
 {
+#if defined(KT_SIMD_MATH)
+    return Color(_mm_div_ps(c1.m_simd, c2.m_simd));
+#else
     return Color(c1.r / c2.r,
                  c1.g / c2.g,
                  c1.b / c2.b);
+#endif
 }
 
 
 inline Color operator *(const Color& c, float f)
 {
+#if defined(KT_SIMD_MATH)
+    return Color(_mm_mul_ps(_mm_set1_ps(f), c.m_simd));
+#else
     return Color(f * c.r,
                  f * c.g,
                  f * c.b);
+#endif
 }
 
 
 inline Color operator *(float f, const Color& c)
 {
+#if defined(KT_SIMD_MATH)
+    return Color(_mm_mul_ps(_mm_set1_ps(f), c.m_simd));
+#else
     return Color(f * c.r,
                  f * c.g,
                  f * c.b);
+#endif
 }
 
 
 inline Color operator /(const Color& c, float f)
 {
+#if defined(KT_SIMD_MATH)
+    return Color(_mm_div_ps(c.m_simd, _mm_set1_ps(f)));
+#else
     return Color(c.r / f,
                  c.g / f,
                  c.b / f);
+#endif
 }
 
 
@@ -171,12 +264,24 @@ inline Color operator /(const Color& c, float f)
 
 struct Vector
 {
+#if defined(KT_SIMD_MATH)
+    union
+    {
+        struct { float x, y, z, m_pad; };
+        __m128 m_simd;
+    };
+    
+    Vector()                          : m_simd(_mm_setzero_ps())           { }
+    Vector(float x, float y, float z) : m_simd(_mm_setr_ps(x, y, z, 0.0f)) { }
+    explicit Vector(float f)          : m_simd(_mm_setr_ps(f, f, f, 0.0f)) { }
+    explicit Vector(__m128 v)         : m_simd(v)                          { }
+#else
     float x, y, z;
     
     Vector()                          : x(0.0f), y(0.0f), z(0.0f)    { }
-    Vector(const Vector& v)           : x(v.x) , y(v.y) , z(v.z)     { }
     Vector(float x, float y, float z) : x(x), y(y), z(z)             { }
     explicit Vector(float f)          : x(f), y(f), z(f)             { }
+#endif
     
     
     float length2() const { return x * x + y * y + z * z; }
@@ -190,135 +295,199 @@ struct Vector
     float maxComponent() const { return std::max(std::max(x, y), z); }
     float minComponent() const { return std::min(std::min(x, y), z); }
     
+    // Component by axis index (0 = x, 1 = y, 2 = z)
+    float operator [](unsigned int axis) const { return axis == 0 ? x : (axis == 1 ? y : z); }
     
-    Vector& operator =(const Vector& v)
-    {
-        x = v.x;
-        y = v.y;
-        z = v.z;
-        return *this;
-    }
     
     Vector& operator +=(const Vector& v)
     {
+#if defined(KT_SIMD_MATH)
+        m_simd = _mm_add_ps(m_simd, v.m_simd);
+#else
         x += v.x;
         y += v.y;
         z += v.z;
+#endif
         return *this;
     }
     
     Vector& operator -=(const Vector& v)
     {
+#if defined(KT_SIMD_MATH)
+        m_simd = _mm_sub_ps(m_simd, v.m_simd);
+#else
         x -= v.x;
         y -= v.y;
         z -= v.z;
+#endif
         return *this;
     }
     
     Vector& operator *=(const Vector& v)
     {
+#if defined(KT_SIMD_MATH)
+        m_simd = _mm_mul_ps(m_simd, v.m_simd);
+#else
         x *= v.x;
         y *= v.y;
         z *= v.z;
+#endif
         return *this;
     }
     
     Vector& operator *=(float f)
     {
+#if defined(KT_SIMD_MATH)
+        m_simd = _mm_mul_ps(m_simd, _mm_set1_ps(f));
+#else
         x *= f;
         y *= f;
         z *= f;
+#endif
         return *this;
     }
     
     Vector& operator /=(const Vector& v)
     {
+#if defined(KT_SIMD_MATH)
+        m_simd = _mm_div_ps(m_simd, v.m_simd);
+#else
         x /= v.x;
         y /= v.y;
         z /= v.z;
+#endif
         return *this;
     }
     
     Vector& operator /=(float f)
     {
+#if defined(KT_SIMD_MATH)
+        m_simd = _mm_div_ps(m_simd, _mm_set1_ps(f));
+#else
         x /= f;
         y /= f;
         z /= f;
+#endif
         return *this;
     }
     
     Vector operator -() const
     {
+#if defined(KT_SIMD_MATH)
+        return Vector(_mm_xor_ps(m_simd, _mm_set1_ps(-0.0f)));
+#else
         return Vector(-x, -y, -z);
+#endif
     }
+    
+#if defined(KT_SIMD_MATH)
+    bool operator ==(const Vector& v) const { return equalXYZ(m_simd, v.m_simd); }
+#else
+    bool operator ==(const Vector& v) const { return x == v.x && y == v.y && z == v.z; }
+#endif
+    bool operator !=(const Vector& v) const { return !(*this == v); }
 };
 
 
 inline Vector operator +(const Vector& v1, const Vector& v2)
 {
+#if defined(KT_SIMD_MATH)
+    return Vector(_mm_add_ps(v1.m_simd, v2.m_simd));
+#else
     return Vector(v1.x + v2.x,
                   v1.y + v2.y,
                   v1.z + v2.z);
+#endif
 }
 
 
 inline Vector operator -(const Vector& v1, const Vector& v2)
 {
+#if defined(KT_SIMD_MATH)
+    return Vector(_mm_sub_ps(v1.m_simd, v2.m_simd));
+#else
     return Vector(v1.x - v2.x,
                   v1.y - v2.y,
                   v1.z - v2.z);
+#endif
 }
 
 
 inline Vector operator *(const Vector& v1, const Vector& v2)
 {
+#if defined(KT_SIMD_MATH)
+    return Vector(_mm_mul_ps(v1.m_simd, v2.m_simd));
+#else
     return Vector(v1.x * v2.x,
                   v1.y * v2.y,
                   v1.z * v2.z);
+#endif
 }
 
 
 inline Vector operator *(const Vector& v, float f)
 {
+#if defined(KT_SIMD_MATH)
+    return Vector(_mm_mul_ps(_mm_set1_ps(f), v.m_simd));
+#else
     return Vector(f * v.x,
                   f * v.y,
                   f * v.z);
+#endif
 }
 
 
 inline Vector operator *(float f, const Vector& v)
 {
+#if defined(KT_SIMD_MATH)
+    return Vector(_mm_mul_ps(_mm_set1_ps(f), v.m_simd));
+#else
     return Vector(f * v.x,
                   f * v.y,
                   f * v.z);
+#endif
 }
 
 
 inline Vector operator /(const Vector& v1, const Vector& v2)
 {
+#if defined(KT_SIMD_MATH)
+    return Vector(_mm_div_ps(v1.m_simd, v2.m_simd));
+#else
     return Vector(v1.x / v2.x,
                   v1.y / v2.y,
                   v1.z / v2.z);
+#endif
 }
 
 
 inline Vector operator /(float f, const Vector& v)
 {
+#if defined(KT_SIMD_MATH)
+    return Vector(_mm_div_ps(_mm_set1_ps(f), v.m_simd));
+#else
     return Vector(f / v.x,
                   f / v.y,
                   f / v.z);
+#endif
 }
 
 
 inline Vector operator /(const Vector& v, float f)
 {
+#if defined(KT_SIMD_MATH)
+    return Vector(_mm_div_ps(v.m_simd, _mm_set1_ps(f)));
+#else
     return Vector(v.x / f,
                   v.y / f,
                   v.z / f);
+#endif
 }
 
 
 // dot(v1, v2) = length(v1) * length(v2) * cos(angle between v1, v2)
+// (This stays scalar with SIMD math: adding up the lanes of a product takes
+// more shuffling than the multiplies it saves)
 inline float dot(const Vector& v1, const Vector& v2)
 {
     // In cartesian coordinates, it simplifies to this simple calculation:
@@ -331,24 +500,43 @@ inline float dot(const Vector& v1, const Vector& v2)
 inline Vector cross(const Vector& v1, const Vector& v2)
 {
     // In cartesian coordinates, it simplifies down to this calculation:
+#if defined(KT_SIMD_MATH)
+    __m128 a = v1.m_simd, b = v2.m_simd;
+    __m128 aYZX = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 aZXY = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 0, 2));
+    __m128 bYZX = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 bZXY = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 1, 0, 2));
+    return Vector(_mm_sub_ps(_mm_mul_ps(aYZX, bZXY), _mm_mul_ps(aZXY, bYZX)));
+#else
     return Vector(v1.y * v2.z - v1.z * v2.y,
                   v1.z * v2.x - v1.x * v2.z,
                   v1.x * v2.y - v1.y * v2.x);
+#endif
 }
 
 
+// (Argument order in the SSE versions makes NaNs come out the same way
+// std::max and std::min let them)
 inline Vector max(const Vector& v1, const Vector& v2)
 {
+#if defined(KT_SIMD_MATH)
+    return Vector(_mm_max_ps(v2.m_simd, v1.m_simd));
+#else
     return Vector(std::max(v1.x, v2.x),
                   std::max(v1.y, v2.y),
                   std::max(v1.z, v2.z));
+#endif
 }
 
 inline Vector min(const Vector& v1, const Vector& v2)
 {
+#if defined(KT_SIMD_MATH)
+    return Vector(_mm_min_ps(v2.m_simd, v1.m_simd));
+#else
     return Vector(std::min(v1.x, v2.x),
                   std::min(v1.y, v2.y),
                   std::min(v1.z, v2.z));
+#endif
 }
 
 
@@ -377,7 +565,6 @@ struct Quaternion
     Vector m_v;
     
     Quaternion()                                   : m_w(1.0f), m_v(0.0f)   { }
-    Quaternion(const Quaternion& q)                : m_w(q.m_w), m_v(q.m_v) { }
     Quaternion(float w, float x, float y, float z) : m_w(w), m_v(x, y, z)   { }
     Quaternion(float w, const Vector& v)           : m_w(w), m_v(v)         { }
     
@@ -427,13 +614,6 @@ struct Quaternion
     }
     
     
-    Quaternion& operator =(const Quaternion& q)
-    {
-        m_w = q.m_w;
-        m_v = q.m_v;
-        return *this;
-    }
-    
     Quaternion& operator +=(const Quaternion& q)
     {
         m_w += q.m_w;
@@ -604,14 +784,60 @@ inline Quaternion slerp(const Quaternion& q1, const Quaternion& q2, float t)
 //
 
 
+// Affine transformation matrix; the last column is the translation
+struct Matrix3x4
+{
+    float m[3][4];
+    
+    Point transformPoint(const Point& p) const
+    {
+        return Point(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                     m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                     m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+    
+    Vector transformVector(const Vector& v) const
+    {
+        return Vector(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                      m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                      m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+    
+    // Rotation matrix of a normalized quaternion, transposed (undoing the
+    // rotation) if asked
+    static Matrix3x4 rotation(const Quaternion& q, bool transposed)
+    {
+        float x = q.m_v.x, y = q.m_v.y, z = q.m_v.z, w = q.m_w;
+        float r[3][3] = { { 1.0f - 2.0f * (y * y + z * z), 2.0f * (x * y - w * z), 2.0f * (x * z + w * y) },
+                          { 2.0f * (x * y + w * z), 1.0f - 2.0f * (x * x + z * z), 2.0f * (y * z - w * x) },
+                          { 2.0f * (x * z - w * y), 2.0f * (y * z + w * x), 1.0f - 2.0f * (x * x + y * y) } };
+        Matrix3x4 result;
+        for (int i = 0; i < 3; ++i)
+        {
+            for (int j = 0; j < 3; ++j)
+                result.m[i][j] = transposed ? r[j][i] : r[i][j];
+            result.m[i][3] = 0.0f;
+        }
+        return result;
+    }
+};
+
+
 // Transformation class (*not* a matrix, but instead for simplicity of motion blur
 // it encodes a scale, rotate, and then translate (applied in that order))
+//
+// prepare() bakes the transformation at each key into matrices, after which
+// taking things into and out of its space is a matrix multiply at a key time
+// (or for a transformation that doesn't move), and does nothing at all for an
+// identity transformation.  Changing it afterwards throws the matrices away
+// until the next prepare().
 class Transform
 {
 public:
-    Transform() : m_time(), m_scale(), m_rotate(), m_translate() { }
+    Transform() : m_time(), m_scale(), m_rotate(), m_translate(), m_keyMatrices(), m_baking(kNotBaked) { }
     Transform(const Transform& t)
-                : m_time(t.m_time), m_scale(t.m_scale), m_rotate(t.m_rotate), m_translate(t.m_translate) { }
+                : m_time(t.m_time), m_scale(t.m_scale), m_rotate(t.m_rotate), m_translate(t.m_translate),
+                  m_keyMatrices(t.m_keyMatrices), m_baking(t.m_baking) { }
     
     Transform& operator =(const Transform& t)
     {
@@ -619,6 +845,8 @@ public:
         m_scale = t.m_scale;
         m_rotate = t.m_rotate;
         m_translate = t.m_translate;
+        m_keyMatrices = t.m_keyMatrices;
+        m_baking = t.m_baking;
         return *this;
     }
     
@@ -632,6 +860,7 @@ public:
     
     void clear()
     {
+        m_baking = kNotBaked;
         m_time.clear();
         m_scale.clear();
         m_rotate.clear();
@@ -710,6 +939,7 @@ public:
     {
         if (keyIndex >= m_translate.size())
             return;
+        m_baking = kNotBaked;
         m_translate[keyIndex] = trans;
     }
     
@@ -717,6 +947,7 @@ public:
     {
         if (keyIndex >= m_scale.size())
             return;
+        m_baking = kNotBaked;
         m_scale[keyIndex] = scaling;
     }
     
@@ -724,6 +955,7 @@ public:
     {
         if (keyIndex >= m_rotate.size())
             return;
+        m_baking = kNotBaked;
         m_rotate[keyIndex] = rot;
     }
     
@@ -751,6 +983,7 @@ public:
     {
         if (keyIndex >= m_translate.size())
             return;
+        m_baking = kNotBaked;
         m_translate[keyIndex] += trans;
     }
     
@@ -758,6 +991,7 @@ public:
     {
         if (keyIndex >= m_scale.size())
             return;
+        m_baking = kNotBaked;
         m_scale[keyIndex] *= scaling;
     }
     
@@ -765,6 +999,7 @@ public:
     {
         if (keyIndex >= m_rotate.size())
             return;
+        m_baking = kNotBaked;
         m_rotate[keyIndex] *= rot;
     }
     
@@ -794,8 +1029,35 @@ public:
         {
             m_rotate[i].normalize();
         }
+        
+        // Keys that are all the same are no different from a single key
+        bool moves = false;
+        for (size_t i = 1; i < m_time.size() && !moves; ++i)
+        {
+            moves = m_scale[i] != m_scale[0] || m_translate[i] != m_translate[0] ||
+                    m_rotate[i].m_w != m_rotate[0].m_w || m_rotate[i].m_v != m_rotate[0].m_v;
+        }
+        m_keyMatrices.resize(moves ? m_time.size() : 1);
+        for (size_t i = 0; i < m_keyMatrices.size(); ++i)
+        {
+            bakeMatrices(scalingKey(i), rotationKey(i), translationKey(i), m_keyMatrices[i]);
+        }
+        if (moves)
+        {
+            m_baking = kBakedKeys;
+        }
+        else
+        {
+            Quaternion rotation = rotationKey(0);
+            bool identity = scalingKey(0) == Vector(1.0f) && translationKey(0) == Vector(0.0f) &&
+                            std::fabs(rotation.m_w) == 1.0f && rotation.m_v == Vector(0.0f);
+            m_baking = identity ? kBakedIdentity : kBakedStatic;
+        }
     }
     
+    // True if prepare() found that this transformation does nothing
+    bool isIdentity() const { return m_baking == kBakedIdentity; }
+    
     
     // Take various quantities into and out of the space defined by this transformation.
     // From local: apply scale, then rotation, then translation.
@@ -803,39 +1065,131 @@ public:
     
     Point toLocalPoint(float time, const Point& p) const
     {
-        return ((~rotation(time)) * (p - translation(time))) / scaling(time);
+        if (m_baking == kBakedIdentity)
+            return p;
+        if (m_baking == kNotBaked)
+            return ((~rotation(time)) * (p - translation(time))) / scaling(time);
+        KeyMatrices scratch;
+        return matricesAt(time, scratch).m_toLocal.transformPoint(p);
     }
     
     Point fromLocalPoint(float time, const Point& p) const
     {
-        return rotation(time) * (p * scaling(time)) + translation(time);
+        if (m_baking == kBakedIdentity)
+            return p;
+        if (m_baking == kNotBaked)
+            return rotation(time) * (p * scaling(time)) + translation(time);
+        KeyMatrices scratch;
+        return matricesAt(time, scratch).m_fromLocal.transformPoint(p);
     }
     
     Vector toLocalVector(float time, const Vector& v) const
     {
-        return ((~rotation(time)) * v) / scaling(time);
+        if (m_baking == kBakedIdentity)
+            return v;
+        if (m_baking == kNotBaked)
+            return ((~rotation(time)) * v) / scaling(time);
+        KeyMatrices scratch;
+        return matricesAt(time, scratch).m_toLocal.transformVector(v);
     }
     
     Vector fromLocalVector(float time, const Vector& v) const
     {
-        return rotation(time) * (v * scaling(time));
+        if (m_baking == kBakedIdentity)
+            return v;
+        if (m_baking == kNotBaked)
+            return rotation(time) * (v * scaling(time));
+        KeyMatrices scratch;
+        return matricesAt(time, scratch).m_fromLocal.transformVector(v);
     }
     
+    // (Normals only get rotated)
     Vector toLocalNormal(float time, const Vector& n) const
     {
-        return (~rotation(time)) * n;
+        if (m_baking == kBakedIdentity)
+            return n;
+        if (m_baking == kNotBaked)
+            return (~rotation(time)) * n;
+        KeyMatrices scratch;
+        return matricesAt(time, scratch).m_toLocalRotation.transformVector(n);
     }
     
     Vector fromLocalNormal(float time, const Vector& n) const
     {
-        return rotation(time) * n;
+        if (m_baking == kBakedIdentity)
+            return n;
+        if (m_baking == kNotBaked)
+            return rotation(time) * n;
+        KeyMatrices scratch;
+        return matricesAt(time, scratch).m_fromLocalRotation.transformVector(n);
     }
 
 private:
+    // The transformation at a time, baked into matrices for each way
+    struct KeyMatrices
+    {
+        Matrix3x4 m_fromLocal, m_toLocal;
+        Matrix3x4 m_fromLocalRotation, m_toLocalRotation;
+    };
+    
+    // What prepare() found and baked (the baking is thrown away whenever
+    // a key changes)
+    enum Baking
+    {
+        kNotBaked,
+        kBakedIdentity,
+        // One set of matrices for all time
+        kBakedStatic,
+        // Matrices for each key; between keys the parts get interpolated
+        kBakedKeys
+    };
+    
     std::vector<float>      m_time;
     std::vector<Vector>     m_scale;
     std::vector<Quaternion> m_rotate;
     std::vector<Vector>     m_translate;
+    std::vector<KeyMatrices> m_keyMatrices;
+    Baking m_baking;
+    
+    static void bakeMatrices(const Vector& scaling, const Quaternion& rotation, const Vector& translation,
+                             KeyMatrices& outMatrices)
+    {
+        outMatrices.m_fromLocalRotation = Matrix3x4::rotation(rotation, false);
+        outMatrices.m_toLocalRotation = Matrix3x4::rotation(rotation, true);
+        // From local is R * S then T; to local is S^-1 * R^T and then that
+        // applied to -T
+        Vector invScaling = Vector(1.0f) / scaling;
+        for (int i = 0; i < 3; ++i)
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                outMatrices.m_fromLocal.m[i][j] = outMatrices.m_fromLocalRotation.m[i][j] * scaling[j];
+                outMatrices.m_toLocal.m[i][j] = outMatrices.m_toLocalRotation.m[i][j] * invScaling[i];
+            }
+            outMatrices.m_fromLocal.m[i][3] = translation[i];
+            outMatrices.m_toLocal.m[i][3] = 0.0f;
+        }
+        Vector back = outMatrices.m_toLocal.transformVector(-translation);
+        outMatrices.m_toLocal.m[0][3] = back.x;
+        outMatrices.m_toLocal.m[1][3] = back.y;
+        outMatrices.m_toLocal.m[2][3] = back.z;
+    }
+    
+    // Baked matrices at a time; in between keys they get made in 'scratch'
+    const KeyMatrices& matricesAt(float time, KeyMatrices& scratch) const
+    {
+        if (m_baking == kBakedStatic)
+            return m_keyMatrices[0];
+        float t;
+        size_t index = timeIndex(time, t);
+        if (t == 0.0f)
+            return m_keyMatrices[index];
+        bakeMatrices(m_scale[index] * (1.0f - t) + m_scale[index + 1] * t,
+                     lerp(m_rotate[index], m_rotate[index + 1], t),
+                     m_translate[index] * (1.0f - t) + m_translate[index + 1] * t,
+                     scratch);
+        return scratch;
+    }
     
     size_t timeIndex(float time, float& outT) const
     {
@@ -875,6 +1229,7 @@ private:
     
     size_t findOrInsertKey(float time)
     {
+        m_baking = kNotBaked;
         // Here's the deal.  If a key at the time slot exists, we just return it.
         // If it's empty or the time is before or after existing time keys, we
         // insert the time for all parts of the transform.  If the time is
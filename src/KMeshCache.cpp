@@ -0,0 +1,271 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <sys/stat.h>
+
+#include "KMeshCache.h"
+#include "KMappedFile.h"
+#include "KPolymesh.h"
+
+
+namespace kt{
+
+// Bump this whenever what gets written changes
+const uint32_t kMeshCacheVersion = 1;
+
+// How much of each end of the source file goes into its hash
+const size_t kMeshSourceHashBytes = 64 * 1024;
+
+// Arrays follow the header in this order
+enum MeshCacheArray
+{
+    kCacheVertices,
+    kCacheNormals,
+    kCacheTriVertices,
+    kCacheTriNormals,
+    kCacheFaceTriangles,
+    kCacheBVHNodes,
+    kCacheBVHPrims,
+    kNumCacheArrays
+};
+
+struct MeshCacheHeader
+{
+    char m_magic[8];
+    uint32_t m_version;
+    // Size of everything we store, plus the BVH width
+    uint32_t m_pointSize, m_vectorSize, m_nodeSize, m_bvhWidth;
+    uint32_t m_bvhMethod;
+    MeshSourceStamp m_source;
+    uint64_t m_counts[kNumCacheArrays];
+    // Hash of everything above
+    uint64_t m_hash;
+};
+
+static const char kMeshCacheMagic[8] = { 'K', 'T', 'M', 'E', 'S', 'H', '\r', '\n' };
+
+// FNV-1a, 64 bit
+static uint64_t hashBytes(const void *pData, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+    const unsigned char *p = static_cast<const unsigned char*>(pData);
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ p[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static uint64_t headerHash(const MeshCacheHeader& header)
+{
+    return hashBytes(&header, offsetof(MeshCacheHeader, m_hash));
+}
+
+static size_t elementSize(MeshCacheArray array)
+{
+    switch (array)
+    {
+    case kCacheVertices:  return sizeof(Point);
+    case kCacheNormals:   return sizeof(Vector);
+    case kCacheBVHNodes:  return sizeof(WideBVHNode);
+    default:              return sizeof(unsigned int);
+    }
+}
+
+static uint64_t alignedSize(uint64_t size)
+{
+    return (size + 15) & ~uint64_t(15);
+}
+
+// The header a cache of a mesh made now would have (less counts and hash)
+static void fillHeader(MeshCacheHeader& header, const MeshSourceStamp& sourceStamp)
+{
+    // Zero all of it so the padding hashes the same every time
+    std::memset(static_cast<void*>(&header), 0, sizeof(header));
+    std::memcpy(header.m_magic, kMeshCacheMagic, sizeof(kMeshCacheMagic));
+    header.m_version = kMeshCacheVersion;
+    header.m_pointSize = sizeof(Point);
+    header.m_vectorSize = sizeof(Vector);
+    header.m_nodeSize = sizeof(WideBVHNode);
+    header.m_bvhWidth = kBVHWidth;
+    header.m_source.m_size = sourceStamp.m_size;
+    header.m_source.m_modified = sourceStamp.m_modified;
+    header.m_source.m_hash = sourceStamp.m_hash;
+}
+
+
+bool getMeshSourceStamp(const char *sourceFilename, MeshSourceStamp& outStamp)
+{
+    struct stat info;
+    if (stat(sourceFilename, &info) != 0)
+        return false;
+    FILE *pFile = fopen(sourceFilename, "rb");
+    if (pFile == NULL)
+        return false;
+    outStamp.m_size = (uint64_t) info.st_size;
+    outStamp.m_modified = (int64_t) info.st_mtime;
+
+    // Hash the start and end of the file, to catch edits that keep its size
+    // and land within a second of the last one
+    std::vector<char> buffer(kMeshSourceHashBytes);
+    size_t got = fread(&buffer[0], 1, buffer.size(), pFile);
+    uint64_t hash = hashBytes(&buffer[0], got);
+    if (outStamp.m_size > kMeshSourceHashBytes &&
+        fseek(pFile, -(long) std::min<uint64_t>(outStamp.m_size - kMeshSourceHashBytes, kMeshSourceHashBytes), SEEK_END) == 0)
+    {
+        got = fread(&buffer[0], 1, buffer.size(), pFile);
+        hash = hashBytes(&buffer[0], got, hash);
+    }
+    fclose(pFile);
+    outStamp.m_hash = hash;
+    return true;
+}
+
+
+std::string meshCacheFilename(const char *sourceFilename)
+{
+    return std::string(sourceFilename) + ".ktmesh";
+}
+
+
+Polymesh* readMeshCache(const char *cacheFilename, const MeshSourceStamp& sourceStamp)
+{
+    MappedFile file;
+    if (!file.open(cacheFilename) || file.size() < sizeof(MeshCacheHeader))
+        return NULL;
+
+    // Everything in the header but the counts has to be what we'd write now
+    MeshCacheHeader header;
+    std::memcpy(&header, file.data(), sizeof(header));
+    MeshCacheHeader expected;
+    fillHeader(expected, sourceStamp);
+    if (headerHash(header) != header.m_hash ||
+        std::memcmp(&header, &expected, offsetof(MeshCacheHeader, m_bvhMethod)) != 0 ||
+        std::memcmp(&header.m_source, &expected.m_source, sizeof(MeshSourceStamp)) != 0 ||
+        (header.m_bvhMethod != kBVHBuildSAH && header.m_bvhMethod != kBVHBuildMidpoint))
+    {
+        return NULL;
+    }
+
+    // Find the arrays, making sure they're all really in the file
+    const char *arrays[kNumCacheArrays];
+    uint64_t offset = alignedSize(sizeof(MeshCacheHeader));
+    for (unsigned int a = 0; a < kNumCacheArrays; ++a)
+    {
+        size_t elemSize = elementSize((MeshCacheArray) a);
+        if (header.m_counts[a] > (file.size() - std::min<uint64_t>(offset, file.size())) / elemSize)
+            return NULL;
+        arrays[a] = file.data() + offset;
+        offset = alignedSize(offset + header.m_counts[a] * elemSize);
+    }
+
+    uint64_t numVerts = header.m_counts[kCacheVertices];
+    uint64_t numNormals = header.m_counts[kCacheNormals];
+    uint64_t numTriCorners = header.m_counts[kCacheTriVertices];
+    uint64_t numFaces = header.m_counts[kCacheFaceTriangles] - 1;
+    if (header.m_counts[kCacheFaceTriangles] == 0 || numTriCorners % 3 != 0 ||
+        (header.m_counts[kCacheTriNormals] != 0 && header.m_counts[kCacheTriNormals] != numTriCorners) ||
+        header.m_counts[kCacheBVHPrims] != numFaces)
+    {
+        return NULL;
+    }
+
+    // The arrays are 16 byte aligned in the file, and the file is mapped on
+    // a page boundary, so they can be read in place
+    const Point *verts = reinterpret_cast<const Point*>(arrays[kCacheVertices]);
+    const Vector *normals = reinterpret_cast<const Vector*>(arrays[kCacheNormals]);
+    const unsigned int *triVertices = reinterpret_cast<const unsigned int*>(arrays[kCacheTriVertices]);
+    const unsigned int *triNormals = reinterpret_cast<const unsigned int*>(arrays[kCacheTriNormals]);
+    const unsigned int *faceTriangles = reinterpret_cast<const unsigned int*>(arrays[kCacheFaceTriangles]);
+
+    // Don't trust indices we're going to look things up with
+    for (uint64_t i = 0; i < numTriCorners; ++i)
+    {
+        if (triVertices[i] >= numVerts)
+            return NULL;
+    }
+    for (uint64_t i = 0; i < header.m_counts[kCacheTriNormals]; ++i)
+    {
+        if (triNormals[i] != kNoNormal && triNormals[i] >= numNormals)
+            return NULL;
+    }
+    if (faceTriangles[0] != 0 || faceTriangles[numFaces] != numTriCorners / 3)
+        return NULL;
+    for (uint64_t f = 0; f < numFaces; ++f)
+    {
+        if (faceTriangles[f] > faceTriangles[f + 1])
+            return NULL;
+    }
+
+    Polymesh *pMesh = new Polymesh(std::vector<Point>(), std::vector<Vector>(), FaceList(), NULL);
+    pMesh->m_vertices.assign(verts, verts + numVerts);
+    pMesh->m_normals.assign(normals, normals + numNormals);
+    pMesh->m_triVertices.assign(triVertices, triVertices + numTriCorners);
+    pMesh->m_triNormals.assign(triNormals, triNormals + header.m_counts[kCacheTriNormals]);
+    pMesh->m_faceTriangles.assign(faceTriangles, faceTriangles + numFaces + 1);
+    if (!pMesh->m_bvh.restore(reinterpret_cast<const WideBVHNode*>(arrays[kCacheBVHNodes]),
+                              header.m_counts[kCacheBVHNodes],
+                              reinterpret_cast<const unsigned int*>(arrays[kCacheBVHPrims]),
+                              header.m_counts[kCacheBVHPrims],
+                              (BVHBuildMethod) header.m_bvhMethod))
+    {
+        delete pMesh;
+        return NULL;
+    }
+    return pMesh;
+}
+
+
+bool writeMeshCache(const char *cacheFilename, const MeshSourceStamp& sourceStamp,
+                    const Polymesh& mesh)
+{
+    const std::vector<WideBVHNode>& nodes = mesh.m_bvh.wideNodes();
+    const void *arrays[kNumCacheArrays] =
+    {
+        mesh.m_vertices.empty()      ? NULL : &mesh.m_vertices[0],
+        mesh.m_normals.empty()       ? NULL : &mesh.m_normals[0],
+        mesh.m_triVertices.empty()   ? NULL : &mesh.m_triVertices[0],
+        mesh.m_triNormals.empty()    ? NULL : &mesh.m_triNormals[0],
+        &mesh.m_faceTriangles[0],
+        nodes.empty()                ? NULL : &nodes[0],
+        mesh.m_bvh.primOrder()
+    };
+
+    MeshCacheHeader header;
+    fillHeader(header, sourceStamp);
+    header.m_bvhMethod = mesh.m_bvh.buildMethod();
+    header.m_counts[kCacheVertices] = mesh.m_vertices.size();
+    header.m_counts[kCacheNormals] = mesh.m_normals.size();
+    header.m_counts[kCacheTriVertices] = mesh.m_triVertices.size();
+    header.m_counts[kCacheTriNormals] = mesh.m_triNormals.size();
+    header.m_counts[kCacheFaceTriangles] = mesh.m_faceTriangles.size();
+    header.m_counts[kCacheBVHNodes] = nodes.size();
+    header.m_counts[kCacheBVHPrims] = mesh.m_bvh.primOrder() != NULL ? mesh.numFaces() : 0;
+    header.m_hash = headerHash(header);
+
+    std::string tempFilename = std::string(cacheFilename) + ".tmp";
+    FILE *pFile = fopen(tempFilename.c_str(), "wb");
+    if (pFile == NULL)
+        return false;
+    static const char kPadding[16] = { 0 };
+    bool ok = fwrite(&header, sizeof(header), 1, pFile) == 1;
+    uint64_t offset = sizeof(header);
+    for (unsigned int a = 0; a < kNumCacheArrays && ok; ++a)
+    {
+        ok = fwrite(kPadding, 1, alignedSize(offset) - offset, pFile) == alignedSize(offset) - offset;
+        offset = alignedSize(offset);
+        uint64_t size = header.m_counts[a] * elementSize((MeshCacheArray) a);
+        ok = ok && (size == 0 || fwrite(arrays[a], size, 1, pFile) == 1);
+        offset += size;
+    }
+    ok = fclose(pFile) == 0 && ok;
+    if (!ok || rename(tempFilename.c_str(), cacheFilename) != 0)
+    {
+        remove(tempFilename.c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace kt
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+
+namespace kt{
+
+class Polymesh;
+
+/*
+ * Mesh cache (.ktmesh files)
+ * 
+ * A binary snapshot of a mesh read from some source file (an OBJ, say): the
+ * vertex and normal arrays, the triangle index arrays, and the BVH built over
+ * the faces.  Loading one is a few big copies out of a memory-mapped file, so
+ * the mesh is ready to render without parsing text or building its BVH.
+ * 
+ * The file starts with a header holding the format version, the sizes of
+ * the things stored (which change with the BVH width of the build), a stamp
+ * of the source file (its size, modification time and a hash of its first
+ * and last few KB) and the BVH build method, all covered by a hash of the
+ * header itself.  A cache whose header doesn't match what we'd write now is
+ * stale, and gets ignored.
+ * 
+ * The arrays follow the header in a fixed order, each starting on a 16 byte
+ * boundary; they're stored as they are in memory, so a cache only makes
+ * sense on machines with the same endianness (the header check catches that
+ * too, since the magic number won't read the same).
+ */
+
+// Identifies the version of the source file a cache was made from
+struct MeshSourceStamp
+{
+    uint64_t m_size;
+    int64_t m_modified;
+    uint64_t m_hash;
+    
+    MeshSourceStamp() : m_size(0), m_modified(0), m_hash(0) { }
+};
+
+// Returns false if the source file can't be read
+bool getMeshSourceStamp(const char *sourceFilename, MeshSourceStamp& outStamp);
+
+// Where the cache for a source file lives (next to it, with .ktmesh tacked on)
+std::string meshCacheFilename(const char *sourceFilename);
+
+// Load a cached mesh, with its BVH already restored.  Returns NULL if there
+// is no cache, or it's stale or damaged.
+Polymesh* readMeshCache(const char *cacheFilename, const MeshSourceStamp& sourceStamp);
+
+// Save a mesh whose BVH has been built.  The file is written under a
+// temporary name and renamed into place, so a reader never sees half of one.
+bool writeMeshCache(const char *cacheFilename, const MeshSourceStamp& sourceStamp,
+                    const Polymesh& mesh);
+
+} // namespace kt
@@ -8,18 +8,51 @@
 namespace kt
 {
 
-bool Polymesh::intersect(Intersection& intersection)
+bool Polymesh::intersect(const Ray& ray, Intersection& intersection)
 {
     // Transform ray to the local space of our transformation
-    Ray nonLocalRay = intersection.m_ray;
-    intersection.m_ray = intersection.m_ray.transformToLocal(m_transform);
-    // Let the BVH do the work of finding the intersection quickly
-    bool intersected = m_bvh.intersect(intersection);
-    // Patch ray back to non-local space, and fix up the normal if we intersected
-    if (intersected)
-        intersection.m_normal = m_transform.fromLocalNormal(nonLocalRay.m_time, intersection.m_normal);
-    intersection.m_ray = nonLocalRay;
-    return intersected;
+    Ray localRay = ray.transformToLocal(m_transform);
+    // Let the BVH do the work of finding the intersection quickly; it only
+    // tells us which triangle is hit, and where
+    if (!m_bvh.intersect(localRay, intersection))
+        return false;
+    
+    // Now that we know the nearest hit, work out what the surface is like there
+    unsigned int tri = intersection.m_primID;
+    float beta = intersection.m_u;
+    float gamma = intersection.m_v;
+    float alpha = 1.0f - beta - gamma;
+    
+    // Calculate shading normal...
+    Vector shadingNormal;
+    if (!m_triNormals.empty() && m_triNormals[tri * 3] != kNoNormal)
+    {
+        // We have normals stored at the vertices, so use them.
+        unsigned int n0 = m_triNormals[tri * 3];
+        unsigned int n1 = m_triNormals[tri * 3 + 1];
+        unsigned int n2 = m_triNormals[tri * 3 + 2];
+        
+        // Weight normals at each vertex by barycentric coords to create
+        // the interpolated normal at the intersection point.
+        shadingNormal = (m_normals[n0] * alpha) +
+                        (m_normals[n1] * beta) +
+                        (m_normals[n2] * gamma);
+        shadingNormal.normalize();
+    }
+    else
+    {
+        // Use the geometric (flat-shaded) normal
+        const Point& p0 = m_vertices[m_triVertices[tri * 3]];
+        const Point& p1 = m_vertices[m_triVertices[tri * 3 + 1]];
+        const Point& p2 = m_vertices[m_triVertices[tri * 3 + 2]];
+        shadingNormal = cross(p1 - p0, p2 - p0).normalized();
+    }
+    
+    // Put the normal in non-local space
+    intersection.m_pMaterial = m_pMaterial;
+    intersection.m_normal = m_transform.fromLocalNormal(ray.m_time, shadingNormal);
+    intersection.m_colorModifier = Color(1.0f);
+    return true;
 }
 
 bool Polymesh::doesIntersect(const Ray& ray)
@@ -35,6 +68,91 @@ BBox Polymesh::bbox()
     return m_bbox;
 }
 
+void Polymesh::triangulate(const std::vector<Face>& faces)
+{
+    // Pack the faces up and triangulate those
+    FaceList faceList;
+    size_t numCorners = 0;
+    bool anyNormals = false;
+    for (size_t faceIndex = 0; faceIndex < faces.size(); ++faceIndex)
+    {
+        numCorners += faces[faceIndex].m_vertexIndices.size();
+        if (!faces[faceIndex].m_normalIndices.empty())
+            anyNormals = true;
+    }
+    faceList.m_faceStarts.reserve(faces.size() + 1);
+    faceList.m_vertexIndices.reserve(numCorners);
+    if (anyNormals)
+        faceList.m_normalIndices.reserve(numCorners);
+    for (size_t faceIndex = 0; faceIndex < faces.size(); ++faceIndex)
+    {
+        const Face& face = faces[faceIndex];
+        bool faceNormals = face.m_normalIndices.size() == face.m_vertexIndices.size();
+        for (size_t i = 0; i < face.m_vertexIndices.size(); ++i)
+        {
+            faceList.m_vertexIndices.push_back(face.m_vertexIndices[i]);
+            if (anyNormals)
+                faceList.m_normalIndices.push_back(faceNormals ? face.m_normalIndices[i] : kNoNormal);
+        }
+        faceList.m_faceStarts.push_back((unsigned int) faceList.m_vertexIndices.size());
+    }
+    triangulate(faceList);
+}
+
+void Polymesh::triangulate(const FaceList& faces)
+{
+    // Count up front so the flat arrays get allocated exactly once
+    size_t numFaces = faces.numFaces();
+    size_t numTris = 0;
+    for (size_t faceIndex = 0; faceIndex < numFaces; ++faceIndex)
+    {
+        unsigned int numCorners = faces.m_faceStarts[faceIndex + 1] - faces.m_faceStarts[faceIndex];
+        if (numCorners >= 3)
+            numTris += numCorners - 2;
+    }
+    bool anyNormals = !faces.m_normalIndices.empty();
+    m_triVertices.clear();
+    m_triNormals.clear();
+    m_faceTriangles.clear();
+    m_triVertices.reserve(numTris * 3);
+    if (anyNormals)
+        m_triNormals.reserve(numTris * 3);
+    m_faceTriangles.reserve(numFaces + 1);
+    
+    for (size_t faceIndex = 0; faceIndex < numFaces; ++faceIndex)
+    {
+        m_faceTriangles.push_back((unsigned int)(m_triVertices.size() / 3));
+        // Faces with fewer than 3 vertices don't cover any area; they just
+        // get an empty run of triangles
+        unsigned int begin = faces.m_faceStarts[faceIndex];
+        unsigned int end = faces.m_faceStarts[faceIndex + 1];
+        if (end - begin < 3)
+            continue;
+        const unsigned int *verts = &faces.m_vertexIndices[begin];
+        const unsigned int *normals = anyNormals ? &faces.m_normalIndices[begin] : NULL;
+        // A face only gets smooth normals if every corner has one
+        bool faceNormals = anyNormals;
+        for (unsigned int i = 0; faceNormals && i < end - begin; ++i)
+        {
+            if (normals[i] == kNoNormal)
+                faceNormals = false;
+        }
+        for (unsigned int tri = 0; tri < end - begin - 2; ++tri)
+        {
+            m_triVertices.push_back(verts[0]);
+            m_triVertices.push_back(verts[tri + 1]);
+            m_triVertices.push_back(verts[tri + 2]);
+            if (anyNormals)
+            {
+                m_triNormals.push_back(faceNormals ? normals[0] : kNoNormal);
+                m_triNormals.push_back(faceNormals ? normals[tri + 1] : kNoNormal);
+                m_triNormals.push_back(faceNormals ? normals[tri + 2] : kNoNormal);
+            }
+        }
+    }
+    m_faceTriangles.push_back((unsigned int)(m_triVertices.size() / 3));
+}
+
 void Polymesh::prepare()
 {
     Shape::prepare();
@@ -50,31 +168,79 @@ void Polymesh::prepare()
         }
     }
     
-    // Calculate total surface area, and the running total of per-face area.
-    // This is used to create the "cumulative distribution function" of the
-    // face areas we can use to quickly choose a face proportional to its
-    // area based on a random number (this means you can use meshes as area
-    // lights).
-    m_faceAreaCDF.clear();
-    m_faceAreaCDF.reserve(m_faces.size() + 1);
+    // Calculate the area of each triangle, and build an alias table over
+    // them so we can quickly choose a triangle proportional to its area based
+    // on a random number (this means you can use meshes as area lights).
+    unsigned int numTris = numTriangles();
+    m_triangleAreas.resize(numTris);
     m_totalArea = 0.0f;
-    for (size_t faceIndex = 0; faceIndex < m_faces.size(); ++faceIndex)
+    for (unsigned int tri = 0; tri < numTris; ++tri)
+    {
+        const Point& p0 = m_vertices[m_triVertices[tri * 3]];
+        const Point& p1 = m_vertices[m_triVertices[tri * 3 + 1]];
+        const Point& p2 = m_vertices[m_triVertices[tri * 3 + 2]];
+        m_triangleAreas[tri] = cross(p1 - p0, p2 - p0).length() * 0.5f;
+        m_totalArea += m_triangleAreas[tri];
+    }
+    m_triangleAreaTable.build(m_triangleAreas);
+    
+    // Build the BVH so ray intersections are nice and fast (unless we already
+    // have one made the same way; the triangles never change), then lay the
+    // triangles out the way its leaves will want them
+    if (!m_bvh.upToDate())
     {
-        float faceArea = 0.0f;
-        for (size_t tri = 0; tri < m_faces[faceIndex].m_vertexIndices.size() - 2; ++tri)
+        if (m_bvh.build() && !m_cacheFilename.empty() &&
+            !writeMeshCache(m_cacheFilename.c_str(), m_cacheSourceStamp, *this))
         {
-            Point p0 = m_vertices[m_faces[faceIndex].m_vertexIndices[0]];
-            Point p1 = m_vertices[m_faces[faceIndex].m_vertexIndices[tri + 1]];
-            Point p2 = m_vertices[m_faces[faceIndex].m_vertexIndices[tri + 2]];
-            faceArea += cross(p1 - p0, p2 - p0).length() * 0.5f;
+            std::cerr << "Could not write mesh cache " << m_cacheFilename << std::endl;
         }
-        m_faceAreaCDF.push_back(m_totalArea);
-        m_totalArea += faceArea;
     }
-    m_faceAreaCDF.push_back(m_totalArea);
+    buildLeafTriangles();
+}
+
+void Polymesh::buildLeafTriangles()
+{
+    unsigned int numTris = numTriangles();
+    unsigned int numSlots = numFaces();
+    const unsigned int *order = m_bvh.primOrder();
+    m_slotTriangles.assign(numSlots + 1, 0);
+    m_leafTriangles.clear();
+    m_leafTriangles.reserve(numTris);
+    for (unsigned int slot = 0; slot < numSlots && order != NULL; ++slot)
+    {
+        m_slotTriangles[slot] = (unsigned int) m_leafTriangles.size();
+        for (unsigned int tri = faceTriangleBegin(order[slot]); tri < faceTriangleEnd(order[slot]); ++tri)
+        {
+            m_leafTriangles.push_back(tri);
+        }
+    }
+    m_slotTriangles[numSlots] = (unsigned int) m_leafTriangles.size();
     
-    // Build the BVH so ray intersections are nice and fast
-    m_bvh.build();
+    for (unsigned int c = 0; c < kNumLeafTriComponents; ++c)
+    {
+        m_leafTriComponents[c].assign(m_leafTriangles.size() + kKernelWidth, 0.0f);
+        m_leafTris.m_components[c] = &m_leafTriComponents[c][0];
+    }
+    for (size_t i = 0; i < m_leafTriangles.size(); ++i)
+    {
+        const unsigned int *triVerts = &m_triVertices[m_leafTriangles[i] * 3];
+        const Point& p0 = m_vertices[triVerts[0]];
+        const Point& p1 = m_vertices[triVerts[1]];
+        const Point& p2 = m_vertices[triVerts[2]];
+        Vector gnormal = cross(p1 - p0, p2 - p0);
+        m_leafTriComponents[kLeafTriV0X][i] = p0.x;
+        m_leafTriComponents[kLeafTriV0Y][i] = p0.y;
+        m_leafTriComponents[kLeafTriV0Z][i] = p0.z;
+        m_leafTriComponents[kLeafTriV1X][i] = p1.x;
+        m_leafTriComponents[kLeafTriV1Y][i] = p1.y;
+        m_leafTriComponents[kLeafTriV1Z][i] = p1.z;
+        m_leafTriComponents[kLeafTriV2X][i] = p2.x;
+        m_leafTriComponents[kLeafTriV2Y][i] = p2.y;
+        m_leafTriComponents[kLeafTriV2Z][i] = p2.z;
+        m_leafTriComponents[kLeafTriNX][i] = gnormal.x;
+        m_leafTriComponents[kLeafTriNY][i] = gnormal.y;
+        m_leafTriComponents[kLeafTriNZ][i] = gnormal.z;
+    }
 }
 
 bool Polymesh::sampleSurface(const Point& refPosition,
@@ -87,48 +253,33 @@ bool Polymesh::sampleSurface(const Point& refPosition,
                                Vector& outNormal,
                                float& outPDF)
 {
-    // Select a face based on a random number (u3), proportional to face
-    // surface area; a face with double the surface area of another is twice
-    // as likely to be selected.
-    std::vector<float>::iterator iter = std::upper_bound(m_faceAreaCDF.begin(),
-                                                         m_faceAreaCDF.end(),
-                                                         u3 * m_totalArea);
-    // Get the face index, taking care to make sure we get a face index in range
-    size_t faceIndex;
-    if (iter == m_faceAreaCDF.end())
-        faceIndex = m_faceAreaCDF.size() - 1;
-    else if (iter == m_faceAreaCDF.begin())
-        faceIndex = 0;
-    else
-        faceIndex = std::distance(m_faceAreaCDF.begin(), iter) - 1;
-    // Find the actual triangle on the face we are choosing
-    float faceArea = m_faceAreaCDF[faceIndex + 1] - m_faceAreaCDF[faceIndex];
-    float triangleSelector = (u3 * m_totalArea - m_faceAreaCDF[faceIndex]) / faceArea;
-    float triangleAreaSoFar = 0.0f;
-    for (size_t tri = 0; tri < m_faces[faceIndex].m_vertexIndices.size() - 2; ++tri)
+    // Select a triangle based on a random number (u3), proportional to
+    // triangle surface area; a triangle with double the surface area of
+    // another is twice as likely to be selected.
+    if (m_triangleAreaTable.empty())
     {
-        Point p0 = m_vertices[m_faces[faceIndex].m_vertexIndices[0]];
-        Point p1 = m_vertices[m_faces[faceIndex].m_vertexIndices[tri + 1]];
-        Point p2 = m_vertices[m_faces[faceIndex].m_vertexIndices[tri + 2]];
-        triangleAreaSoFar += cross(p1 - p0, p2 - p0).length() * 0.5f;
-        if (triangleSelector * faceArea < triangleAreaSoFar)
-        {
-            // We found our triangle!  Now, find out which point on the
-            // triangle we selected, and put it in non-local space.
-            float alpha = 0.0f, beta = 0.0f;
-            uniformToBarycentricTriangle(u1, u2, alpha, beta);
-            float gamma = 1.0f - alpha - beta;
-            outPosition = p0 * alpha + p1 * beta + p2 * gamma;
-            outPosition = m_transform.fromLocalPoint(refTime, outPosition);
-            // Calculate normal and the PDF of having selected this position (w.r.t. solid angle)
-            outNormal = cross(p1 - p0, p2 - p0);
-            outNormal = m_transform.fromLocalNormal(refTime, outNormal).normalized();
-            Vector toSurf = refPosition - outPosition;
-            outPDF = toSurf.length2() * surfaceAreaPDF() / std::fabs(dot(toSurf.normalized(), outNormal));
-            return true;
-        }
+        outPDF = 0.0f;
+        return false;
     }
-    return false;
+    float triPmf = 0.0f;
+    size_t tri = m_triangleAreaTable.sample(u3, triPmf);
+    
+    // Now, find out which point on the triangle we selected, and put it in
+    // non-local space.
+    const Point& p0 = m_vertices[m_triVertices[tri * 3]];
+    const Point& p1 = m_vertices[m_triVertices[tri * 3 + 1]];
+    const Point& p2 = m_vertices[m_triVertices[tri * 3 + 2]];
+    float alpha = 0.0f, beta = 0.0f;
+    uniformToBarycentricTriangle(u1, u2, alpha, beta);
+    float gamma = 1.0f - alpha - beta;
+    outPosition = p0 * alpha + p1 * beta + p2 * gamma;
+    outPosition = m_transform.fromLocalPoint(refTime, outPosition);
+    // Calculate normal and the PDF of having selected this position (w.r.t. solid angle)
+    outNormal = cross(p1 - p0, p2 - p0);
+    outNormal = m_transform.fromLocalNormal(refTime, outNormal).normalized();
+    Vector toSurf = refPosition - outPosition;
+    outPDF = toSurf.length2() * surfaceAreaPDF() / std::fabs(dot(toSurf.normalized(), outNormal));
+    return true;
 }
 
 float Polymesh::pdfSA(const Point &refPosition,
@@ -144,158 +295,46 @@ float Polymesh::pdfSA(const Point &refPosition,
 
 BBox Polymesh::elementBBox(unsigned int index) const
 {
-    // Build a bbox around the face
+    // Build a bbox around the face's triangles
     BBox bbox;
-    for (size_t i = 0; i < m_faces[index].m_vertexIndices.size(); ++i)
+    const unsigned int *triVerts = &m_triVertices[0];
+    for (unsigned int tri = faceTriangleBegin(index); tri < faceTriangleEnd(index); ++tri)
     {
-        bbox.expand(m_vertices[m_faces[index].m_vertexIndices[i]]);
+        bbox.expand(m_vertices[triVerts[tri * 3]]);
+        bbox.expand(m_vertices[triVerts[tri * 3 + 1]]);
+        bbox.expand(m_vertices[triVerts[tri * 3 + 2]]);
     }
     return bbox;
 }
 
-bool Polymesh::intersect(Intersection& intersection, unsigned int index)
+bool Polymesh::intersectLeaf(const Ray& ray, Intersection& intersection, const unsigned int *prims,
+                             unsigned int firstSlot, unsigned int numPrims)
 {
-    // Intersect the triangles of the face, bailing if we find one; we can
-    // to this because we assume and hope the triangles are coplanar with
-    // each other.  The first one to claim the intersection thus wins.
-    bool intersectAny = false;
-    for (size_t i = 0; i < m_faces[index].m_vertexIndices.size() - 2; ++i)
+    // Find the nearest hit among the leaf's triangles.  Just note the hit;
+    // the rest waits until we know it's the nearest one.
+    KernelRay kray = kernelRay(ray, Vector(0.0f, 0.0f, 0.0f));
+    unsigned int tri = 0;
+    float beta = 0.0f, gamma = 0.0f;
+    if (!kernels().nearestTriangle(m_leafTris, m_slotTriangles[firstSlot],
+                                   m_slotTriangles[firstSlot + numPrims],
+                                   kray, kRayTMin, intersection.m_t, tri, beta, gamma))
     {
-        if (intersectTri(index, i, intersection))
-            intersectAny = true;
-    }
-    return intersectAny;
-}
-
-bool Polymesh::doesIntersect(const Ray& ray, unsigned int index)
-{
-    // Intersect the triangles of the face
-    for (size_t i = 0; i < m_faces[index].m_vertexIndices.size() - 2; ++i)
-    {
-        if (doesIntersectTri(index, i, ray))
-            return true;
-    }
-    return false;
-}
-
-bool Polymesh::intersectTri(unsigned int faceIndex, unsigned int tri, Intersection& intersection)
-{
-    unsigned int v0 = m_faces[faceIndex].m_vertexIndices[0];
-    unsigned int v1 = m_faces[faceIndex].m_vertexIndices[tri + 1];
-    unsigned int v2 = m_faces[faceIndex].m_vertexIndices[tri + 2];
-    
-    // Moller-Trumbore ray-triangle intersection test.  The point here is to
-    // find the barycentric coordinates of the triangle where the ray hits
-    // the plane the triangle lives in.  If the barycentric coordinates
-    // alpha, beta, gamma all add up to 1 (and each is in the 0.0 to 1.0
-    // range) then we have a valid intersection in the triangle.  Then, each
-    // of alpha, beta, gamma are the amounts of influence each vertex has
-    // on the values at the intersection.  So if we store things at the
-    // vertices (like normals, UVs, colors, etc) we can just weight them
-    // with the barycentric coordinates to get the interpolated result.
-    
-    Vector v0To1 = m_vertices[v1] - m_vertices[v0];
-    Vector v0To2 = m_vertices[v2] - m_vertices[v0];
-    Vector gnormal = cross(v0To1, v0To2);
-    float det = -dot(intersection.m_ray.m_direction, gnormal);
-    if (det == 0.0f)
-        return false;
-    
-    Vector rOriginToV0 = m_vertices[v0] - intersection.m_ray.m_origin;
-    Vector rayVertCross = cross(intersection.m_ray.m_direction, rOriginToV0);
-    Vector rOriginToV1 = m_vertices[v1] - intersection.m_ray.m_origin;
-    float invDet = 1.0f / det;
-    
-    // Calculate barycentric gamma coord
-    float gamma = -dot(rOriginToV1, rayVertCross) * invDet;
-    if (gamma < 0.0f || gamma > 1.0f)
-        return false;
-    
-    Vector rOriginToV2 = m_vertices[v2] - intersection.m_ray.m_origin;
-    
-    // Calculate barycentric beta coord
-    float beta = dot(rOriginToV2, rayVertCross) * invDet;
-    if (beta < 0.0f || beta + gamma > 1.0f)
         return false;
-    
-    float t = -dot(rOriginToV0, gnormal) * invDet;
-    if (t < kRayTMin || t >= intersection.m_t)
-        return false;
-    
-    float alpha = 1.0f - beta - gamma;
-
-    // Calculate shading normal...
-    Vector shadingNormal;
-    if (!m_faces[faceIndex].m_normalIndices.empty())
-    {
-        // We have normals stored at the vertices, so use them.
-        unsigned int n0 = m_faces[faceIndex].m_normalIndices[0];
-        unsigned int n1 = m_faces[faceIndex].m_normalIndices[tri + 1];
-        unsigned int n2 = m_faces[faceIndex].m_normalIndices[tri + 2];
-        
-        // Weight normals at each vertex by barycentric coords to create
-        // the interpolated normal at the intersection point.
-        shadingNormal = (m_normals[n0] * alpha) +
-                        (m_normals[n1] * beta) +
-                        (m_normals[n2] * gamma);
-        shadingNormal.normalize();
     }
-    else
-    {
-        // Use the geometric (flat-shaded) normal
-        shadingNormal = gnormal.normalized();
-    }
-    
-    intersection.m_t = t;
     intersection.m_pShape = this;
-    intersection.m_pMaterial = m_pMaterial;
-    intersection.m_normal = shadingNormal;
-    intersection.m_colorModifier = Color(1.0f);
-    
+    intersection.m_primID = m_leafTriangles[tri];
+    intersection.m_u = beta;
+    intersection.m_v = gamma;
     return true;
 }
 
-bool Polymesh::doesIntersectTri(unsigned int faceIndex, unsigned int tri, const Ray& ray)
+bool Polymesh::doesIntersectLeaf(const Ray& ray, const unsigned int *prims,
+                                 unsigned int firstSlot, unsigned int numPrims)
 {
-    unsigned int v0 = m_faces[faceIndex].m_vertexIndices[0];
-    unsigned int v1 = m_faces[faceIndex].m_vertexIndices[tri + 1];
-    unsigned int v2 = m_faces[faceIndex].m_vertexIndices[tri + 2];
-    
-    // Moller-Trumbore ray-triangle intersection test.  The point here is to
-    // find the barycentric coordinates of the triangle where the ray hits
-    // the plane the triangle lives in.  If the barycentric coordinates
-    // alpha, beta, gamma all add up to 1 (and each is in the 0.0 to 1.0
-    // range) then we have a valid intersection in the triangle.
-    
-    Vector v0To1 = m_vertices[v1] - m_vertices[v0];
-    Vector v0To2 = m_vertices[v2] - m_vertices[v0];
-    Vector gnormal = cross(v0To1, v0To2);
-    float det = -dot(ray.m_direction, gnormal);
-    if (det == 0.0f)
-        return false;
-    
-    Vector rOriginToV0 = m_vertices[v0] - ray.m_origin;
-    Vector rayVertCross = cross(ray.m_direction, rOriginToV0);
-    Vector rOriginToV1 = m_vertices[v1] - ray.m_origin;
-    float invDet = 1.0f / det;
-    
-    // Calculate barycentric gamma coord
-    float gamma = -dot(rOriginToV1, rayVertCross) * invDet;
-    if (gamma < 0.0f || gamma > 1.0f)
-        return false;
-    
-    Vector rOriginToV2 = m_vertices[v2] - ray.m_origin;
-    
-    // Calculate barycentric beta coord
-    float beta = dot(rOriginToV2, rayVertCross) * invDet;
-    if (beta < 0.0f || beta + gamma > 1.0f)
-        return false;
-    
-    float t = -dot(rOriginToV0, gnormal) * invDet;
-    if (t < kRayTMin || t >= ray.m_tMax)
-        return false;
-    
-    return true;
+    KernelRay kray = kernelRay(ray, Vector(0.0f, 0.0f, 0.0f));
+    return kernels().anyTriangle(m_leafTris, m_slotTriangles[firstSlot],
+                                 m_slotTriangles[firstSlot + numPrims],
+                                 kray, kRayTMin, ray.m_tMax);
 }
 
-} // namespace kt
\ No newline at end of file
+} // namespace kt
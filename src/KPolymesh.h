@@ -10,6 +10,7 @@
 #include "KSampler.h"
 #include "KAccelerator.h"
 #include "KShape.h"
+#include "KMeshCache.h"
 
 
 namespace kt{
@@ -25,9 +26,42 @@ struct Face
 };
 
 
+// Marks a triangle corner that has no normal index
+const unsigned int kNoNormal = 0xffffffffu;
+
+
+// Polygon faces all packed into a few flat arrays (what the file readers
+// produce, since a vector per face means an allocation per face).  Face i's
+// corners are [m_faceStarts[i], m_faceStarts[i + 1]) in m_vertexIndices, and
+// likewise in m_normalIndices, which is empty if no face has normals and
+// holds kNoNormal for the corners of those that don't.
+struct FaceList
+{
+    std::vector<unsigned int> m_faceStarts;
+    std::vector<unsigned int> m_vertexIndices;
+    std::vector<unsigned int> m_normalIndices;
+    
+    FaceList() : m_faceStarts(1, 0), m_vertexIndices(), m_normalIndices() { }
+    
+    size_t numFaces() const { return m_faceStarts.size() - 1; }
+};
+
+
 // Polygon mesh.  Faces may have 3 or more sides, but each face must be convex
 // (no holes or edges going back inside the hull at all).  Faces are triangulated
-// by making a triangle fan out from the first vertex.
+// by making a triangle fan out from the first vertex.  That happens once, when
+// the mesh is made; after that the mesh only deals in triangles, kept in flat
+// index arrays so tracing never has to chase pointers into per-face storage.
+//
+// Once the BVH is built, the triangles' corners and geometric normals get
+// copied out in the order the BVH leaves reference them, one array per
+// component.  A leaf's triangles are then a contiguous run of those arrays,
+// and get tested against a ray a whole SIMD packet at a time by the kernels
+// (see KKernels.h).
+//
+// A mesh read from a file can be saved to a mesh cache along with its BVH
+// (see KMeshCache.h); a mesh loaded from one comes with its BVH restored, and
+// prepare() only builds it again if the build method has changed since.
 class Polymesh : public Shape
 {
 public:
@@ -37,21 +71,59 @@ public:
          Material* pMaterial): 
          m_vertices(verts),
          m_normals(normals),
-         m_faces(faces),
+         m_triVertices(),
+         m_triNormals(),
+         m_faceTriangles(),
          m_pMaterial(pMaterial),
          m_bbox(),
          m_bvh(*this),
-         m_faceAreaCDF(),
-         m_totalArea(0.0f)
+         m_triangleAreas(),
+         m_triangleAreaTable(),
+         m_totalArea(0.0f),
+         m_slotTriangles(),
+         m_leafTriangles(),
+         m_cacheFilename(),
+         m_cacheSourceStamp()
     {
-        
+        triangulate(faces);
+    }
+    
+    Polymesh(const std::vector<Point>& verts,
+         const std::vector<Vector>& normals,
+         const FaceList& faces,
+         Material* pMaterial): 
+         m_vertices(verts),
+         m_normals(normals),
+         m_triVertices(),
+         m_triNormals(),
+         m_faceTriangles(),
+         m_pMaterial(pMaterial),
+         m_bbox(),
+         m_bvh(*this),
+         m_triangleAreas(),
+         m_triangleAreaTable(),
+         m_totalArea(0.0f),
+         m_slotTriangles(),
+         m_leafTriangles(),
+         m_cacheFilename(),
+         m_cacheSourceStamp()
+    {
+        triangulate(faces);
     }
     
     virtual ~Polymesh() { }
     
     void setMaterial(Material* pMaterial) { m_pMaterial = pMaterial; }
     
-    virtual bool intersect(Intersection& intersection);
+    // Have prepare() save the mesh to this cache file whenever it builds the
+    // BVH (the stamp is of the file the mesh was read from)
+    void setCacheFile(const std::string& cacheFilename, const MeshSourceStamp& sourceStamp)
+    {
+        m_cacheFilename = cacheFilename;
+        m_cacheSourceStamp = sourceStamp;
+    }
+    
+    virtual bool intersect(const Ray& ray, Intersection& intersection);
     
     virtual bool doesIntersect(const Ray& ray);
     
@@ -59,6 +131,10 @@ public:
     
     virtual void prepare();
     
+    virtual void setBVHBuildMethod(BVHBuildMethod method) { m_bvh.setBuildMethod(method); }
+    
+    virtual void setThreadPool(ThreadPool *pPool) { m_bvh.setThreadPool(pPool); }
+    
     // Given two random numbers between 0.0 and 1.0, find a location + surface
     // normal on the surface of the *light*.
     virtual bool sampleSurface(const Point& refPosition,
@@ -83,37 +159,86 @@ public:
         return 1.0f / m_totalArea;
     }
     
-    // Methods for BVH build
+    unsigned int numTriangles() const { return (unsigned int)(m_triVertices.size() / 3); }
+    
+    // A corner (0-2) of a triangle, in local space
+    const Point& triangleVertex(unsigned int tri, unsigned int corner) const
+    {
+        return m_vertices[m_triVertices[tri * 3 + corner]];
+    }
+    unsigned int numFaces()     const { return (unsigned int)(m_faceTriangles.size() - 1); }
+    
+    // Triangles made from a face are [faceTriangleBegin, faceTriangleEnd)
+    unsigned int faceTriangleBegin(unsigned int face) const { return m_faceTriangles[face]; }
+    unsigned int faceTriangleEnd(unsigned int face)   const { return m_faceTriangles[face + 1]; }
+    
+    // Methods for BVH build (the BVH elements are faces, so a quad still
+    // only costs one leaf slot)
     
-    virtual unsigned int numElements() const { return m_faces.size(); }
+    virtual unsigned int numElements() const { return numFaces(); }
     
     virtual BBox elementBBox(unsigned int index) const;
     
     virtual float elementArea(unsigned int index) const
     {
-        return m_faceAreaCDF[index + 1] - m_faceAreaCDF[index];
+        float area = 0.0f;
+        for (unsigned int tri = faceTriangleBegin(index); tri < faceTriangleEnd(index); ++tri)
+            area += m_triangleAreas[tri];
+        return area;
     }
     
     // Methods for BVH intersection
     
-    virtual bool intersect(Intersection& intersection, unsigned int index);
+    // (These only record the triangle hit and its barycentric coords in the
+    // intersection; intersect() fills in the rest for the nearest one)
+    bool intersectLeaf(const Ray& ray, Intersection& intersection, const unsigned int *prims,
+                       unsigned int firstSlot, unsigned int numPrims);
     
-    virtual bool doesIntersect(const Ray& ray, unsigned int index);
+    bool doesIntersectLeaf(const Ray& ray, const unsigned int *prims,
+                           unsigned int firstSlot, unsigned int numPrims);
 
 protected:
     std::vector<Point> m_vertices;
     std::vector<Vector> m_normals;
-    std::vector<Face> m_faces;
+    // Three vertex indices per triangle, and three normal indices per triangle
+    // (kNoNormal where the face had none; empty if no face had any)
+    std::vector<unsigned int> m_triVertices;
+    std::vector<unsigned int> m_triNormals;
+    // Where each face's triangles start, plus one past the last triangle
+    std::vector<unsigned int> m_faceTriangles;
     Material *m_pMaterial;
     BBox m_bbox;
     BVH<Polymesh> m_bvh;
-    std::vector<float> m_faceAreaCDF;
+    // Area of each triangle, and a table to pick triangles in proportion to
+    // it in constant time
+    std::vector<float> m_triangleAreas;
+    AliasTable m_triangleAreaTable;
     float m_totalArea;
     
-    bool intersectTri(unsigned int faceIndex, unsigned int tri, Intersection& intersection);
-    
-    bool doesIntersectTri(unsigned int faceIndex, unsigned int tri, const Ray& ray);
-
+    // Where each BVH slot's triangles start in leaf order, plus one past the
+    // end; the triangle each leaf-ordered one came from; and the leaf-ordered
+    // components (padded so a packet can always load kKernelWidth of them),
+    // along with where the kernels find them
+    std::vector<unsigned int> m_slotTriangles;
+    std::vector<unsigned int> m_leafTriangles;
+    std::vector<float> m_leafTriComponents[kNumLeafTriComponents];
+    LeafTriangles m_leafTris;
+    
+    // Where to save the mesh once the BVH is built (empty to not save it)
+    std::string m_cacheFilename;
+    MeshSourceStamp m_cacheSourceStamp;
+    
+    // Fan the faces out into triangles
+    void triangulate(const std::vector<Face>& faces);
+    void triangulate(const FaceList& faces);
+    
+    // Copy the triangles out in the BVH's leaf order
+    void buildLeafTriangles();
+    
+    // The mesh cache reads and writes our arrays directly
+    friend Polymesh* readMeshCache(const char *cacheFilename, const MeshSourceStamp& sourceStamp);
+    friend bool writeMeshCache(const char *cacheFilename, const MeshSourceStamp& sourceStamp,
+                               const Polymesh& mesh);
 };
 
 
@@ -61,6 +61,8 @@ struct Ray
     // The rotation quaternion should be normalized first before being used here!
     Ray transformToLocal(const Transform& txform) const
     {
+        if (txform.isIdentity())
+            return *this;
         return Ray(txform.toLocalPoint(m_time, m_origin), txform.toLocalVector(m_time, m_direction), m_tMax, m_time);
     }
     
@@ -77,48 +79,71 @@ struct Ray
 //
 // Intersection (results from casting a ray)
 //
+// While a ray is being traced, shapes only record the distance to the nearest
+// hit so far, which shape it's on, and which primitive of the shape (and
+// where on it; barycentric coords for triangles).  The surface attributes
+// (material, normal, ...) get filled in once a shape knows its nearest hit,
+// instead of for every closer candidate it runs across on the way there.
+// The ray isn't kept here; the hit position is ray.calculate(m_t) for
+// whatever ray was traced.
+//
 class Shape;
 class Material;
 
+// Marks an intersection that isn't on any particular primitive of its shape
+const unsigned int kNoPrimitive = 0xffffffffu;
+
 struct Intersection
 {
-    Ray m_ray;
     float m_t;
     Shape *m_pShape;
+    unsigned int m_primID;
+    float m_u, m_v;
+    
+    // Surface attributes at the hit
     Material *m_pMaterial;
     Color m_colorModifier;
     Vector m_normal;
     
     
     Intersection(): 
-              m_ray(),
               m_t(kRayTMax),
               m_pShape(NULL),
+              m_primID(kNoPrimitive),
+              m_u(0.0f),
+              m_v(0.0f),
               m_pMaterial(NULL),
               m_colorModifier(1.0f, 1.0f, 1.0f),
               m_normal(){ }
     
     Intersection(const Intersection& i): 
-                              m_ray(i.m_ray),
                               m_t(i.m_t),
                               m_pShape(i.m_pShape),
+                              m_primID(i.m_primID),
+                              m_u(i.m_u),
+                              m_v(i.m_v),
                               m_pMaterial(i.m_pMaterial),
                               m_colorModifier(i.m_colorModifier),
                               m_normal(i.m_normal){ }
     
-    Intersection(const Ray& ray): 
-                              m_ray(ray),
+    // Ready to trace the given ray (only hits out to its max count)
+    explicit Intersection(const Ray& ray): 
                               m_t(ray.m_tMax),
                               m_pShape(NULL),
+                              m_primID(kNoPrimitive),
+                              m_u(0.0f),
+                              m_v(0.0f),
                               m_pMaterial(NULL),
                               m_colorModifier(1.0f, 1.0f, 1.0f),
                               m_normal(){ }
     
     Intersection& operator =(const Intersection& i)
     {
-        m_ray = i.m_ray;
         m_t = i.m_t;
         m_pShape = i.m_pShape;
+        m_primID = i.m_primID;
+        m_u = i.m_u;
+        m_v = i.m_v;
         m_pMaterial = i.m_pMaterial;
         m_colorModifier = i.m_colorModifier;
         m_normal = i.m_normal;
@@ -127,7 +152,7 @@ struct Intersection
     
     bool intersected() const { return (m_pShape == NULL) ? false : true; }
     
-    Point position() const { return m_ray.calculate(m_t); }
+    Point position(const Ray& ray) const { return ray.calculate(m_t); }
 };
 
 
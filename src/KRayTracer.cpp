@@ -2,7 +2,12 @@
 #include <iostream>
 #include <sstream>
 #include <stdio.h>
+#include <cmath>
+#include <limits>
+#include <chrono>
 #include "KRayTracer.h"
+#include "KThreadPool.h"
+#include "KKernels.h"
 
 
 using namespace kt;
@@ -10,11 +15,19 @@ using namespace kt;
 
 namespace kt{
 
+// Russian roulette never kills paths with more than this probability; the
+// survivors would otherwise get boosted so much they turn into fireflies.
+const float kRouletteMinSurvival = 0.05f;
+
+// Renders with more samples per pixel than this don't bother with blue noise
+// (it's for low sample counts, and the pixels' blocks of the shared sample
+// sequences have to fit in 32 bit indices)
+const unsigned int kMaxBlueNoiseSamples = 1 << 16;
+
 Color pathTracer(const Ray& ray,
                  ShapeSet& scene,
-                 std::vector<Shape*>& lights,
-                 RNG& rng,
-                 SamplerSet& samplers,
+                 const LightSampler& lightSampler,
+                 const SamplerSet& samplers,
                  unsigned int pixelSampleIndex)
 {
     // Accumulate total incoming radiance in 'result'
@@ -30,11 +43,32 @@ Color pathTracer(const Ray& ray,
     size_t numBounces = 0;
     size_t numDiracBounces = 0;
     bool lastBounceDiracDistribution = false;
+    // When reusing the BRDF ray from the lighting MIS, this holds the first
+    // BRDF sample at the current bounce and what it ran into, so the next
+    // leg of the path doesn't have to be traced again
+    bool haveReusedSample = false;
+    bool reusedHit = false;
+    Intersection reusedIntersection;
+    Vector reusedIncoming;
+    float reusedBrdfPdf = 0.0f;
+    float reusedBrdfResult = 0.0f;
     while (numBounces < samplers.m_maxRayDepth)
     {
-        // Trace the ray to see if we hit anything
+        // Trace the ray to see if we hit anything (unless the lighting at the
+        // last bounce already did)
         Intersection intersection(currentRay);
-        if (!scene.intersect(intersection))
+        bool hit = false;
+        if (haveReusedSample)
+        {
+            intersection = reusedIntersection;
+            hit = reusedHit;
+            haveReusedSample = false;
+        }
+        else
+        {
+            hit = scene.intersect(currentRay, intersection);
+        }
+        if (!hit)
         {
             // No hit, return black (background)
             break;
@@ -49,7 +83,7 @@ Color pathTracer(const Ray& ray,
         }
         
         // Evaluate the material and intersection information at this bounce
-        Point position = intersection.position();
+        Point position = intersection.position(currentRay);
         Vector normal = intersection.m_normal;
         // Primary current ray come from camera, so in physical world, it is 
         // outgoing ray.
@@ -76,8 +110,6 @@ Color pathTracer(const Ray& ray,
         if (!lastBounceDiracDistribution)
         {
             Color lightResult = Color(0.0f, 0.0f, 0.0f);
-            float lightSelectionWeight = \
-                float(lights.size()) / samplers.m_numLightSamples;
             for (size_t lightSampleIndex = 0; 
                  lightSampleIndex < samplers.m_numLightSamples; ++lightSampleIndex)
             {
@@ -99,30 +131,39 @@ Color pathTracer(const Ray& ray,
                 // cost an extra shadow ray and evaluation, though, but it is
                 // generally such an improvement in quality that it is very much
                 // worth the overhead.
+                //
+                // Light samples come from one emitter at a time, picked by
+                // the light sampler; the chance of having picked it is part
+                // of the light sample's PDF.  BRDF samples count whichever
+                // light they run into, with the chance that the light sampler
+                // would have picked it for the light's side of the MIS.
                 
-                // Select a light randomly for this sample
+                // Select an emitter for this sample
                 unsigned int finalLightSampleIndex = pixelSampleIndex * \
                     samplers.m_numLightSamples + lightSampleIndex;
-                float liu = samplers.m_lightSelectionSamplers[numBounces]->sample1D(finalLightSampleIndex);
-                size_t lightIndex = (size_t)(liu * lights.size());
-                if (lightIndex >= lights.size())
-                    lightIndex = lights.size() - 1;
-                Light *pLightShape = (Light*) lights[lightIndex];
-                
-                // Ask the light for a random position/normal we can use for lighting
-                float lsu, lsv;
-                samplers.m_lightSamplers[numBounces]->sample2D(finalLightSampleIndex, lsu, lsv);
-                float leu = samplers.m_lightElementSamplers[numBounces]->sample1D(finalLightSampleIndex);
+                float liu = samplers.sample1D(kSampleLightSelection, numBounces, finalLightSampleIndex);
+                Light *pLightShape = NULL;
+                unsigned int emitter = 0;
+                float selectionPmf = 0.0f;
+                float lightPdf = 0.0f;
                 Point lightPoint;
                 Vector lightNormal;
-                float lightPdf = 0.0f;
-                pLightShape->sampleSurface(position,
-                                           normal,
-                                           ray.m_time,
-                                           lsu, lsv, leu,
-                                           lightPoint,
-                                           lightNormal,
-                                           lightPdf);
+                if (lightSampler.sample(position, normal, liu, pLightShape, emitter, selectionPmf))
+                {
+                    // Ask the emitter for a random position/normal we can use for lighting
+                    float lsu, lsv;
+                    samplers.sample2D(kSampleLight, numBounces, finalLightSampleIndex, lsu, lsv);
+                    float leu = samplers.sample1D(kSampleLightElement, numBounces, finalLightSampleIndex);
+                    pLightShape->sampleEmitter(emitter,
+                                               position,
+                                               normal,
+                                               ray.m_time,
+                                               lsu, lsv, leu,
+                                               lightPoint,
+                                               lightNormal,
+                                               lightPdf);
+                    lightPdf *= selectionPmf;
+                }
                 
                 if (lightPdf > 0.0f)
                 {
@@ -154,7 +195,7 @@ Color pathTracer(const Ray& ray,
                 
                 // Ask the BRDF for a sample direction
                 float bsu, bsv;
-                samplers.m_brdfSamplers[numBounces]->sample2D(finalLightSampleIndex, bsu, bsv);
+                samplers.sample2D(kSampleBrdf, numBounces, finalLightSampleIndex, bsu, bsv);
                 Vector brdfIncoming;
                 float brdfPdf = 0.0f;
                 float brdfResult = pBrdf->sampleSA(brdfIncoming,
@@ -163,20 +204,43 @@ Color pathTracer(const Ray& ray,
                                                    bsu,
                                                    bsv,
                                                    brdfPdf);
-                if (brdfPdf > 0.0f && brdfResult > 0.0f)
+                
+                // The first BRDF sample doubles as the next leg of the path
+                // when we're reusing it, so it gets traced no matter what it
+                // ends up contributing to the lighting here
+                bool reuseThisSample = samplers.m_reuseBrdfRay && lightSampleIndex == 0;
+                if (reuseThisSample)
+                {
+                    haveReusedSample = true;
+                    reusedIncoming = brdfIncoming;
+                    reusedBrdfPdf = brdfPdf;
+                    reusedBrdfResult = brdfResult;
+                    reusedHit = false;
+                }
+                if (brdfPdf > 0.0f && (brdfResult > 0.0f || reuseThisSample))
                 {
-                    Intersection shadowIntersection(Ray(position, -brdfIncoming, kRayTMax, ray.m_time));
-                    bool intersected = scene.intersect(shadowIntersection);
-                    if (intersected && shadowIntersection.m_pShape == pLightShape)
+                    Ray brdfRay(position, -brdfIncoming, kRayTMax, ray.m_time);
+                    Intersection shadowIntersection(brdfRay);
+                    bool intersected = scene.intersect(brdfRay, shadowIntersection);
+                    if (reuseThisSample)
+                    {
+                        reusedIntersection = shadowIntersection;
+                        reusedHit = intersected;
+                    }
+                    if (intersected && brdfResult > 0.0f && shadowIntersection.m_pShape->isLight())
                     {
                         // Ask the light what it thinks of this direction (for MIS)
-                        lightPdf = pLightShape->intersectPDF(shadowIntersection);
+                        Light *pHitLight = (Light*) shadowIntersection.m_pShape;
+                        unsigned int hitEmitter = pHitLight->emitterHit(shadowIntersection);
+                        lightPdf = pHitLight->emitterPDF(hitEmitter, brdfRay, shadowIntersection);
+                        if (lightPdf > 0.0f)
+                            lightPdf *= lightSampler.pmf(position, normal, pHitLight, hitEmitter);
                         if (lightPdf > 0.0f)
                         {
                             // BRDF chose the light, so let's add that
                             // contribution (mixed by MIS)
                             float misWeightBrdf = powerHeuristic(1, brdfPdf, 1, lightPdf);
-                            lightResult += pLightShape->emitted() * 
+                            lightResult += pHitLight->emitted() * 
                                            intersection.m_colorModifier * matColor * brdfResult *
                                            std::fabs(dot(-brdfIncoming, normal)) * misWeightBrdf /
                                            (brdfPdf * brdfWeight);
@@ -186,26 +250,37 @@ Color pathTracer(const Ray& ray,
             }
             
             // Average light samples
-            lightResult *= samplers.m_numLightSamples > 0 ? lightSelectionWeight : 0.0f;
+            lightResult *= samplers.m_numLightSamples > 0 ? 1.0f / samplers.m_numLightSamples : 0.0f;
             
             // Add direct lighting at this bounce (modified by how much the
             // previous bounces have dimmed it)
             result += throughput * lightResult;
         }
                 
-        // Sample the BRDF to find the direction the next leg of the path goes in
-        float brdfSampleU, brdfSampleV;
-        samplers.m_bounceSamplers[numBounces]->sample2D(pixelSampleIndex, 
-                                                        brdfSampleU, 
-                                                        brdfSampleV);
+        // Sample the BRDF to find the direction the next leg of the path goes
+        // in (or take the one the lighting already sampled and traced)
         Vector incoming;
         float incomingBrdfPdf = 0.0f;
-        float incomingBrdfResult = pBrdf->sampleSA(incoming,
-                                                   outgoing,
-                                                   normal,
-                                                   brdfSampleU,
-                                                   brdfSampleV,
-                                                   incomingBrdfPdf);
+        float incomingBrdfResult = 0.0f;
+        if (haveReusedSample)
+        {
+            incoming = reusedIncoming;
+            incomingBrdfPdf = reusedBrdfPdf;
+            incomingBrdfResult = reusedBrdfResult;
+        }
+        else
+        {
+            float brdfSampleU, brdfSampleV;
+            samplers.sample2D(kSampleBounce, numBounces, pixelSampleIndex,
+                              brdfSampleU,
+                              brdfSampleV);
+            incomingBrdfResult = pBrdf->sampleSA(incoming,
+                                                 outgoing,
+                                                 normal,
+                                                 brdfSampleU,
+                                                 brdfSampleV,
+                                                 incomingBrdfPdf);
+        }
 
         if (incomingBrdfPdf > 0.0f)
         {
@@ -223,6 +298,24 @@ Color pathTracer(const Ray& ray,
             break; // BRDF is zero, stop bouncing
         }
         
+        // Russian roulette: once the path is deep enough, randomly end it
+        // with a probability that grows as its throughput shrinks.  Paths
+        // that survive get their throughput boosted by the same amount, so
+        // on average the result is the same as tracing every path to the
+        // end, but we spend far fewer rays on paths that can barely
+        // contribute anything.
+        if (samplers.m_rouletteDepth > 0 &&
+            numBounces + 1 >= samplers.m_rouletteDepth &&
+            numBounces + 1 < samplers.m_maxRayDepth)
+        {
+            float survival = std::min(throughput.maxComponent(), samplers.m_rouletteMaxSurvival);
+            survival = std::max(survival, kRouletteMinSurvival);
+            float rouletteU = samplers.sample1D(kSampleRoulette, numBounces, pixelSampleIndex);
+            if (rouletteU >= survival)
+                break;
+            throughput /= survival;
+        }
+        
         numBounces++;
     }
     
@@ -232,50 +325,43 @@ Color pathTracer(const Ray& ray,
 
 void RenderTask::raytracing()
 {
-        // Random number generator (for random pixel positions, light positions, etc)
-        // We seed the generator for this render thread based on something that
-        // doesn't change, but gives us a good variable seed for each thread.
-        RNG rng(static_cast<unsigned int>(((m_xstart << 16) | m_xend) ^ m_xstart),
-                static_cast<unsigned int>(((m_ystart << 16) | m_yend) ^ m_ystart));
-        
         // The aspect ratio is used to make the image only get more zoomed in when
         // the height changes (and not the width)
         float aspectRatioXToY = float(m_pImage->width()) / float(m_pImage->height());
         
         SamplerSet samplers;
-        samplers.m_numLightSamples = m_lights.empty() ? 0 : m_lightSamplesHint * m_lightSamplesHint;
+        samplers.m_pixelSeed = 0;
+        samplers.m_zSamples = 0;
+        samplers.m_zFirstIndex = 0;
+        samplers.m_zLightFirstIndex = 0;
+        samplers.m_numLightSamples = m_lightSampler.empty() ? 0 : m_lightSamplesHint * m_lightSamplesHint;
         samplers.m_maxRayDepth = m_maxRayDepth;
+        samplers.m_rouletteDepth = m_settings.m_rouletteDepth;
+        samplers.m_rouletteMaxSurvival = m_settings.m_rouletteMaxSurvival;
+        samplers.m_reuseBrdfRay = m_settings.m_reuseBrdfRay;
+        unsigned int totalPixelSamples = m_xPixelSamples * m_yPixelSamples;
         
-        // Set up samplers for each of the ray bounces.  Each bounce will use
-        // the same sampler for all pixel samples in the pixel to reduce noise.
-        for (size_t i = 0; i < m_maxRayDepth; ++i)
+        // For blue noise, give every pixel a power-of-two block of the shared
+        // sequences with room for all its samples, in Z-order.  The layout
+        // repeats in square tiles small enough for the indices to fit in 32
+        // bits (with a tile at least 8 pixels across, or it isn't worth it).
+        unsigned int zBlock = 1, zLightBlock = 1, zTileMask = 0;
+        if (m_settings.m_blueNoise && m_renderPixelSamples > 0 && m_renderPixelSamples <= kMaxBlueNoiseSamples)
         {
-            samplers.m_bounceSamplers.push_back(new CorrelatedMultiJitterSampler(m_pixelSamplesHint,
-                                                                                 m_pixelSamplesHint,
-                                                                                 rng,
-                                                                                 rng.nextUInt32()));
-            samplers.m_lightSelectionSamplers.push_back(new CorrelatedMultiJitterSampler(m_pixelSamplesHint * m_lightSamplesHint *
-                                                                                         m_pixelSamplesHint * m_lightSamplesHint,
-                                                                                         rng,
-                                                                                         rng.nextUInt32()));
-            samplers.m_lightElementSamplers.push_back(new CorrelatedMultiJitterSampler(m_pixelSamplesHint * m_lightSamplesHint *
-                                                                                       m_pixelSamplesHint * m_lightSamplesHint,
-                                                                                       rng,
-                                                                                       rng.nextUInt32()));
-            samplers.m_lightSamplers.push_back(new CorrelatedMultiJitterSampler(m_pixelSamplesHint * m_lightSamplesHint,
-                                                                                m_pixelSamplesHint * m_lightSamplesHint,
-                                                                                rng,
-                                                                                rng.nextUInt32()));
-            samplers.m_brdfSamplers.push_back(new CorrelatedMultiJitterSampler(m_pixelSamplesHint * m_lightSamplesHint,
-                                                                               m_pixelSamplesHint * m_lightSamplesHint,
-                                                                               rng,
-                                                                               rng.nextUInt32()));
+            while (zBlock < m_renderPixelSamples)
+                zBlock <<= 1;
+            while (zLightBlock < m_renderPixelSamples * std::max(samplers.m_numLightSamples, 1u))
+                zLightBlock <<= 1;
+            unsigned int blockBits = 0;
+            while ((1u << blockBits) < zLightBlock)
+                blockBits++;
+            unsigned int tileBits = std::min(16u, (32 - blockBits) / 2);
+            if (tileBits >= 3)
+            {
+                samplers.m_zSamples = m_renderPixelSamples;
+                zTileMask = (1u << tileBits) - 1;
+            }
         }
-        // Set up samplers for each pixel sample
-        samplers.m_timeSampler = new CorrelatedMultiJitterSampler(m_pixelSamplesHint * m_pixelSamplesHint, rng, rng.nextUInt32());
-        samplers.m_lensSampler = new CorrelatedMultiJitterSampler(m_pixelSamplesHint, m_pixelSamplesHint, rng, rng.nextUInt32());
-        samplers.m_subpixelSampler = new CorrelatedMultiJitterSampler(m_pixelSamplesHint, m_pixelSamplesHint, rng, rng.nextUInt32());
-        unsigned int totalPixelSamples = samplers.m_subpixelSampler->total2DSamplesAvailable();
 
         // For each pixel row...
         for (size_t y = m_ystart; y < m_yend; ++y)
@@ -283,25 +369,40 @@ void RenderTask::raytracing()
             // For each pixel across the row...
             for (size_t x = m_xstart; x < m_xend; ++x)
             {
-                // Accumulate pixel color
+                // Adaptive sampling may have decided this pixel has enough
+                if (m_pImage->converged(x, y))
+                    continue;
+                
+                // Each pixel's samples depend on where it is, not on which
+                // bucket or thread renders it, and pick up the sequence where
+                // the pixel's earlier passes left off
+                samplers.m_pixelSeed = hashCombine(hashUInt32((unsigned int) x), (unsigned int) y);
+                unsigned int zPixel = mortonIndex((unsigned int) x & zTileMask, (unsigned int) y & zTileMask);
+                samplers.m_zFirstIndex = zPixel * zBlock;
+                samplers.m_zLightFirstIndex = zPixel * zLightBlock;
+                unsigned int firstSample = m_pImage->sampleCount(x, y);
+                
+                // Accumulate pixel color, and the squared luminance of each
+                // sample so the image can estimate the pixel's variance
                 Color pixelColor(0.0f, 0.0f, 0.0f);
+                float lumSquareSum = 0.0f;
                 // For each sample in the pixel...
-                for (size_t psi = 0; psi < totalPixelSamples; ++psi)
+                for (unsigned int psi = firstSample; psi < firstSample + totalPixelSamples; ++psi)
                 {
                     // Calculate a stratified random position within the pixel
                     // to hide aliasing
                     float pu, pv;
-                    samplers.m_subpixelSampler->sample2D(psi, pu, pv);
+                    samplers.sample2D(kSampleSubpixel, 0, psi, pu, pv);
                     float xu = (x + pu) / float(m_pImage->width());
                     // Flip pixel row to be in screen space (images are top-down)
                     float yu = 1.0f - (y + pv) / float(m_pImage->height());
                     
                     // Calculate a stratified random variation for depth-of-field
                     float lensU, lensV;
-                    samplers.m_lensSampler->sample2D(psi, lensU, lensV);
+                    samplers.sample2D(kSampleLens, 0, psi, lensU, lensV);
                     
                     // Grab a time for motion blur
-                    float timeU = samplers.m_timeSampler->sample1D(psi);
+                    float timeU = samplers.sample1D(kSampleTime, 0, psi);
                     
                     // Find where this pixel sample hits in the scene
                     Ray ray = m_camera.makeRay((xu - 0.5f) * aspectRatioXToY + 0.5f,
@@ -311,122 +412,280 @@ void RenderTask::raytracing()
                                                timeU);
                     
                     // Trace a path out, gathering estimated radiance along the path
-                    pixelColor += pathTracer(ray,
-                                             m_masterSet,
-                                             m_lights,
-                                             rng,
-                                             samplers,
-                                             psi);
-                }
-                // Divide by the number of pixel samples (a box pixel filter, essentially)
-                pixelColor /= totalPixelSamples;
-                
-                // Store off the computed pixel in a big buffer
-                m_pImage->pixel(x, y) = pixelColor;
-                
-                // Reset samplers for the next pixel sample
-                for (size_t i = 0; i < m_maxRayDepth; ++i)
-                {
-                    samplers.m_bounceSamplers[i]->refill(rng.nextUInt32());
-                    samplers.m_lightSelectionSamplers[i]->refill(rng.nextUInt32());
-                    samplers.m_lightElementSamplers[i]->refill(rng.nextUInt32());
-                    samplers.m_lightSamplers[i]->refill(rng.nextUInt32());
-                    samplers.m_brdfSamplers[i]->refill(rng.nextUInt32());
+                    Color sampleColor = pathTracer(ray,
+                                                   m_masterSet,
+                                                   m_lightSampler,
+                                                   samplers,
+                                                   psi);
+                    pixelColor += sampleColor;
+                    lumSquareSum += sampleColor.luminance() * sampleColor.luminance();
                 }
-                samplers.m_lensSampler->refill(rng.nextUInt32());
-                samplers.m_timeSampler->refill(rng.nextUInt32());
-                samplers.m_subpixelSampler->refill(rng.nextUInt32());
+                // Add the samples to the pixel's running total; the image
+                // divides by the sample count when it resolves (a box pixel
+                // filter, essentially)
+                m_pImage->addSamples(x, y, pixelColor, lumSquareSum, totalPixelSamples);
             }
         }
-        
-        // Deallocate all samplers
-        for (size_t i = 0; i < m_maxRayDepth; ++i)
+};
+
+// Split a per-pixel sample count into a nearly square x * y for the render
+// tasks (the samples themselves only care about the total, but a prime count
+// still ends up as a 1 x N pattern).
+static void factorPixelSamples(unsigned int numSamples,
+                               unsigned int& outXSamples,
+                               unsigned int& outYSamples)
+{
+    unsigned int xSamples = (unsigned int)std::sqrt(float(numSamples));
+    while (xSamples > 1 && numSamples % xSamples != 0)
+        xSamples--;
+    outXSamples = std::max(xSamples, 1u);
+    outYSamples = std::max(numSamples / outXSamples, 1u);
+}
+
+// Samples per pixel added by each adaptive pass after the first, unless the
+// settings ask for something else
+const unsigned int kAdaptivePassSamples = 4;
+
+// Below this luminance, adaptive sampling judges noise in absolute rather than
+// relative terms, so black pixels don't soak up the whole sample budget
+const float kAdaptiveMinLuminance = 0.05f;
+
+// Mark pixels whose estimate is good enough as converged, and collect the
+// buckets that still have noisy pixels in them.  A pixel has converged once
+// it has the minimum number of samples and the standard error of its mean
+// luminance is within the threshold (relative to the luminance itself).
+static size_t updateConvergence(Image *pImage,
+                                const std::vector<Bucket>& buckets,
+                                float errorThreshold,
+                                unsigned int minSamples,
+                                std::vector<Bucket>& outActiveBuckets)
+{
+    size_t activePixels = 0;
+    outActiveBuckets.clear();
+    for (size_t i = 0; i < buckets.size(); ++i)
+    {
+        const Bucket& bucket = buckets[i];
+        size_t activeInBucket = 0;
+        for (size_t y = bucket.m_ystart; y < bucket.m_yend; ++y)
         {
-            delete samplers.m_bounceSamplers[i];
-            delete samplers.m_lightSelectionSamplers[i];
-            delete samplers.m_lightElementSamplers[i];
-            delete samplers.m_lightSamplers[i];
-            delete samplers.m_brdfSamplers[i];
+            for (size_t x = bucket.m_xstart; x < bucket.m_xend; ++x)
+            {
+                if (pImage->converged(x, y))
+                    continue;
+                unsigned int count = pImage->sampleCount(x, y);
+                float mean = pImage->estimate(x, y).luminance();
+                float standardError = std::sqrt(pImage->variance(x, y) / std::max(count, 1u));
+                if (count >= minSamples &&
+                    standardError <= errorThreshold * std::max(mean, kAdaptiveMinLuminance))
+                {
+                    pImage->setConverged(x, y, true);
+                }
+                else
+                {
+                    activeInBucket++;
+                }
+            }
         }
-        delete samplers.m_lensSampler;
-        delete samplers.m_timeSampler;
-        delete samplers.m_subpixelSampler;
-};
+        if (activeInBucket > 0)
+            outActiveBuckets.push_back(bucket);
+        activePixels += activeInBucket;
+    }
+    return activePixels;
+}
 
 Image* rendering(ShapeSet& scene,
                  const Camera& camera,
                  Log& renderLog,
-                 size_t theads,
-                 size_t width,
-                 size_t height,
-                 unsigned int pixelSamplesHint,
-                 unsigned int lightSamplesHint,
-                 unsigned int maxRayDepth)
+                 const RenderSettings& settings,
+                 const PassCallback& passDone)
 {
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    
     // Get light list from the scene
     std::vector<Shape*> lights;
     renderLog.logging("\t\tfind lights");
     scene.findLights(lights);
-    renderLog.logging("\t\tscene prepare");    
+    
+    // Set up the worker threads; they stay alive for the whole render, and
+    // help get the scene ready before that
+    ThreadPool threadPool(settings.m_threads);
+    
+    char message[256];
+    snprintf(message, sizeof(message), "\t\tcpu kernels (%s; cpu has %s)",
+             kernels().m_name, cpuFeatures());
+    renderLog.logging(message);
+    
+    snprintf(message, sizeof(message), "\t\tscene prepare (%s bvh)",
+             bvhBuildMethodName(settings.m_bvhBuildMethod));
+    renderLog.logging(message);
+    std::chrono::steady_clock::time_point prepareStartTime = std::chrono::steady_clock::now();
+    scene.setBVHBuildMethod(settings.m_bvhBuildMethod);
+    scene.setThreadPool(&threadPool);
     scene.prepare();
+    scene.setThreadPool(NULL);
+    snprintf(message, sizeof(message), "\t\tscene prepared in %.3f s",
+             std::chrono::duration<double>(std::chrono::steady_clock::now() - prepareStartTime).count());
+    renderLog.logging(message);
+    
+    // Lights get chosen between by how much they put out (and with a light
+    // BVH, by where they are too), one emitter at a time
+    LightSampler lightSampler;
+    lightSampler.build(lights, settings.m_lightSelection);
+    snprintf(message, sizeof(message), "\t\tlight selection (%s, %u lights, %u emitters)",
+             lightSelectionName(lightSampler.selection()),
+             (unsigned int)lights.size(),
+             (unsigned int)lightSampler.numEmitters());
+    renderLog.logging(message);
     
     // Set up the output image
-    Image *pImage = new Image(width, height);
+    Image *pImage = new Image(settings.m_width, settings.m_height);
+    
+    // Chop the image into small buckets; they get dealt out to the workers
+    // at the start of every pass.  Buckets are small enough that there are
+    // many more of them than there are threads, so with work stealing every
+    // thread stays busy until the whole frame is done.
+    std::vector<Bucket> buckets;
+    makeBuckets(settings.m_width, settings.m_height,
+                settings.m_bucketSize, settings.m_bucketOrder, buckets);
     
-    // Set up render threads; we make as much as 16 chunks of the image that
-    // can render in parallel.
-    const size_t kChunkDim = theads;
+    // Work out how the samples get split into passes.  A regular render is
+    // just one big pass with all of the samples in it.  Adaptive renders are
+    // progressive too: a first pass of the minimum sample count everywhere,
+    // then small passes over whichever pixels are still noisy.
+    bool adaptive = settings.m_adaptiveThreshold > 0.0f;
+    bool progressive = settings.m_passSamples > 0 || adaptive;
+    unsigned int fullSamples = settings.m_pixelSamplesHint * settings.m_pixelSamplesHint;
+    unsigned int targetSamples = fullSamples;
+    unsigned int passSamples = fullSamples;
+    unsigned int firstPassSamples = fullSamples;
+    if (progressive)
+    {
+        passSamples = settings.m_passSamples > 0 ? settings.m_passSamples : kAdaptivePassSamples;
+        if (settings.m_targetSamples > 0)
+            targetSamples = settings.m_targetSamples;
+        else if (settings.m_timeBudget > 0.0f || adaptive)
+            targetSamples = std::numeric_limits<unsigned int>::max();
+        // Adaptive renders never go past the per-pixel maximum
+        if (adaptive)
+            targetSamples = std::min(targetSamples, std::max(settings.m_maxSamples, 1u));
+        firstPassSamples = adaptive ? std::max(settings.m_minSamples, 1u) : passSamples;
+    }
+    std::vector<Bucket> activeBuckets(buckets);
     
-    // Chunk size is the number of pixels per image chunk (we have to take care
-    // to deal with tiny images)
-    size_t xChunkSize = width >= kChunkDim ? width / kChunkDim : 1;
-    size_t yChunkSize = height >= kChunkDim ? height / kChunkDim : 1;
-    // Chunks are the number of chunks in each dimension we can chop the image
-    // into (again, taking care to deal with tiny images, and also images that
-    // don't divide clealy into 4 chunks)
-    size_t xChunks = width > kChunkDim ? width / xChunkSize : 1;
-    size_t yChunks = height > kChunkDim ? height / yChunkSize : 1;
-    if (xChunks * xChunkSize < width) xChunks++;
-    if (yChunks * yChunkSize < height) yChunks++;
+    // Blue noise has to know how many samples pixels will end up with
+    unsigned int renderPixelSamples =
+        targetSamples == std::numeric_limits<unsigned int>::max() ? 0 : targetSamples;
+    bool blueNoise = settings.m_blueNoise && renderPixelSamples > 0 &&
+                     renderPixelSamples <= kMaxBlueNoiseSamples;
+    if (settings.m_blueNoise && !blueNoise)
+        renderLog.logging("\t\tblue noise needs a set number of samples per pixel; rendering without it");
     
-    // Set up render threads
-    size_t numRenderThreads = xChunks * yChunks;
-    RenderTask **renderThreads = new RenderTask*[numRenderThreads];
+    snprintf(message, sizeof(message), "\t\tstart ray trace (%u threads, %u %s buckets, %s samples)",
+             (unsigned int)threadPool.numThreads(),
+             (unsigned int)buckets.size(),
+             bucketOrderName(settings.m_bucketOrder),
+             blueNoise ? "blue-noise" : "white-noise");
+    renderLog.logging(message);
     
-    // Launch render threads
-    renderLog.logging("\t\tstart ray trace");
-    for (size_t yc = 0; yc < yChunks; ++yc)
+    std::chrono::steady_clock::time_point traceStartTime = std::chrono::steady_clock::now();
+    unsigned int samplesSoFar = 0;
+    unsigned int passIndex = 0;
+    while (samplesSoFar < targetSamples)
     {
-        // Get the row start/end (making sure the last chunk doesn't go off the end)
-        size_t yStart = yc * yChunkSize;
-        size_t yEnd = std::min((yc + 1) * yChunkSize, height);
-        for (size_t xc = 0; xc < xChunks; ++xc)
+        // The last pass only takes what's left to reach the target
+        unsigned int thisPassSamples = std::min(passIndex == 0 ? firstPassSamples : passSamples,
+                                                targetSamples - samplesSoFar);
+        unsigned int xPixelSamples = settings.m_pixelSamplesHint;
+        unsigned int yPixelSamples = settings.m_pixelSamplesHint;
+        if (progressive)
+            factorPixelSamples(thisPassSamples, xPixelSamples, yPixelSamples);
+        
+        // Launch one worker per thread; each keeps rendering buckets until
+        // the scheduler runs out of them
+        BucketScheduler scheduler(activeBuckets, threadPool.numThreads());
+        for (size_t worker = 0; worker < scheduler.numWorkers(); ++worker)
         {
-            // Get the column start/end (making sure the last chunk doesn't go off the end)
-            size_t xStart = xc * xChunkSize;
-            size_t xEnd = std::min((xc + 1) * xChunkSize, width);
-            // Render the chunk!
-            renderThreads[yc * xChunks + xc] = new RenderTask(xStart,
-                                                              xEnd,
-                                                              yStart,
-                                                              yEnd,
-                                                              pImage,
-                                                              scene,
-                                                              camera,
-                                                              lights,
-                                                              pixelSamplesHint,
-                                                              lightSamplesHint,
-                                                              maxRayDepth);
-            renderThreads[yc * xChunks + xc]->raytracing();
+            threadPool.submit([&, worker]()
+            {
+                Bucket bucket;
+                while (scheduler.next(worker, bucket))
+                {
+                    // Render the bucket!
+                    RenderTask task(bucket.m_xstart,
+                                    bucket.m_xend,
+                                    bucket.m_ystart,
+                                    bucket.m_yend,
+                                    pImage,
+                                    scene,
+                                    camera,
+                                    lightSampler,
+                                    settings,
+                                    xPixelSamples,
+                                    yPixelSamples,
+                                    renderPixelSamples);
+                    task.raytracing();
+                }
+            });
+        }
+        
+        // Wait for every bucket to come back
+        threadPool.wait();
+        samplesSoFar += xPixelSamples * yPixelSamples;
+        passIndex++;
+        
+        if (!progressive)
+            break;
+        
+        // Pass boundary: the image is consistent, so resolve it and let the
+        // caller have a look
+        pImage->resolve();
+        float elapsed = std::chrono::duration<float>(std::chrono::steady_clock::now() - startTime).count();
+        if (adaptive)
+        {
+            size_t activePixels = updateConvergence(pImage,
+                                                    buckets,
+                                                    settings.m_adaptiveThreshold,
+                                                    settings.m_minSamples,
+                                                    activeBuckets);
+            snprintf(message, sizeof(message), "\t\tpass %u done (%u spp, %u pixels still noisy, %.1fs)",
+                     passIndex, samplesSoFar, (unsigned int)activePixels, elapsed);
+        }
+        else
+        {
+            snprintf(message, sizeof(message), "\t\tpass %u done (%u spp, %.1fs)",
+                     passIndex, samplesSoFar, elapsed);
+        }
+        renderLog.logging(message);
+        if (passDone)
+            passDone(pImage, passIndex, samplesSoFar);
+        
+        // Everything converged?  Then we're done early.
+        if (activeBuckets.empty())
+            break;
+        
+        // Stop if another pass (judging by how long they've taken so far)
+        // would run over the time budget
+        if (settings.m_timeBudget > 0.0f)
+        {
+            float traceTime = std::chrono::duration<float>(std::chrono::steady_clock::now() - traceStartTime).count();
+            if (elapsed + traceTime / passIndex > settings.m_timeBudget)
+                break;
         }
     }
     
-    // Clean up render thread objects
-    for (size_t i = 0; i < numRenderThreads; ++i)
+    // Put the final estimate in the pixels
+    pImage->resolve();
+    
+    if (adaptive)
     {
-        delete[] renderThreads[i];
+        double totalSamples = 0.0;
+        for (size_t y = 0; y < pImage->height(); ++y)
+            for (size_t x = 0; x < pImage->width(); ++x)
+                totalSamples += pImage->sampleCount(x, y);
+        snprintf(message, sizeof(message), "\t\tadaptive sampling averaged %.1f spp",
+                 totalSamples / std::max(size_t(1), pImage->width() * pImage->height()));
+        renderLog.logging(message);
     }
-    delete[] renderThreads;
     
     // Return a picture
     return pImage;
@@ -1,33 +1,117 @@
 #pragma once
 
+#include <functional>
+
 #include "KMathCore.h"
 #include "KMaterial.h"
 #include "KShape.h"
 #include "KLight.h"
+#include "KLightSampler.h"
 #include "KCamera.h"
 #include "KLog.h"
+#include "KBucket.h"
 
 namespace kt{
 
 //
-// Sampler container (for a given pixel, holds the samplers for all random features and bounces)
+// The random decisions made while tracing a path.  Each gets a sample
+// pattern of its own for every pixel, and the ones made at every bounce get a
+// separate one per bounce.
 //
-struct SamplerSet
+enum SampleDimension
 {
     // These are sampled once per pixel sample to start a path
-    Sampler* m_lensSampler;
-    Sampler* m_subpixelSampler;
-    Sampler* m_timeSampler;
+    kSampleSubpixel,
+    kSampleLens,
+    kSampleTime,
     // This is sampled once per bounce to determine the next leg of the path
-    std::vector<Sampler*> m_bounceSamplers;
+    kSampleBounce,
     // These are sampled N times per bounce (once for each light sample)
-    std::vector<Sampler*> m_lightSelectionSamplers;
-    std::vector<Sampler*> m_lightElementSamplers;
-    std::vector<Sampler*> m_lightSamplers;
-    std::vector<Sampler*> m_brdfSamplers;
+    kSampleLightSelection,
+    kSampleLightElement,
+    kSampleLight,
+    kSampleBrdf,
+    // This is sampled once per bounce to decide whether Russian roulette
+    // ends the path
+    kSampleRoulette,
+    kNumSampleDimensions
+};
+
+//
+// Sampler container (for a given pixel, hands out the samples for all random
+// features and bounces).  Samples are Owen-scrambled Sobol points, worked out
+// from the pixel's seed, the dimension and the sample index alone, so there
+// are no per-pixel sample patterns to build and no limit on how many samples
+// a pixel takes.
+//
+// Normally each pixel's seed comes from its position, so every pixel gets
+// unrelated sequences and the error from pixel to pixel is white noise.  For
+// blue noise, pixels instead share one sequence per dimension, each taking a
+// block of it in Z-order of the screen (a "Z-sampler").  Neighbouring pixels
+// then have neighbouring blocks, whose samples taken together are well
+// stratified as well, so their errors tend to cancel out: the error is high
+// frequency noise that denoising or downsampling mostly removes.  Every
+// pixel's own samples are as well stratified as before.  This needs to know
+// the samples per pixel up front; samples past that carry on with the
+// pixel's own sequences.  See "Screen-Space Blue-Noise Diffusion of Monte
+// Carlo Sampling Error via Hierarchical Ordering of Pixels", Ahmed and
+// Wonka, SIGGRAPH Asia 2020.
+//
+struct SamplerSet
+{
+    // Seed for the pixel being rendered
+    unsigned int m_pixelSeed;
+    // With blue noise, the pixel's first m_zSamples samples come from the
+    // shared sequences, starting at m_zFirstIndex (m_zLightFirstIndex for the
+    // dimensions sampled once per light sample); m_zSamples is 0 otherwise
+    unsigned int m_zSamples;
+    unsigned int m_zFirstIndex, m_zLightFirstIndex;
     
     unsigned int m_numLightSamples;
     unsigned int m_maxRayDepth;
+    // Russian roulette starts after this many bounces (0 turns it off), and
+    // never lets a path survive with more than the given probability
+    unsigned int m_rouletteDepth;
+    float m_rouletteMaxSurvival;
+    // Use the first BRDF sample of the lighting MIS as the next leg of the
+    // path instead of sampling and tracing a separate one
+    bool m_reuseBrdfRay;
+    
+    // Sample 'index' of a dimension's pattern at a bounce (bounce 0 for the
+    // ones that start a path)
+    float sample1D(SampleDimension dimension, size_t bounce, unsigned int index) const
+    {
+        unsigned int seed, sequenceIndex;
+        locate(dimension, bounce, index, seed, sequenceIndex);
+        return sobolSample1D(sequenceIndex, seed);
+    }
+    
+    void sample2D(SampleDimension dimension, size_t bounce, unsigned int index,
+                  float& outD1, float& outD2) const
+    {
+        unsigned int seed, sequenceIndex;
+        locate(dimension, bounce, index, seed, sequenceIndex);
+        sobolSample2D(sequenceIndex, seed, outD1, outD2);
+    }
+    
+    // Which sequence a sample comes from, and where in it
+    void locate(SampleDimension dimension, size_t bounce, unsigned int index,
+                unsigned int& outSeed, unsigned int& outSequenceIndex) const
+    {
+        unsigned int key = (unsigned int)(bounce * kNumSampleDimensions + dimension);
+        bool perLightSample = dimension >= kSampleLightSelection && dimension <= kSampleBrdf;
+        unsigned int zSamples = perLightSample ? m_zSamples * m_numLightSamples : m_zSamples;
+        if (index < zSamples)
+        {
+            outSeed = hashUInt32(key);
+            outSequenceIndex = (perLightSample ? m_zLightFirstIndex : m_zFirstIndex) + index;
+        }
+        else
+        {
+            outSeed = hashCombine(m_pixelSeed, key);
+            outSequenceIndex = index;
+        }
+    }
 };
 
 
@@ -35,28 +119,114 @@ struct SamplerSet
 // Ray tracing
 //
 // Path trace through the scene, starting with an initial ray.
-// Pass along scene information and various samplers so that we can reduce noise
-// along the way.
+// Pass along scene information and the pixel's samplers so that we can reduce
+// noise along the way.
 Color pathTracer(const Ray& ray,
                 ShapeSet& scene,
-                std::vector<Shape*>& lights,
-                RNG& rng,
-                SamplerSet& samplers,
+                const LightSampler& lightSampler,
+                const SamplerSet& samplers,
                 unsigned int pixelSampleIndex);
 
+//
+// Render settings (everything the command line can tweak about a render)
+//
+struct RenderSettings
+{
+    // Worker threads (0 means one per hardware thread)
+    size_t m_threads;
+    size_t m_width, m_height;
+    // Pixel samples are a hint^2 pattern per pixel; light samples are a
+    // hint^2 pattern per pixel sample
+    unsigned int m_pixelSamplesHint;
+    unsigned int m_lightSamplesHint;
+    unsigned int m_maxRayDepth;
+    size_t m_bucketSize;
+    BucketOrder m_bucketOrder;
+    
+    // Progressive rendering: when m_passSamples is non-zero the frame is
+    // rendered in passes of that many samples per pixel, accumulating into
+    // the image, until m_targetSamples per pixel are in or m_timeBudget
+    // seconds have gone by (zero disables either limit; with neither set the
+    // target is the pixelSamplesHint^2 of a regular render).
+    unsigned int m_passSamples;
+    unsigned int m_targetSamples;
+    float m_timeBudget;
+    
+    // Adaptive sampling: when m_adaptiveThreshold is non-zero, pixels stop
+    // taking samples once the standard error of their mean luminance drops
+    // below that fraction of the luminance (after at least m_minSamples),
+    // and no pixel takes more than m_maxSamples.
+    float m_adaptiveThreshold;
+    unsigned int m_minSamples;
+    unsigned int m_maxSamples;
+    
+    // Russian roulette: from bounce m_rouletteDepth on (zero disables it),
+    // paths survive with a probability that follows their throughput,
+    // capped at m_rouletteMaxSurvival.
+    unsigned int m_rouletteDepth;
+    float m_rouletteMaxSurvival;
+    
+    // Continue paths along the BRDF ray already traced for the MIS lighting
+    // estimate, saving one closest-hit ray per (non-specular) bounce.  The
+    // continuation then depends on the lighting sample, which can make the
+    // noise a little less even but doesn't bias anything.
+    bool m_reuseBrdfRay;
+    
+    // Spread the error between neighbouring pixels as blue noise rather than
+    // white noise, which makes low sample count renders easier to filter.
+    // Needs a known sample count, so it does nothing for renders that run
+    // until a time limit.
+    bool m_blueNoise;
+    
+    // How the scene's BVHs get built
+    BVHBuildMethod m_bvhBuildMethod;
+    
+    // How direct lighting chooses which light to sample
+    LightSelection m_lightSelection;
+    
+    RenderSettings():
+        m_threads(1),
+        m_width(512),
+        m_height(512),
+        m_pixelSamplesHint(3),
+        m_lightSamplesHint(1),
+        m_maxRayDepth(2),
+        m_bucketSize(32),
+        m_bucketOrder(kBucketSpiral),
+        m_passSamples(0),
+        m_targetSamples(0),
+        m_timeBudget(0.0f),
+        m_adaptiveThreshold(0.0f),
+        m_minSamples(16),
+        m_maxSamples(256),
+        m_rouletteDepth(0),
+        m_rouletteMaxSurvival(0.95f),
+        m_reuseBrdfRay(false),
+        m_blueNoise(false),
+        m_bvhBuildMethod(kBVHBuildSAH),
+        m_lightSelection(kLightSelectBVH) { }
+};
+
+// Called on the rendering thread after each progressive pass with the image
+// resolved to the current estimate, the pass just finished and the samples
+// per pixel accumulated so far.  It is safe to write the image out from here.
+typedef std::function<void(Image*, unsigned int, unsigned int)> PassCallback;
+
 Image* rendering(ShapeSet& scene,
                  const Camera& camera,
                  Log& renderLog,
-                 size_t theads,
-                 size_t width,
-                 size_t height,
-                 unsigned int pixelSamplesHint,
-                 unsigned int lightSamplesHint,
-                 unsigned int maxRayDepth);
+                 const RenderSettings& settings,
+                 const PassCallback& passDone = PassCallback());
 
 //
-// RenderTask works on a small chunk of the image
-// But currently kt-Renderer is not runing on muti-threads
+// RenderTask works on a small chunk of the image.  Tasks are run concurrently
+// on the render thread pool, so anything a task touches besides its own
+// samplers and pixels (the scene, light sampler, camera) must only be read.
+// Each task adds xPixelSamples * yPixelSamples samples to every pixel in its
+// chunk (the pixel sample hint in the settings is not used here), carrying on
+// from however many samples earlier passes already gave each pixel.  Blue
+// noise needs to know how many samples each pixel gets over the whole render
+// (0 if there's no telling).
 //
 class RenderTask
 {
@@ -65,14 +235,20 @@ public:
                Image *pImage,
                ShapeSet& masterSet,
                const Camera& cam,
-               std::vector<Shape*>& lights,
-               unsigned int pixelSamplesHint,
-               unsigned int lightSamplesHint,
-               unsigned int maxRayDepth):
+               const LightSampler& lightSampler,
+               const RenderSettings& settings,
+               unsigned int xPixelSamples,
+               unsigned int yPixelSamples,
+               unsigned int renderPixelSamples = 0):
           m_xstart(xstart), m_xend(xend), m_ystart(ystart), m_yend(yend),
-          m_pImage(pImage), m_masterSet(masterSet), m_camera(cam), m_lights(lights),
-          m_pixelSamplesHint(pixelSamplesHint), m_lightSamplesHint(lightSamplesHint),
-          m_maxRayDepth(maxRayDepth) { }
+          m_pImage(pImage), m_masterSet(masterSet), m_camera(cam), m_lightSampler(lightSampler),
+          m_settings(settings),
+          m_xPixelSamples(xPixelSamples), m_yPixelSamples(yPixelSamples),
+          m_lightSamplesHint(settings.m_lightSamplesHint),
+          m_maxRayDepth(settings.m_maxRayDepth),
+          m_renderPixelSamples(renderPixelSamples) { }
+
+    virtual ~RenderTask() { }
 
     virtual void raytracing();
 
@@ -81,10 +257,11 @@ private:
     Image *m_pImage;
     ShapeSet& m_masterSet;
     const Camera& m_camera;
-    std::vector<Shape*>& m_lights;
-    unsigned int m_pixelSamplesHint, m_lightSamplesHint;
+    const LightSampler& m_lightSampler;
+    const RenderSettings& m_settings;
+    unsigned int m_xPixelSamples, m_yPixelSamples, m_lightSamplesHint;
     unsigned int m_maxRayDepth;
+    unsigned int m_renderPixelSamples;
 };
 
 } // namespace kt
-
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Vector and Color math (KMathCore.h) uses SSE if the build asks for it with
+// -DKT_SIMD_MATH, and there is any
+#if defined(KT_SIMD_MATH) && !defined(__SSE2__)
+#undef KT_SIMD_MATH
+#endif
+
+
+namespace kt{
+
+// Code built for different instruction sets (see KKernels.h) sees different
+// lanes, so each set gets its own names for them
+#if defined(__AVX2__)
+inline namespace simd_avx2{
+#elif defined(__AVX__)
+inline namespace simd_avx{
+#elif defined(__SSE2__)
+inline namespace simd_sse2{
+#else
+inline namespace simd_generic{
+#endif
+
+//
+// SIMD lanes
+//
+// A handful of floats that get worked on together, one per lane: 8 with AVX,
+// 4 with SSE, and 4 done one at a time in plain C++ if we have neither.  This
+// is for "structure of arrays" data, where each lane is a different box or
+// triangle being tested against the same ray.
+//
+#if defined(__AVX__)
+const unsigned int kSIMDWidth = 8;
+#else
+const unsigned int kSIMDWidth = 4;
+#endif
+
+// Result of comparing lanes; each lane is either all true or all false
+struct SIMDMask
+{
+#if defined(__AVX__)
+    __m256 m_v;
+    explicit SIMDMask(__m256 v) : m_v(v) { }
+    // One bit per lane, lane 0 in the lowest bit
+    unsigned int bits() const { return (unsigned int) _mm256_movemask_ps(m_v); }
+    SIMDMask operator &(const SIMDMask& m) const { return SIMDMask(_mm256_and_ps(m_v, m.m_v)); }
+#elif defined(__SSE2__)
+    __m128 m_v;
+    explicit SIMDMask(__m128 v) : m_v(v) { }
+    unsigned int bits() const { return (unsigned int) _mm_movemask_ps(m_v); }
+    SIMDMask operator &(const SIMDMask& m) const { return SIMDMask(_mm_and_ps(m_v, m.m_v)); }
+#else
+    unsigned int m_bits;
+    explicit SIMDMask(unsigned int bits) : m_bits(bits) { }
+    unsigned int bits() const { return m_bits; }
+    SIMDMask operator &(const SIMDMask& m) const { return SIMDMask(m_bits & m.m_bits); }
+#endif
+};
+
+struct SIMDFloat
+{
+#if defined(__AVX__)
+    __m256 m_v;
+
+    SIMDFloat() { }
+    explicit SIMDFloat(__m256 v) : m_v(v) { }
+    // Same value in every lane
+    explicit SIMDFloat(float f) : m_v(_mm256_set1_ps(f)) { }
+
+    // Load/store kSIMDWidth floats (no alignment needed)
+    static SIMDFloat load(const float *p) { return SIMDFloat(_mm256_loadu_ps(p)); }
+    void store(float *p) const { _mm256_storeu_ps(p, m_v); }
+
+    SIMDFloat operator +(const SIMDFloat& f) const { return SIMDFloat(_mm256_add_ps(m_v, f.m_v)); }
+    SIMDFloat operator -(const SIMDFloat& f) const { return SIMDFloat(_mm256_sub_ps(m_v, f.m_v)); }
+    SIMDFloat operator *(const SIMDFloat& f) const { return SIMDFloat(_mm256_mul_ps(m_v, f.m_v)); }
+    SIMDFloat operator /(const SIMDFloat& f) const { return SIMDFloat(_mm256_div_ps(m_v, f.m_v)); }
+    // Flips the sign bit, so it's exact (unlike 0 - x, which turns 0 into +0)
+    SIMDFloat operator -() const { return SIMDFloat(_mm256_xor_ps(m_v, _mm256_set1_ps(-0.0f))); }
+
+    SIMDMask operator <(const SIMDFloat& f)  const { return SIMDMask(_mm256_cmp_ps(m_v, f.m_v, _CMP_LT_OQ)); }
+    SIMDMask operator <=(const SIMDFloat& f) const { return SIMDMask(_mm256_cmp_ps(m_v, f.m_v, _CMP_LE_OQ)); }
+    SIMDMask operator >=(const SIMDFloat& f) const { return SIMDMask(_mm256_cmp_ps(m_v, f.m_v, _CMP_GE_OQ)); }
+    SIMDMask operator !=(const SIMDFloat& f) const { return SIMDMask(_mm256_cmp_ps(m_v, f.m_v, _CMP_NEQ_OQ)); }
+#elif defined(__SSE2__)
+    __m128 m_v;
+
+    SIMDFloat() { }
+    explicit SIMDFloat(__m128 v) : m_v(v) { }
+    explicit SIMDFloat(float f) : m_v(_mm_set1_ps(f)) { }
+
+    static SIMDFloat load(const float *p) { return SIMDFloat(_mm_loadu_ps(p)); }
+    void store(float *p) const { _mm_storeu_ps(p, m_v); }
+
+    SIMDFloat operator +(const SIMDFloat& f) const { return SIMDFloat(_mm_add_ps(m_v, f.m_v)); }
+    SIMDFloat operator -(const SIMDFloat& f) const { return SIMDFloat(_mm_sub_ps(m_v, f.m_v)); }
+    SIMDFloat operator *(const SIMDFloat& f) const { return SIMDFloat(_mm_mul_ps(m_v, f.m_v)); }
+    SIMDFloat operator /(const SIMDFloat& f) const { return SIMDFloat(_mm_div_ps(m_v, f.m_v)); }
+    SIMDFloat operator -() const { return SIMDFloat(_mm_xor_ps(m_v, _mm_set1_ps(-0.0f))); }
+
+    SIMDMask operator <(const SIMDFloat& f)  const { return SIMDMask(_mm_cmplt_ps(m_v, f.m_v)); }
+    SIMDMask operator <=(const SIMDFloat& f) const { return SIMDMask(_mm_cmple_ps(m_v, f.m_v)); }
+    SIMDMask operator >=(const SIMDFloat& f) const { return SIMDMask(_mm_cmpge_ps(m_v, f.m_v)); }
+    SIMDMask operator !=(const SIMDFloat& f) const { return SIMDMask(_mm_cmpneq_ps(m_v, f.m_v)); }
+#else
+    float m_v[kSIMDWidth];
+
+    SIMDFloat() { }
+    explicit SIMDFloat(float f) { for (unsigned int i = 0; i < kSIMDWidth; ++i) m_v[i] = f; }
+
+    static SIMDFloat load(const float *p) { SIMDFloat r; for (unsigned int i = 0; i < kSIMDWidth; ++i) r.m_v[i] = p[i]; return r; }
+    void store(float *p) const { for (unsigned int i = 0; i < kSIMDWidth; ++i) p[i] = m_v[i]; }
+
+    SIMDFloat operator +(const SIMDFloat& f) const { SIMDFloat r; for (unsigned int i = 0; i < kSIMDWidth; ++i) r.m_v[i] = m_v[i] + f.m_v[i]; return r; }
+    SIMDFloat operator -(const SIMDFloat& f) const { SIMDFloat r; for (unsigned int i = 0; i < kSIMDWidth; ++i) r.m_v[i] = m_v[i] - f.m_v[i]; return r; }
+    SIMDFloat operator *(const SIMDFloat& f) const { SIMDFloat r; for (unsigned int i = 0; i < kSIMDWidth; ++i) r.m_v[i] = m_v[i] * f.m_v[i]; return r; }
+    SIMDFloat operator /(const SIMDFloat& f) const { SIMDFloat r; for (unsigned int i = 0; i < kSIMDWidth; ++i) r.m_v[i] = m_v[i] / f.m_v[i]; return r; }
+    SIMDFloat operator -() const { SIMDFloat r; for (unsigned int i = 0; i < kSIMDWidth; ++i) r.m_v[i] = -m_v[i]; return r; }
+
+    SIMDMask operator <(const SIMDFloat& f)  const { unsigned int b = 0; for (unsigned int i = 0; i < kSIMDWidth; ++i) b |= (m_v[i] < f.m_v[i] ? 1u : 0u) << i; return SIMDMask(b); }
+    SIMDMask operator <=(const SIMDFloat& f) const { unsigned int b = 0; for (unsigned int i = 0; i < kSIMDWidth; ++i) b |= (m_v[i] <= f.m_v[i] ? 1u : 0u) << i; return SIMDMask(b); }
+    SIMDMask operator >=(const SIMDFloat& f) const { unsigned int b = 0; for (unsigned int i = 0; i < kSIMDWidth; ++i) b |= (m_v[i] >= f.m_v[i] ? 1u : 0u) << i; return SIMDMask(b); }
+    SIMDMask operator !=(const SIMDFloat& f) const { unsigned int b = 0; for (unsigned int i = 0; i < kSIMDWidth; ++i) b |= (m_v[i] != f.m_v[i] ? 1u : 0u) << i; return SIMDMask(b); }
+#endif
+};
+
+// Lane-wise min/max.  If either lane is NaN these return the lane from the
+// *second* argument (like the SSE/AVX instructions do), so put the value you
+// want to survive a NaN second.
+inline SIMDFloat min(const SIMDFloat& a, const SIMDFloat& b)
+{
+#if defined(__AVX__)
+    return SIMDFloat(_mm256_min_ps(a.m_v, b.m_v));
+#elif defined(__SSE2__)
+    return SIMDFloat(_mm_min_ps(a.m_v, b.m_v));
+#else
+    SIMDFloat r;
+    for (unsigned int i = 0; i < kSIMDWidth; ++i) r.m_v[i] = a.m_v[i] < b.m_v[i] ? a.m_v[i] : b.m_v[i];
+    return r;
+#endif
+}
+
+inline SIMDFloat max(const SIMDFloat& a, const SIMDFloat& b)
+{
+#if defined(__AVX__)
+    return SIMDFloat(_mm256_max_ps(a.m_v, b.m_v));
+#elif defined(__SSE2__)
+    return SIMDFloat(_mm_max_ps(a.m_v, b.m_v));
+#else
+    SIMDFloat r;
+    for (unsigned int i = 0; i < kSIMDWidth; ++i) r.m_v[i] = a.m_v[i] > b.m_v[i] ? a.m_v[i] : b.m_v[i];
+    return r;
+#endif
+}
+
+} // inline namespace
+
+} // namespace kt
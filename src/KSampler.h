@@ -380,6 +380,218 @@ protected:
 };
 
 
+//
+// Owen-scrambled Sobol sampling
+//
+// Samples that are a pure function of a seed and a sample index: nothing is
+// stored, so there's nothing to allocate, refill or share between threads,
+// and there's no limit on the index.  These are the first two dimensions of
+// the Sobol sequence, with the index shuffled and the result Owen-scrambled
+// by hashing.  Every prefix of the sequence is well stratified (power-of-two
+// counts especially), so samples can be added a few at a time by progressive
+// or adaptive rendering and still land in the gaps left by earlier ones.
+//
+// Give each pixel and each random decision its own seed; the shuffle keeps
+// their patterns from lining up with each other.
+//
+// See "Practical Hash-based Owen Scrambling", Brent Burley, JCGT 9(4), 2020.
+//
+
+// Decent 32 bit integer hash (Chris Wellons' "lowbias32"), for making seeds
+inline unsigned int hashUInt32(unsigned int x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+inline unsigned int hashCombine(unsigned int seed, unsigned int value)
+{
+    return hashUInt32(seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+inline unsigned int reverseBits(unsigned int x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Owen scrambling of a 32 bit fraction: randomly flips each bit based only on
+// the bits above it, by running the reversed bits through a hash whose bits
+// only depend on the bits below them (Laine and Karras).  This is also how
+// the sample index gets shuffled.
+inline unsigned int nestedUniformScramble(unsigned int x, unsigned int seed)
+{
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverseBits(x);
+}
+
+// Sobol dimensions 0 and 1, as 32 bit fractions
+inline unsigned int sobolDimension0(unsigned int index)
+{
+    return reverseBits(index);
+}
+
+inline unsigned int sobolDimension1(unsigned int index)
+{
+    unsigned int result = 0;
+    for (unsigned int v = 0x80000000u; index != 0; index >>= 1, v ^= v >> 1)
+    {
+        if (index & 1)
+            result ^= v;
+    }
+    return result;
+}
+
+// 32 bit fraction to a float in [0, 1) (keeping only the bits a float can
+// hold, so it can't round up to 1)
+inline float fractionToFloat(unsigned int x)
+{
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+inline float sobolSample1D(unsigned int index, unsigned int seed)
+{
+    unsigned int shuffled = nestedUniformScramble(index, hashUInt32(seed));
+    return fractionToFloat(nestedUniformScramble(sobolDimension0(shuffled), hashCombine(seed, 1)));
+}
+
+inline void sobolSample2D(unsigned int index, unsigned int seed, float& outD1, float& outD2)
+{
+    unsigned int shuffled = nestedUniformScramble(index, hashUInt32(seed));
+    outD1 = fractionToFloat(nestedUniformScramble(sobolDimension0(shuffled), hashCombine(seed, 1)));
+    outD2 = fractionToFloat(nestedUniformScramble(sobolDimension1(shuffled), hashCombine(seed, 2)));
+}
+
+
+// Z-order (Morton) index of a pixel: the bits of x and y interleaved, so
+// every aligned 2x2, 4x4, 8x8... block of pixels gets a contiguous run of
+// indices.  Only the low 16 bits of x and y are used.
+inline unsigned int mortonIndex(unsigned int x, unsigned int y)
+{
+    x &= 0xffffu;
+    x = (x | (x << 8)) & 0x00ff00ffu;
+    x = (x | (x << 4)) & 0x0f0f0f0fu;
+    x = (x | (x << 2)) & 0x33333333u;
+    x = (x | (x << 1)) & 0x55555555u;
+    y &= 0xffffu;
+    y = (y | (y << 8)) & 0x00ff00ffu;
+    y = (y | (y << 4)) & 0x0f0f0f0fu;
+    y = (y | (y << 2)) & 0x33333333u;
+    y = (y | (y << 1)) & 0x55555555u;
+    return x | (y << 1);
+}
+
+
+//
+// Alias table (Walker's method, built with Vose's algorithm)
+//
+// Picks one of n items in proportion to the weights it was built with, in
+// constant time with a single random number: the number picks a slot, and
+// then which of the slot's two items it gets.
+//
+class AliasTable
+{
+public:
+    AliasTable() : m_slots(), m_totalWeight(0.0f) { }
+
+    // Negative weights count as zero; if all of them are zero, nothing can
+    // be picked
+    void build(const std::vector<float>& weights)
+    {
+        size_t n = weights.size();
+        m_slots.assign(n, Slot());
+        double total = 0.0;
+        for (size_t i = 0; i < n; ++i)
+            total += std::max(weights[i], 0.0f);
+        m_totalWeight = (float) total;
+        if (total <= 0.0)
+            return;
+
+        // Scale the weights so they average 1, then pair up each slot under
+        // that with one over it that tops it up
+        std::vector<double> scaled(n);
+        std::vector<unsigned int> under, over;
+        for (size_t i = 0; i < n; ++i)
+        {
+            m_slots[i].m_pmf = (float)(std::max(weights[i], 0.0f) / total);
+            scaled[i] = std::max(weights[i], 0.0f) * n / total;
+            if (scaled[i] < 1.0)
+                under.push_back((unsigned int) i);
+            else
+                over.push_back((unsigned int) i);
+        }
+        while (!under.empty() && !over.empty())
+        {
+            unsigned int small = under.back(), large = over.back();
+            under.pop_back();
+            m_slots[small].m_threshold = (float) scaled[small];
+            m_slots[small].m_alias = large;
+            scaled[large] -= 1.0 - scaled[small];
+            if (scaled[large] < 1.0)
+            {
+                over.pop_back();
+                under.push_back(large);
+            }
+        }
+        // Whatever's left is 1 give or take round-off (but never let
+        // round-off hand out an item that has no weight)
+        size_t heaviest = std::max_element(weights.begin(), weights.end()) - weights.begin();
+        for (size_t i = 0; i < under.size(); ++i)
+        {
+            bool weightless = weights[under[i]] <= 0.0f;
+            m_slots[under[i]].m_threshold = weightless ? 0.0f : 1.0f;
+            m_slots[under[i]].m_alias = (unsigned int) heaviest;
+        }
+        for (size_t i = 0; i < over.size(); ++i)
+            m_slots[over[i]].m_threshold = 1.0f;
+    }
+
+    size_t size() const { return m_slots.size(); }
+    bool empty() const { return m_totalWeight <= 0.0f; }
+    float totalWeight() const { return m_totalWeight; }
+
+    // Probability of picking an item
+    float pmf(size_t index) const { return m_slots[index].m_pmf; }
+
+    // Pick an item with u in [0, 1); don't call this on an empty table
+    size_t sample(float u, float& outPmf) const
+    {
+        float scaled = u * m_slots.size();
+        size_t slot = std::min((size_t) scaled, m_slots.size() - 1);
+        size_t index = scaled - slot < m_slots[slot].m_threshold ? slot : m_slots[slot].m_alias;
+        outPmf = m_slots[index].m_pmf;
+        return index;
+    }
+
+private:
+    struct Slot
+    {
+        // The slot keeps its own item when the leftover of u is under the
+        // threshold, and gives the alias otherwise
+        float m_threshold;
+        unsigned int m_alias;
+        float m_pmf;
+
+        Slot() : m_threshold(1.0f), m_alias(0), m_pmf(0.0f) { }
+    };
+
+    std::vector<Slot> m_slots;
+    float m_totalWeight;
+};
+
+
 //
 // Multiple importance sampling weightings
 //
@@ -525,6 +737,174 @@ inline float uniformConePdf(float cosThetaMax)
 }
 
 
+// Solid angle sampling of a rectangle: points on the rectangle spread evenly
+// over the directions it covers as seen from a viewer, so the PDF (with
+// respect to solid angle) is the same everywhere on it.  This beats picking
+// points evenly by area when the viewer is close to a big rectangle, where
+// the area PDF converted to solid angle varies a lot.  See "An Area-
+// Preserving Parametrization for Spherical Rectangles", Urena, Fajardo and
+// King, EGSR 2013.
+struct SphericalRectangle
+{
+    // Set up for a rectangle with a corner and two perpendicular sides, seen
+    // from the given point
+    SphericalRectangle(const Point& corner, const Vector& side1, const Vector& side2, const Point& viewer)
+        : m_viewer(viewer)
+    {
+        float length1 = side1.length(), length2 = side2.length();
+        m_x = side1 / length1;
+        m_y = side2 / length2;
+        m_z = cross(m_x, m_y);
+        // Local frame at the viewer, with the rectangle on the -z side
+        Vector d = corner - viewer;
+        m_z0 = dot(d, m_z);
+        if (m_z0 > 0.0f)
+        {
+            m_z *= -1.0f;
+            m_z0 *= -1.0f;
+        }
+        m_x0 = dot(d, m_x);
+        m_y0 = dot(d, m_y);
+        m_x1 = m_x0 + length1;
+        m_y1 = m_y0 + length2;
+        
+        // Normals of the planes through the viewer and each edge, and the
+        // interior angles between them; the solid angle is what the angles
+        // add up to past 2 pi
+        Vector v00(m_x0, m_y0, m_z0), v01(m_x0, m_y1, m_z0);
+        Vector v10(m_x1, m_y0, m_z0), v11(m_x1, m_y1, m_z0);
+        Vector n0 = cross(v00, v10).normalized();
+        Vector n1 = cross(v10, v11).normalized();
+        Vector n2 = cross(v11, v01).normalized();
+        Vector n3 = cross(v01, v00).normalized();
+        float g0 = std::acos(std::min(std::max(-dot(n0, n1), -1.0f), 1.0f));
+        float g1 = std::acos(std::min(std::max(-dot(n1, n2), -1.0f), 1.0f));
+        float g2 = std::acos(std::min(std::max(-dot(n2, n3), -1.0f), 1.0f));
+        float g3 = std::acos(std::min(std::max(-dot(n3, n0), -1.0f), 1.0f));
+        m_b0 = n0.z;
+        m_b1 = n2.z;
+        m_k = 2.0f * M_PI - g2 - g3;
+        m_solidAngle = m_z0 < 0.0f ? std::max(g0 + g1 - m_k, 0.0f) : 0.0f;
+    }
+    
+    float solidAngle() const { return m_solidAngle; }
+    
+    // Point on the rectangle for u1, u2 in [0, 1)
+    Point sample(float u1, float u2) const
+    {
+        // Pick the x coordinate so the part of the solid angle to its left
+        // is u1 of the total...
+        float au = u1 * m_solidAngle + m_k;
+        float fu = (std::cos(au) * m_b0 - m_b1) / std::sin(au);
+        float cu = std::min(std::max((fu > 0.0f ? 1.0f : -1.0f) / std::sqrt(fu * fu + m_b0 * m_b0), -1.0f), 1.0f);
+        float xu = -(cu * m_z0) / std::sqrt(std::max(1.0f - cu * cu, 1.0e-12f));
+        xu = std::min(std::max(xu, m_x0), m_x1);
+        // ...then y along that line, evenly in the sine of its elevation
+        float dist = std::sqrt(xu * xu + m_z0 * m_z0);
+        float h0 = m_y0 / std::sqrt(dist * dist + m_y0 * m_y0);
+        float h1 = m_y1 / std::sqrt(dist * dist + m_y1 * m_y1);
+        float hv = h0 + u2 * (h1 - h0);
+        float hv2 = hv * hv;
+        float yv = hv2 < 1.0f - 1.0e-6f ? hv * dist / std::sqrt(1.0f - hv2) : m_y1;
+        yv = std::min(std::max(yv, m_y0), m_y1);
+        return m_viewer + m_x * xu + m_y * yv + m_z * m_z0;
+    }
+    
+    Point m_viewer;
+    Vector m_x, m_y, m_z;
+    float m_x0, m_y0, m_z0, m_x1, m_y1;
+    float m_b0, m_b1, m_k;
+    float m_solidAngle;
+};
+
+
+// Solid angle sampling of a triangle, for the same reasons as the rectangle
+// above.  The direction is picked by first choosing the part of the spherical
+// triangle (cut off by an arc from its first corner) that holds the right
+// fraction of its area, then a point along the arc from the second corner
+// across it.  See "Stratified Sampling of Spherical Triangles", Arvo,
+// SIGGRAPH 1995.
+struct SphericalTriangle
+{
+    SphericalTriangle(const Point& p0, const Point& p1, const Point& p2, const Point& viewer)
+        : m_viewer(viewer), m_p0(p0), m_p1(p1), m_p2(p2),
+          m_alpha(0.0f), m_solidAngle(0.0f)
+    {
+        // Corners and edge plane normals on the unit sphere around the viewer
+        m_a = (p0 - viewer).normalized();
+        m_b = (p1 - viewer).normalized();
+        m_c = (p2 - viewer).normalized();
+        Vector nAB = cross(m_a, m_b), nBC = cross(m_b, m_c), nCA = cross(m_c, m_a);
+        if (nAB.normalize() <= 0.0f || nBC.normalize() <= 0.0f || nCA.normalize() <= 0.0f)
+            return;
+        // The solid angle is how far the interior angles add up past pi
+        m_alpha = angleBetween(nAB, -nCA);
+        float beta = angleBetween(nBC, -nAB);
+        float gamma = angleBetween(nCA, -nBC);
+        m_solidAngle = std::max(m_alpha + beta + gamma - (float) M_PI, 0.0f);
+    }
+
+    float solidAngle() const { return m_solidAngle; }
+
+    // Point on the triangle for u1, u2 in [0, 1)
+    Point sample(float u1, float u2) const
+    {
+        // Find where the arc from a has to meet the edge b-c to cut off u1
+        // of the area...
+        float phi = u1 * m_solidAngle + (float) M_PI - m_alpha;
+        float sinPhi = std::sin(phi), cosPhi = std::cos(phi);
+        float sinAlpha = std::sin(m_alpha), cosAlpha = std::cos(m_alpha);
+        float k1 = cosPhi + cosAlpha;
+        float k2 = sinPhi - sinAlpha * dot(m_a, m_b);
+        float cosB = (k2 + (k2 * cosPhi - k1 * sinPhi) * cosAlpha) /
+                     ((k2 * sinPhi + k1 * cosPhi) * sinAlpha);
+        cosB = std::min(std::max(cosB, -1.0f), 1.0f);
+        Vector cNew = m_a * cosB + perpendicular(m_c, m_a) * std::sqrt(std::max(1.0f - cosB * cosB, 0.0f));
+        // ...then go u2 of the way along the arc from b to that point
+        float cosTheta = 1.0f - u2 * (1.0f - dot(cNew, m_b));
+        float sinTheta = std::sqrt(std::max(1.0f - cosTheta * cosTheta, 0.0f));
+        Vector dir = m_b * cosTheta + perpendicular(cNew, m_b) * sinTheta;
+
+        // Where that direction hits the triangle, in barycentric coordinates
+        // (kept on the triangle, in case of round-off)
+        Vector e1 = m_p1 - m_p0, e2 = m_p2 - m_p0;
+        Vector s1 = cross(dir, e2);
+        float divisor = dot(s1, e1);
+        if (divisor == 0.0f)
+            return (m_p0 + m_p1 + m_p2) / 3.0f;
+        Vector s = m_viewer - m_p0;
+        float b1 = std::min(std::max(dot(s, s1) / divisor, 0.0f), 1.0f);
+        float b2 = std::min(std::max(dot(dir, cross(s, e1)) / divisor, 0.0f), 1.0f);
+        if (b1 + b2 > 1.0f)
+        {
+            float sum = b1 + b2;
+            b1 /= sum;
+            b2 /= sum;
+        }
+        return m_p0 + e1 * b1 + e2 * b2;
+    }
+
+    // Angle between unit vectors, accurate for small angles too
+    static float angleBetween(const Vector& v1, const Vector& v2)
+    {
+        if (dot(v1, v2) < 0.0f)
+            return (float) M_PI - 2.0f * std::asin(std::min((v1 + v2).length() * 0.5f, 1.0f));
+        return 2.0f * std::asin(std::min((v2 - v1).length() * 0.5f, 1.0f));
+    }
+
+    // The part of v at right angles to unit vector w, normalized
+    static Vector perpendicular(const Vector& v, const Vector& w)
+    {
+        return (v - w * dot(v, w)).normalized();
+    }
+
+    Point m_viewer, m_p0, m_p1, m_p2;
+    Vector m_a, m_b, m_c;
+    float m_alpha;
+    float m_solidAngle;
+};
+
+
 // Random point on a triangle, converted to barycentric alpha and beta (gamma is 1 - alpha - beta)
 inline void uniformToBarycentricTriangle(float u1, float u2, float& btu, float& btv)
 {
@@ -28,9 +28,11 @@ public:
           Transform& transform()       { return m_transform; }
     
     // Subclasses must implement this; this is the meat of ray tracing.
-    // The first version finds the nearest intersection, the second just tells
-    // us if the ray hits anything at all (generally used for shadow rays).
-    virtual bool intersect(Intersection& intersection) = 0;
+    // The first version finds the nearest intersection (closer than the one
+    // already in the intersection, if any) and fills in its surface
+    // attributes, the second just tells us if the ray hits anything at all
+    // (generally used for shadow rays).
+    virtual bool intersect(const Ray& ray, Intersection& intersection) = 0;
     virtual bool doesIntersect(const Ray& ray) = 0;
     
     // Get bbox of this shape (and its children)
@@ -42,6 +44,14 @@ public:
     // calls this on the scene root shape which will prep all of the shapes.
     virtual void prepare() { m_transform.prepare(); }
     
+    // Pick how this shape (and its children) build their BVHs, if they have
+    // any; call before prepare().
+    virtual void setBVHBuildMethod(BVHBuildMethod method) { }
+    
+    // Give prepare() a pool to spread its work across (or NULL to do it all
+    // on the calling thread).  The pool has to outlive the prepare() call.
+    virtual void setThreadPool(ThreadPool *pPool) { }
+    
     // Usually for lights: given two random numbers between 0.0 and 1.0, find a
     // location + surface normal on the surface, and return the PDF for how
     // likely the sample was (with respect to solid angle).  Return false if not
@@ -92,7 +102,7 @@ public:
     virtual float        elementArea(unsigned int) const { return 0; }
     
     // Methods for BVH intersection
-    virtual bool intersect(Intersection&, unsigned int)      { return false; }
+    virtual bool intersect(const Ray&, Intersection&, unsigned int) { return false; }
     virtual bool doesIntersect(const Ray& ray, unsigned int) { return false; }
     
 protected:
@@ -104,28 +114,27 @@ protected:
 class ShapeSet : public Shape
 {
 public:
-    ShapeSet() : Shape(), m_shapes(), m_infiniteShapes(), m_bvh(*this) { }
+    ShapeSet() : Shape(), m_shapes(), m_infiniteShapes(), m_bvh(*this), m_pThreadPool(NULL) { }
     
     virtual ~ShapeSet() { }
     
-    virtual bool intersect(Intersection& intersection)
+    virtual bool intersect(const Ray& ray, Intersection& intersection)
     {
         // Transform ray to local space for intersection
-        Ray nonLocalRay = intersection.m_ray;
-        intersection.m_ray = intersection.m_ray.transformToLocal(m_transform);
+        Ray localRay = ray.transformToLocal(m_transform);
         bool intersectedAny = false;
         for (std::vector<Shape*>::iterator iter = m_infiniteShapes.begin();
              iter != m_infiniteShapes.end();
              ++iter)
         {
             Shape *pShape = *iter;
-            if (pShape->intersect(intersection))
+            if (pShape->intersect(localRay, intersection))
                 intersectedAny = true;
         }
         
         if (m_shapes.size() > 2)
         {
-            if (m_bvh.intersect(intersection))
+            if (m_bvh.intersect(localRay, intersection))
                 intersectedAny = true;
         }
         else
@@ -135,14 +144,13 @@ public:
                  ++iter)
             {
                 Shape *pShape = *iter;
-                if (pShape->intersect(intersection))
+                if (pShape->intersect(localRay, intersection))
                     intersectedAny = true;
             }
         }
-        // Put ray back in non-local space, and patch up normal if we intersected
+        // Patch up normal to non-local space if we intersected
         if (intersectedAny)
-            intersection.m_normal = m_transform.fromLocalNormal(nonLocalRay.m_time, intersection.m_normal);
-        intersection.m_ray = nonLocalRay;
+            intersection.m_normal = m_transform.fromLocalNormal(ray.m_time, intersection.m_normal);
         return intersectedAny;
     }
     
@@ -177,24 +185,64 @@ public:
     virtual void prepare()
     {
         Shape::prepare();
+        // The shapes don't depend on each other, so they can all get ready at
+        // once (each big mesh building its BVH on its own thread, or several)
+        TaskGroup tasks(m_pThreadPool);
         for (std::vector<Shape*>::iterator iter = m_infiniteShapes.begin();
              iter != m_infiniteShapes.end();
              ++iter)
         {
             Shape *pShape = *iter;
-            pShape->prepare();
+            tasks.run([pShape]() { pShape->prepare(); });
         }
         for (std::vector<Shape*>::iterator iter = m_shapes.begin();
              iter != m_shapes.end();
              ++iter)
         {
             Shape *pShape = *iter;
-            pShape->prepare();
+            tasks.run([pShape]() { pShape->prepare(); });
         }
+        // Our own BVH needs all of their bboxes
+        tasks.wait();
         if (m_shapes.size() > 2)
             m_bvh.build();
     }
     
+    virtual void setBVHBuildMethod(BVHBuildMethod method)
+    {
+        m_bvh.setBuildMethod(method);
+        for (std::vector<Shape*>::iterator iter = m_infiniteShapes.begin();
+             iter != m_infiniteShapes.end();
+             ++iter)
+        {
+            (*iter)->setBVHBuildMethod(method);
+        }
+        for (std::vector<Shape*>::iterator iter = m_shapes.begin();
+             iter != m_shapes.end();
+             ++iter)
+        {
+            (*iter)->setBVHBuildMethod(method);
+        }
+    }
+    
+    virtual void setThreadPool(ThreadPool *pPool)
+    {
+        m_pThreadPool = pPool;
+        m_bvh.setThreadPool(pPool);
+        for (std::vector<Shape*>::iterator iter = m_infiniteShapes.begin();
+             iter != m_infiniteShapes.end();
+             ++iter)
+        {
+            (*iter)->setThreadPool(pPool);
+        }
+        for (std::vector<Shape*>::iterator iter = m_shapes.begin();
+             iter != m_shapes.end();
+             ++iter)
+        {
+            (*iter)->setThreadPool(pPool);
+        }
+    }
+    
     virtual BBox bbox()
     {
         // Compute combined bbox (in non-local space)
@@ -250,13 +298,37 @@ public:
     virtual float        elementArea(unsigned int index) const { return 1.0f / m_shapes[index]->surfaceAreaPDF(); }
     
     // Methods for BVH intersection
-    virtual bool intersect(Intersection& intersection, unsigned int index) { return m_shapes[index]->intersect(intersection); }
+    virtual bool intersect(const Ray& ray, Intersection& intersection, unsigned int index) { return m_shapes[index]->intersect(ray, intersection); }
     virtual bool doesIntersect(const Ray& ray, unsigned int index)         { return m_shapes[index]->doesIntersect(ray); }
     
+    bool intersectLeaf(const Ray& ray, Intersection& intersection, const unsigned int *prims,
+                       unsigned int firstSlot, unsigned int numPrims)
+    {
+        bool intersectAny = false;
+        for (unsigned int i = 0; i < numPrims; ++i)
+        {
+            if (intersect(ray, intersection, prims[i]))
+                intersectAny = true;
+        }
+        return intersectAny;
+    }
+    
+    bool doesIntersectLeaf(const Ray& ray, const unsigned int *prims,
+                           unsigned int firstSlot, unsigned int numPrims)
+    {
+        for (unsigned int i = 0; i < numPrims; ++i)
+        {
+            if (doesIntersect(ray, prims[i]))
+                return true;
+        }
+        return false;
+    }
+    
 protected:
     std::vector<Shape*> m_shapes;
     std::vector<Shape*> m_infiniteShapes;
     BVH<ShapeSet> m_bvh;
+    ThreadPool *m_pThreadPool;
 };
 
 
@@ -279,9 +351,9 @@ public:
     
     virtual ~Plane() { }
     
-    virtual bool intersect(Intersection& intersection)
+    virtual bool intersect(const Ray& ray, Intersection& intersection)
     {
-        Ray localRay = intersection.m_ray.transformToLocal(m_transform);
+        Ray localRay = ray.transformToLocal(m_transform);
         
         // Plane eqn: ax+by+cz+d=0; another way of writing it is: dot(n, p-p0)=0
         // where n=normal=(a,b,c), and p=(x,y,z), and p0 is position.  Now, p is
@@ -311,6 +383,7 @@ public:
         // This intersection is closer, so record it.
         intersection.m_t = t;
         intersection.m_pShape = this;
+        intersection.m_primID = kNoPrimitive;
         intersection.m_pMaterial = m_pMaterial;
         intersection.m_normal = m_transform.fromLocalNormal(localRay.m_time, m_normal);
         intersection.m_colorModifier = Color(1.0f, 1.0f, 1.0f);
@@ -390,12 +463,12 @@ public:
     
     void setMaterial(Material* pMaterial) { m_pMaterial = pMaterial; }
     
-    virtual bool intersect(Intersection& intersection)
+    virtual bool intersect(const Ray& ray, Intersection& intersection)
     {
         // Transform ray to local space.  Beyond the tranform, we have to move the
         // sphere center to the origin (and the ray along with it).   This makes
         // the intersection logic easier to follow to intersect a sphere at the origin.
-        Ray localRay = intersection.m_ray.transformToLocal(m_transform);
+        Ray localRay = ray.transformToLocal(m_transform);
         localRay.m_origin -= m_position;
         
         // Ray-sphere intersection can result in either zero, one or two points
@@ -454,6 +527,7 @@ public:
         Vector worldNorm = m_transform.fromLocalNormal(localRay.m_time, localNorm).normalized();
         
         intersection.m_pShape = this;
+        intersection.m_primID = kNoPrimitive;
         intersection.m_pMaterial = m_pMaterial;
         intersection.m_normal = worldNorm;
         intersection.m_colorModifier = Color(1.0f, 1.0f, 1.0f);
@@ -558,7 +632,7 @@ public:
         Ray localRay(localRefPosition, cone);
         Ray ray = localRay.transformFromLocal(m_transform);
         Intersection intersection(ray);
-        if (!intersect(intersection))
+        if (!intersect(ray, intersection))
         {
             intersection.m_t = dot(toCenter, cone);
         }
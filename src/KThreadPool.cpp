@@ -0,0 +1,192 @@
+
+#include <algorithm>
+
+#include "KThreadPool.h"
+
+
+namespace kt{
+
+ThreadPool::ThreadPool(size_t numThreads)
+    : m_workers(), m_jobs(), m_numPending(0), m_shutdown(false)
+{
+    if (numThreads == 0)
+        numThreads = hardwareThreads();
+    m_workers.reserve(numThreads);
+    for (size_t i = 0; i < numThreads; ++i)
+    {
+        m_workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    // Let the workers drain whatever is left in the queue, then send them home
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_shutdown = true;
+    }
+    m_jobAvailable.notify_all();
+    for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+        m_workers[i].join();
+    }
+}
+
+void ThreadPool::submit(const Job& job)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_jobs.push_back(job);
+        ++m_numPending;
+    }
+    m_jobAvailable.notify_one();
+}
+
+void ThreadPool::wait()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_numPending > 0)
+    {
+        m_jobsDone.wait(lock);
+    }
+}
+
+bool ThreadPool::runPendingJob()
+{
+    Job job;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_jobs.empty())
+            return false;
+        job = m_jobs.front();
+        m_jobs.pop_front();
+    }
+
+    job();
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        --m_numPending;
+        if (m_numPending == 0)
+            m_jobsDone.notify_all();
+    }
+    return true;
+}
+
+size_t ThreadPool::hardwareThreads()
+{
+    // hardware_concurrency() is allowed to return zero if it can't tell
+    size_t count = std::thread::hardware_concurrency();
+    return count > 0 ? count : 1;
+}
+
+void ThreadPool::workerLoop()
+{
+    for (;;)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (m_jobs.empty() && !m_shutdown)
+            {
+                m_jobAvailable.wait(lock);
+            }
+            if (m_jobs.empty())
+                return; // Shutting down and nothing left to do
+            job = m_jobs.front();
+            m_jobs.pop_front();
+        }
+
+        // Run the job without holding the lock so other workers can keep going
+        job();
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            --m_numPending;
+            if (m_numPending == 0)
+                m_jobsDone.notify_all();
+        }
+    }
+}
+
+
+
+TaskGroup::TaskGroup(ThreadPool *pPool)
+    : m_pPool(pPool), m_numPending(0)
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+    wait();
+}
+
+void TaskGroup::run(const Job& job)
+{
+    if (m_pPool == NULL)
+    {
+        job();
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        ++m_numPending;
+    }
+    m_pPool->submit([this, job]()
+    {
+        job();
+        // Notify with the lock held; as soon as the count hits zero the
+        // waiter is free to destroy the group
+        std::unique_lock<std::mutex> lock(m_mutex);
+        --m_numPending;
+        if (m_numPending == 0)
+            m_jobsDone.notify_all();
+    });
+}
+
+void TaskGroup::wait()
+{
+    if (m_pPool == NULL)
+        return;
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (m_numPending == 0)
+                return;
+        }
+        // Help out with whatever is queued (our jobs or anybody else's)
+        if (m_pPool->runPendingJob())
+            continue;
+        // Nothing queued, so the rest of our jobs are running on other
+        // threads; sleep until they're done
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_numPending > 0)
+        {
+            m_jobsDone.wait(lock);
+        }
+        return;
+    }
+}
+
+
+void parallelFor(ThreadPool *pPool,
+                 size_t begin,
+                 size_t end,
+                 size_t chunkSize,
+                 const std::function<void(size_t, size_t)>& body)
+{
+    if (chunkSize == 0)
+        chunkSize = 1;
+    TaskGroup tasks(pPool);
+    for (size_t chunkBegin = begin; chunkBegin < end; chunkBegin += chunkSize)
+    {
+        size_t chunkEnd = std::min(chunkBegin + chunkSize, end);
+        tasks.run([&body, chunkBegin, chunkEnd]() { body(chunkBegin, chunkEnd); });
+    }
+    tasks.wait();
+}
+
+} // namespace kt
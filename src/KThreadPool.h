@@ -0,0 +1,113 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+
+namespace kt{
+
+//
+// Thread pool
+//
+// A fixed set of worker threads that stay alive for as long as the pool does
+// and pull jobs off a shared queue.  Spinning up a thread is not free, so the
+// renderer makes one pool up front and pushes all of its work through it
+// instead of creating a thread for every chunk of the image.
+//
+// Jobs must not throw; there is nobody to catch the exception on the worker.
+class ThreadPool
+{
+public:
+    typedef std::function<void()> Job;
+
+    // Passing zero threads means "one per hardware thread"
+    explicit ThreadPool(size_t numThreads = 0);
+
+    ~ThreadPool();
+
+    size_t numThreads() const { return m_workers.size(); }
+
+    // Queue a job; one of the workers will pick it up as soon as it is free
+    void submit(const Job& job);
+
+    // Block the calling thread until every job submitted so far has finished
+    void wait();
+
+    // Take the oldest queued job (if there is one) and run it on the calling
+    // thread; returns false if the queue was empty.  This is how a thread
+    // that's waiting on other jobs can lend a hand instead of sitting idle.
+    bool runPendingJob();
+
+    // Number of hardware threads, never less than one
+    static size_t hardwareThreads();
+
+private:
+    std::vector<std::thread> m_workers;
+    std::deque<Job> m_jobs;
+    std::mutex m_mutex;
+    std::condition_variable m_jobAvailable;
+    std::condition_variable m_jobsDone;
+    // Jobs that are queued or currently running
+    size_t m_numPending;
+    bool m_shutdown;
+
+    void workerLoop();
+
+    // Not copyable
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator =(const ThreadPool&);
+};
+
+
+//
+// Task group
+//
+// A batch of related jobs on a pool that can be waited on by itself, without
+// waiting for everything else on the pool.  While waiting, the calling thread
+// runs queued jobs itself, so jobs can start task groups of their own and wait
+// on them (even with a single worker thread) without tying the pool up.
+//
+// With no pool the jobs just run right away on the calling thread.  The group
+// waits for its jobs before it goes away.
+class TaskGroup
+{
+public:
+    typedef ThreadPool::Job Job;
+
+    explicit TaskGroup(ThreadPool *pPool);
+
+    ~TaskGroup();
+
+    void run(const Job& job);
+
+    // Block until every job run through this group so far has finished,
+    // running other queued jobs in the meantime
+    void wait();
+
+private:
+    ThreadPool *m_pPool;
+    std::mutex m_mutex;
+    std::condition_variable m_jobsDone;
+    size_t m_numPending;
+
+    // Not copyable
+    TaskGroup(const TaskGroup&);
+    TaskGroup& operator =(const TaskGroup&);
+};
+
+
+// Run body(chunkBegin, chunkEnd) over [begin, end) cut into chunks of
+// chunkSize (the last one may be smaller), spreading the chunks across the
+// pool, and wait for them all.  Chunk i starts at begin + i * chunkSize, so
+// bodies can keep per-chunk results in an array.
+void parallelFor(ThreadPool *pPool,
+                 size_t begin,
+                 size_t end,
+                 size_t chunkSize,
+                 const std::function<void(size_t, size_t)>& body);
+
+} // namespace kt
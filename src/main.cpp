@@ -15,14 +15,29 @@ using namespace std;
 //
 static void usage(const char * const program) {
     fprintf(stderr, "usage: %s <command args ...>\n", "ktRender");
-    fprintf(stderr, "\t\t -s     scene sources \n");
-    fprintf(stderr, "\t\t -t     thread number \n");
+    fprintf(stderr, "\t\t -s     scene sources (.obj or .ply) \n");
+    fprintf(stderr, "\t\t -t     thread number (default 1, 0 for all cores) \n");
     fprintf(stderr, "\t\t -o     output file(.ppm) \n");
     fprintf(stderr, "\t\t -wd    width of output file  (default 512) \n");
     fprintf(stderr, "\t\t -ht    height of output file (default 512) \n");
     fprintf(stderr, "\t\t -rd    ray depth    (default 2) \n");
     fprintf(stderr, "\t\t -ps    pixle sample (default 3) \n");
     fprintf(stderr, "\t\t -ls    light sample (default 1) \n");
+    fprintf(stderr, "\t\t -bs    bucket size  (default 32) \n");
+    fprintf(stderr, "\t\t -bo    bucket order: scanline, spiral, hilbert (default spiral) \n");
+    fprintf(stderr, "\t\t -bvh   bvh build: sah, midpoint (default sah) \n");
+    fprintf(stderr, "\t\t -lsel  light selection: power, bvh (default bvh) \n");
+    fprintf(stderr, "\t\t -pp    progressive: samples per pixel per pass (default 0, off) \n");
+    fprintf(stderr, "\t\t -spp   progressive: stop at this many samples per pixel \n");
+    fprintf(stderr, "\t\t -tl    progressive: stop after this many seconds \n");
+    fprintf(stderr, "\t\t -ae    adaptive: relative noise threshold (default 0, off) \n");
+    fprintf(stderr, "\t\t -amin  adaptive: minimum samples per pixel (default 16) \n");
+    fprintf(stderr, "\t\t -amax  adaptive: maximum samples per pixel (default 256) \n");
+    fprintf(stderr, "\t\t -rr    russian roulette from this bounce on (default 0, off) \n");
+    fprintf(stderr, "\t\t -rrp   russian roulette: max survival probability (default 0.95) \n");
+    fprintf(stderr, "\t\t -rb    reuse the lighting BRDF ray for the next bounce, 0 or 1 (default 0) \n");
+    fprintf(stderr, "\t\t -bn    blue-noise sample decorrelation across pixels, 0 or 1 (default 0) \n");
+    fprintf(stderr, "\t\t -isa   cpu kernels: %s (default the best the cpu runs) \n", kernelNames());
     fprintf(stderr, "\t\t --help print help information! \n");
     fprintf(stderr, "\t kt-Renderer v0.20 by [Kevin Tsui] \n");
     exit(1);
@@ -37,11 +52,26 @@ int main(int argc, char *argv[]){
     const char *rayDepth = "2";
     const char *pixleSample = "5";
     const char *lightSample = "3";
+    const char *bucketSize = "32";
+    const char *bucketOrderArg = "spiral";
+    const char *bvhBuildArg = "sah";
+    const char *lightSelectionArg = "bvh";
+    const char *passSamples = "0";
+    const char *targetSamples = "0";
+    const char *timeLimit = "0";
+    const char *adaptiveThreshold = "0";
+    const char *minSamples = "16";
+    const char *maxSamples = "256";
+    const char *rouletteDepth = "0";
+    const char *rouletteSurvival = "0.95";
+    const char *reuseBrdfRay = "0";
+    const char *blueNoise = "0";
+    const char *isaArg = NULL;
 
     // chasing arguments
     if (argc == 1) usage(argv[0]);
     for (int i = 1; i < argc; i++) {
-        if (i > 14)
+        if (i > 46)
             printf("Too many arguments!");
         else if (strcmp(argv[i], "-s") == 0)
         {
@@ -75,12 +105,78 @@ int main(int argc, char *argv[]){
         {
             lightSample = argv[i + 1];i++;
         }
+        else if (strcmp(argv[i], "-bs") == 0)
+        {
+            bucketSize = argv[i + 1];i++;
+        }
+        else if (strcmp(argv[i], "-bo") == 0)
+        {
+            bucketOrderArg = argv[i + 1];i++;
+        }
+        else if (strcmp(argv[i], "-pp") == 0)
+        {
+            passSamples = argv[i + 1];i++;
+        }
+        else if (strcmp(argv[i], "-spp") == 0)
+        {
+            targetSamples = argv[i + 1];i++;
+        }
+        else if (strcmp(argv[i], "-tl") == 0)
+        {
+            timeLimit = argv[i + 1];i++;
+        }
+        else if (strcmp(argv[i], "-ae") == 0)
+        {
+            adaptiveThreshold = argv[i + 1];i++;
+        }
+        else if (strcmp(argv[i], "-amin") == 0)
+        {
+            minSamples = argv[i + 1];i++;
+        }
+        else if (strcmp(argv[i], "-amax") == 0)
+        {
+            maxSamples = argv[i + 1];i++;
+        }
+        else if (strcmp(argv[i], "-rr") == 0)
+        {
+            rouletteDepth = argv[i + 1];i++;
+        }
+        else if (strcmp(argv[i], "-rrp") == 0)
+        {
+            rouletteSurvival = argv[i + 1];i++;
+        }
+        else if (strcmp(argv[i], "-rb") == 0)
+        {
+            reuseBrdfRay = argv[i + 1];i++;
+        }
+        else if (strcmp(argv[i], "-bn") == 0)
+        {
+            blueNoise = argv[i + 1];i++;
+        }
+        else if (strcmp(argv[i], "-bvh") == 0)
+        {
+            bvhBuildArg = argv[i + 1];i++;
+        }
+        else if (strcmp(argv[i], "-lsel") == 0)
+        {
+            lightSelectionArg = argv[i + 1];i++;
+        }
+        else if (strcmp(argv[i], "-isa") == 0)
+        {
+            isaArg = argv[i + 1];i++;
+        }
         else if (strcmp(argv[i], "--help") == 0)
             usage(argv[0]); 
         else
             usage(argv[0]);
     }
 
+    if (isaArg != NULL && !selectKernels(isaArg))
+    {
+        fprintf(stderr, "no %s kernels this cpu can run (cpu has %s)\n", isaArg, cpuFeatures());
+        usage(argv[0]);
+    }
+
     Log renderLog;
     // printf("[%s] %s\n", "kt-Renderer v0.10 by [Kevin Tsui]");
     renderLog.logging("-- Render Start ----");
@@ -115,9 +211,11 @@ int main(int argc, char *argv[]){
     Sphere sphere3(Point(), 0.5f, &blueLambert);
     sphere3.transform().translate(0.0f, Vector(1.5f, -1.5f, 2.5f));
 
+    // Meshes get loaded across as many threads as we'll render with
+    ThreadPool *pLoadPool = new ThreadPool(atoi(threads));
     if (sources !=NULL)
     {
-        Polymesh* sourcesShape = readFromOBJFile(sources);
+        Polymesh* sourcesShape = readFromFile(sources, pLoadPool);
         sourcesShape->setMaterial(&basicLambert);
         sourcesShape->transform().translate(0.0f, Vector(0.0f, -2.0f, 0.0f));
         sourcesShape->transform().scale(0.0f, Vector(0.5f, 0.5f, 0.5f));
@@ -131,7 +229,8 @@ int main(int argc, char *argv[]){
         // masterSet.addShape(&sphere3);
     }
 
-    Polymesh* atangShape = readFromOBJFile("/home/xukai/Desktop/atang.obj");
+    Polymesh* atangShape = readFromOBJFile("/home/xukai/Desktop/atang.obj", pLoadPool);
+    delete pLoadPool;
     atangShape->setMaterial(&yellowGlossy);
     atangShape->transform().translate(0.0f, Vector(0.0f, -2.0f, 0.0f));
     atangShape->transform().scale(0.0f, Vector(0.5f, 0.5f, 0.5f));
@@ -175,25 +274,49 @@ int main(int argc, char *argv[]){
                               targetUpDirection,focalDistance, lensRadius,
                               shutterOpen, shutterClose);    
     // Ray trace!
-    size_t threadNumber = atoi(threads);
-    size_t imageWidth = atoi(width);
-    size_t imageHeight = atoi(height);
-    unsigned int pixelSamplesSpinBox = atoi(pixleSample);
-    unsigned int lightSamplesSpinBox = atoi(lightSample);
-    unsigned int rayDepthSpinBox = atoi(rayDepth);
+    RenderSettings settings;
+    settings.m_threads = atoi(threads);
+    settings.m_width = atoi(width);
+    settings.m_height = atoi(height);
+    settings.m_pixelSamplesHint = atoi(pixleSample);
+    settings.m_lightSamplesHint = atoi(lightSample);
+    settings.m_maxRayDepth = atoi(rayDepth);
+    settings.m_bucketSize = atoi(bucketSize);
+    if (!parseBucketOrder(bucketOrderArg, settings.m_bucketOrder))
+        usage(argv[0]);
+    if (!parseBVHBuildMethod(bvhBuildArg, settings.m_bvhBuildMethod))
+        usage(argv[0]);
+    if (!parseLightSelection(lightSelectionArg, settings.m_lightSelection))
+        usage(argv[0]);
+    settings.m_passSamples = atoi(passSamples);
+    settings.m_targetSamples = atoi(targetSamples);
+    settings.m_timeBudget = atof(timeLimit);
+    settings.m_adaptiveThreshold = atof(adaptiveThreshold);
+    settings.m_minSamples = atoi(minSamples);
+    settings.m_maxSamples = atoi(maxSamples);
+    settings.m_rouletteDepth = atoi(rouletteDepth);
+    settings.m_rouletteMaxSurvival = atof(rouletteSurvival);
+    settings.m_reuseBrdfRay = atoi(reuseBrdfRay) != 0;
+    settings.m_blueNoise = atoi(blueNoise) != 0;
 
+    // In progressive mode, write out the image at the end of every pass so
+    // there's always something to look at
+    PassCallback passDone;
+    if (settings.m_passSamples > 0 || settings.m_adaptiveThreshold > 0.0f)
+    {
+        passDone = [outfile](Image *pPassImage, unsigned int, unsigned int)
+        {
+            ppm_driver(pPassImage, outfile);
+        };
+    }
 
     renderLog.logging("Ray Tracing ...");
     Image *pImage = rendering(
                         masterSet,
                         camera,
                         renderLog,
-                        threadNumber,
-                        imageWidth,
-                        imageHeight,
-                        pixelSamplesSpinBox,
-                        lightSamplesSpinBox,
-                        rayDepthSpinBox);
+                        settings,
+                        passDone);
 
     renderLog.logging("Writing Output Image...");    
     // output images